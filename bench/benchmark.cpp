@@ -0,0 +1,385 @@
+﻿//
+// アニメーションとモデル変換のベンチマーク
+//   GLもウィンドウも使わないので、GPUの無い環境で実行できる
+//   合成したモデルで各処理の時間を測り、JSONで出力する
+//
+//   benchmark [--depth N] [--width N] [--bones N] [--meshes N] [--vertices N]
+//             [--influences N] [--keys N] [--duration SEC] [--iterations N] [--output PATH]
+//             [--check-alloc] [--check-texture]
+//
+//   --check-alloc   計測の代わりに、毎フレームの処理がヒープを使わないかを調べる
+//                   使っていれば終了コードが1
+//                   確保を数えるbenchmark_alloc(USE_ALLOC_TRACKINGを定義したビルド)でのみ使える
+//   --check-texture 計測の代わりに、テクスチャの圧縮とKTXの往復を調べる
+//                   コンテナが一致しないか、誤差が上限を超えれば終了コードが1
+//
+
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <functional>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "allocTracker.hpp"
+#include "model.hpp"
+#include "pose.hpp"
+#include "modelInstance.hpp"
+#include "posePipeline.hpp"
+#include "syntheticRig.hpp"
+#include "textureCheck.hpp"
+
+
+// 計算結果を捨てられないように書き込む先
+volatile float bench_sink;
+
+
+struct BenchResult {
+  std::string name;
+  size_t iterations;
+
+  // 1回あたりの時間(ミリ秒)
+  double min_ms;
+  double median_ms;
+  double mean_ms;
+};
+
+
+// 1回空実行してから、iterations回の時間を測る
+BenchResult runBench(const std::string& name, const size_t iterations, const std::function<void ()>& func) {
+  using Clock = std::chrono::steady_clock;
+
+  func();
+
+  std::vector<double> times;
+  times.reserve(iterations);
+  for (size_t i = 0; i < iterations; ++i) {
+    auto start = Clock::now();
+    func();
+    times.push_back(std::chrono::duration<double, std::milli>(Clock::now() - start).count());
+  }
+
+  std::sort(times.begin(), times.end());
+  double total = 0.0;
+  for (auto t : times) total += t;
+
+  return BenchResult{ name, iterations, times.front(), times[times.size() / 2], total / times.size() };
+}
+
+
+void writeJson(std::ostream& os, const RigSettings& settings, const std::vector<BenchResult>& results) {
+  os << "{\n"
+     << "  \"settings\": {\n"
+     << "    \"depth\": "       << settings.depth       << ",\n"
+     << "    \"width\": "       << settings.width       << ",\n"
+     << "    \"bones\": "       << settings.bones       << ",\n"
+     << "    \"meshes\": "      << settings.meshes      << ",\n"
+     << "    \"vertices\": "    << settings.vertices    << ",\n"
+     << "    \"influences\": "  << settings.influences  << ",\n"
+     << "    \"key_density\": " << settings.key_density << ",\n"
+     << "    \"duration\": "    << settings.duration    << "\n"
+     << "  },\n"
+     << "  \"results\": [\n";
+
+  for (size_t i = 0; i < results.size(); ++i) {
+    const auto& r = results[i];
+    os << "    { \"name\": \"" << r.name << "\""
+       << ", \"iterations\": " << r.iterations
+       << ", \"min_ms\": "     << r.min_ms
+       << ", \"median_ms\": "  << r.median_ms
+       << ", \"mean_ms\": "    << r.mean_ms
+       << " }" << ((i + 1 < results.size()) ? "," : "") << "\n";
+  }
+
+  os << "  ]\n"
+     << "}\n";
+}
+
+
+// 定常状態の再生でヒープを使っていないか調べる
+//   描画スレッドでのアニメーション適用と、計算スレッドでの群衆の姿勢の計算を交互におこない
+//   最初の数フレームで容量を確保した後は、全スレッドで1回でも確保したら失敗
+bool checkSteadyAllocation(Model& model, const ModelAssetRef& asset, const size_t frames) {
+  const size_t warmup_frames = 10;
+  const size_t crowd_num     = 16;
+
+  PoseSimulator sim;
+  setPoseAsset(sim, asset);
+  startPoseSimulator(sim);
+
+  // 遠くのインスタンスほど粗いLODにする
+  std::vector<u_int> lods(crowd_num);
+  for (size_t i = 0; i < crowd_num; ++i) {
+    lods[i] = u_int(i * SKELETON_LOD_NUM / crowd_num);
+  }
+
+  Pose pose;
+  double time = 0.0;
+  size_t failed_frames = 0;
+  AllocStats total{ 0, 0 };
+
+  for (size_t frame = 0; frame < warmup_frames + frames; ++frame) {
+    const auto begin = getAllocStats();
+    time += 1.0 / 60.0;
+
+    updateModel(model, time, 0);
+    capturePose(model, pose);
+
+    requestPoses(sim, time, crowd_num, true, 30.0, lods);
+    waitPoseSimulator(sim);
+    acquirePoses(sim);
+
+    // カリングで使うAABB
+    const auto& poses = getFrontPoses(sim).poses;
+    for (size_t i = 0; i < poses.size(); ++i) {
+      for (const auto& node : asset->model.node_list) {
+        for (const auto& ref : node->mesh) {
+          const auto& mesh = asset->model.mesh[ref.index];
+          if (!mesh.has_bone) continue;
+          bench_sink = calcSkinnedAABB(mesh, &poses[i].palette[ref.palette_offset]).getMin().x;
+        }
+      }
+    }
+
+    const auto used = getAllocStats() - begin;
+    if ((frame < warmup_frames) || (used.count == 0)) continue;
+
+    std::cerr << "frame " << frame << ": allocations " << used.count << " bytes " << used.bytes << std::endl;
+    failed_frames += 1;
+    total.count += used.count;
+    total.bytes += used.bytes;
+  }
+
+  stopPoseSimulator(sim);
+
+  std::cout << "Steady-state frames:" << frames
+            << " allocating frames:" << failed_frames
+            << " allocations:" << total.count
+            << " bytes:" << total.bytes << std::endl;
+
+  return failed_frames == 0;
+}
+
+
+int main(int argc, char* argv[]) {
+  RigSettings settings;
+  size_t iterations = 50;
+  std::string output;
+  bool check_alloc = false;
+  bool check_texture = false;
+
+  for (int i = 1; i < argc; ++i) {
+    std::string key = argv[i];
+    if (key == "--check-alloc") {
+      check_alloc = true;
+      continue;
+    }
+    if (key == "--check-texture") {
+      check_texture = true;
+      continue;
+    }
+
+    if (i + 1 >= argc) {
+      std::cerr << "Missing value:" << key << std::endl;
+      return 1;
+    }
+    std::string value = argv[++i];
+
+    if      (key == "--depth")      settings.depth       = std::atoi(value.c_str());
+    else if (key == "--width")      settings.width       = std::atoi(value.c_str());
+    else if (key == "--bones")      settings.bones       = std::atoi(value.c_str());
+    else if (key == "--meshes")     settings.meshes      = std::atoi(value.c_str());
+    else if (key == "--vertices")   settings.vertices    = std::atoi(value.c_str());
+    else if (key == "--influences") settings.influences  = std::atoi(value.c_str());
+    else if (key == "--keys")       settings.key_density = std::atof(value.c_str());
+    else if (key == "--duration")   settings.duration    = std::atof(value.c_str());
+    else if (key == "--iterations") iterations           = size_t(std::max(std::atoi(value.c_str()), 1));
+    else if (key == "--output")     output               = value;
+    else {
+      std::cerr << "Unknown option:" << key << std::endl;
+      return 1;
+    }
+  }
+
+#if !defined (USE_ALLOC_TRACKING)
+  // 計測用のビルドは確保を数えない
+  if (check_alloc) {
+    std::cerr << "--check-alloc needs benchmark_alloc" << std::endl;
+    return 1;
+  }
+#else
+  // 確保を数えるビルドで測ると、全ての確保にカウンタの更新が加わる
+  if (!check_alloc && !check_texture) {
+    std::cerr << "benchmark_alloc is for --check-alloc; use benchmark for timings" << std::endl;
+    return 1;
+  }
+#endif
+
+  // 変換中のログは出さない
+  setLogLevel(LOG_NONE);
+
+  if (check_texture) {
+    auto path = (ci::fs::temp_directory_path() / "SkeletalBenchmark.ktx").string();
+    return checkTextureRoundTrip(path) ? 0 : 1;
+  }
+
+  auto scene = createRigScene(settings);
+  auto prepareModel = [&scene]() {
+    auto model = createModel(scene.get());
+    model.aabb = calcAABB(model);
+    setupPalette(model);
+    return model;
+  };
+
+  // ノードを書き換える処理はmodelで、インスタンスの処理はassetで測る
+  auto model = prepareModel();
+  auto asset = createModelAsset(prepareModel());
+
+  if (check_alloc) {
+    return checkSteadyAllocation(model, asset, iterations) ? 0 : 1;
+  }
+
+  std::vector<BenchResult> results;
+
+  results.push_back(runBench("createModel", std::max(iterations / 10, size_t(1)), [&]() {
+        auto created = createModel(scene.get());
+        bench_sink = float(created.mesh.size());
+      }));
+
+#if defined (USE_COOKED_MODEL)
+  {
+    auto path      = (ci::fs::temp_directory_path() / "SkeletalBenchmark.cooked").string();
+    auto clip_path = getCookedClipPath(path);
+    uint64_t hash = 0;
+
+    results.push_back(runBench("writeCookedModel", std::max(iterations / 10, size_t(1)), [&]() {
+          std::vector<uint64_t> clip_offsets;
+          writeCookedClips(*model.clips, clip_path, hash, clip_offsets);
+          writeCookedModel(model, path, hash, clip_offsets);
+        }));
+    results.push_back(runBench("readCookedModel", std::max(iterations / 10, size_t(1)), [&]() {
+          Model cooked;
+          readCookedModel(cooked, path, clip_path, hash);
+        }));
+
+    {
+      // 毎回捨ててからクリップファイルを読む
+      Model cooked;
+      if (readCookedModel(cooked, path, clip_path, hash) && !cooked.animation.empty()) {
+        results.push_back(runBench("loadClip", iterations, [&]() {
+              setClipBudget(*cooked.clips, 0);
+              auto clip = acquireClip(*cooked.clips, 0);
+              bench_sink = clip ? float(clip->body.size()) : 0.0f;
+            }));
+      }
+    }
+
+    std::remove(path.c_str());
+    std::remove(clip_path.c_str());
+  }
+#endif
+
+  results.push_back(runBench("normalizeMeshWeight", iterations, [&]() {
+        normalizeMeshWeight(model);
+      }));
+
+  // 合成したモデルのクリップはキーを全て持っている
+  auto clip = acquireClip(*model.clips, 0);
+
+  {
+    // 1回で全チャンネルをキーの数だけ引く
+    const auto& anim = *clip;
+
+    results.push_back(runBench("getLerpValue(vec3)", iterations, [&]() {
+          ci::vec3 sum;
+          for (const auto& body : anim.body) {
+            for (size_t i = 0; i < body.translate.size(); ++i) {
+              sum += getLerpValue(anim.duration * i / body.translate.size(), body.translate);
+            }
+          }
+          bench_sink = sum.x;
+        }));
+    results.push_back(runBench("getLerpValue(quat)", iterations, [&]() {
+          ci::quat sum;
+          for (const auto& body : anim.body) {
+            for (size_t i = 0; i < body.rotation.size(); ++i) {
+              sum = sum * getLerpValue(anim.duration * i / body.rotation.size(), body.rotation);
+            }
+          }
+          bench_sink = sum.w;
+        }));
+  }
+
+  {
+    double time = 0.0;
+    results.push_back(runBench("updateNodeMatrix", iterations, [&]() {
+          time += 1.0 / 60.0;
+          updateNodeMatrix(model.animation[0], *clip, std::fmod(time, model.animation[0].duration));
+        }));
+  }
+
+  results.push_back(runBench("updateNodeDerivedMatrix", iterations, [&]() {
+        updateNodeDerivedMatrix(model.node, ci::mat4());
+      }));
+
+  results.push_back(runBench("updateMesh", iterations, [&]() {
+        updateMesh(model);
+      }));
+
+  {
+    double time = 0.0;
+    results.push_back(runBench("updateModel", iterations, [&]() {
+          time += 1.0 / 60.0;
+          updateModel(model, time, 0);
+        }));
+  }
+
+  {
+    Pose pose;
+    results.push_back(runBench("capturePose", iterations, [&]() {
+          capturePose(model, pose);
+        }));
+  }
+
+  // スケルトンのLODごと
+  for (u_int lod = 0; lod < SKELETON_LOD_NUM; ++lod) {
+    double time = 0.0;
+    auto instance = createModelInstance(asset);
+    instance.lod = lod;
+    auto clip = acquireInstanceClip(instance);
+    std::string name = lod ? "updateModelInstance LOD" + std::to_string(lod) : "updateModelInstance";
+    results.push_back(runBench(name, iterations, [&]() {
+          time += 1.0 / 60.0;
+          updateModelInstance(instance, time, clip.get());
+        }));
+  }
+
+  // 60fpsで表示して30Hzで計算する(1フレームあたりの平均)
+  {
+    double time = 0.0;
+    auto instance = createModelInstance(asset);
+    auto clip = acquireInstanceClip(instance);
+    Pose pose;
+    results.push_back(runBench("tickModelInstance 30Hz", iterations, [&]() {
+          time += 1.0 / 60.0;
+          tickModelInstance(instance, time, 30.0, clip.get(), pose);
+        }));
+  }
+
+  results.push_back(runBench("calcAABB", std::max(iterations / 10, size_t(1)), [&]() {
+        calcAABB(model);
+      }));
+
+  if (output.empty()) {
+    writeJson(std::cout, settings, results);
+  }
+  else {
+    std::ofstream ofs(output);
+    writeJson(ofs, settings, results);
+    std::cout << "Wrote " << output << std::endl;
+  }
+
+  return 0;
+}
@@ -0,0 +1,204 @@
+﻿#pragma once
+
+//
+// ベンチマーク用の合成モデル
+//   階層の深さと幅、ボーン数、頂点数、ウェイト数、キーの密度を指定して
+//   Assimpのシーンを直接組み立てる(ファイルは使わない)
+//   乱数は固定の式なので、同じ設定なら同じデータになる
+//
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <cmath>
+#include <assimp/scene.h>
+
+
+struct RigSettings {
+  RigSettings()
+    : depth(4),
+      width(3),
+      bones(64),
+      meshes(1),
+      vertices(12000),
+      influences(4),
+      key_density(30.0),
+      duration(2.0)
+  {}
+
+  // ノードの階層の深さと、ノードごとの子供の数
+  int depth;
+  int width;
+  // ボーンにするノードの数(ルート以外から幅優先で選ぶ)
+  int bones;
+  // メッシュの数と、メッシュごとの頂点数
+  int meshes;
+  int vertices;
+  // 頂点ごとのウェイト数(1 ~ 4)
+  int influences;
+  // 1秒あたりのキーの数
+  double key_density;
+  double duration;
+};
+
+
+// 0.0 ~ 1.0の疑似乱数
+float getRigRandom(const uint32_t seed) {
+  uint32_t x = seed * 2654435761u;
+  x ^= x >> 16;
+  x *= 0x45d9f3bu;
+  x ^= x >> 16;
+  return float(x & 0xffffff) / float(0xffffff);
+}
+
+
+// ノードの階層を作る
+//   nodesには幅優先の順で全ノードを入れる
+void createRigNodes(const RigSettings& settings, aiNode* root, std::vector<aiNode*>& nodes) {
+  nodes.push_back(root);
+
+  size_t begin = 0;
+  for (int level = 1; level < settings.depth; ++level) {
+    size_t end = nodes.size();
+    for (size_t i = begin; i < end; ++i) {
+      auto parent = nodes[i];
+      parent->mNumChildren = settings.width;
+      parent->mChildren    = new aiNode*[settings.width];
+
+      for (int c = 0; c < settings.width; ++c) {
+        auto node = new aiNode("node_" + std::to_string(nodes.size()));
+        node->mParent = parent;
+        aiMatrix4x4::Translation(aiVector3D(float(c) - settings.width * 0.5f, 1.0f, 0.0f), node->mTransformation);
+
+        parent->mChildren[c] = node;
+        nodes.push_back(node);
+      }
+    }
+    begin = end;
+  }
+}
+
+// ボーン付きのメッシュを作る
+//   頂点は球面上に散らばった三角形
+aiMesh* createRigMesh(const RigSettings& settings, const std::vector<aiNode*>& bone_nodes, const uint32_t seed) {
+  auto mesh = new aiMesh();
+
+  u_int num = std::max(settings.vertices / 3, 1) * 3;
+  mesh->mPrimitiveTypes = aiPrimitiveType_TRIANGLE;
+  mesh->mNumVertices    = num;
+  mesh->mVertices       = new aiVector3D[num];
+  mesh->mNormals        = new aiVector3D[num];
+  mesh->mMaterialIndex  = 0;
+
+  for (u_int i = 0; i < num; ++i) {
+    float theta = getRigRandom(seed + i * 2)     * 6.2831853f;
+    float phi   = getRigRandom(seed + i * 2 + 1) * 3.1415926f;
+    aiVector3D n(std::sin(phi) * std::cos(theta), std::cos(phi), std::sin(phi) * std::sin(theta));
+    mesh->mNormals[i]  = n;
+    mesh->mVertices[i] = n * float(settings.depth);
+  }
+
+  mesh->mNumFaces = num / 3;
+  mesh->mFaces    = new aiFace[mesh->mNumFaces];
+  for (u_int i = 0; i < mesh->mNumFaces; ++i) {
+    auto& face = mesh->mFaces[i];
+    face.mNumIndices = 3;
+    face.mIndices    = new u_int[3]{ i * 3, i * 3 + 1, i * 3 + 2 };
+  }
+
+  if (bone_nodes.empty()) return mesh;
+
+  // 頂点ごとに連続したボーンへウェイトを振り分ける(合計は1にしない)
+  int influences = std::min(std::max(settings.influences, 1), std::min(4, int(bone_nodes.size())));
+  std::vector<std::vector<aiVertexWeight> > weights(bone_nodes.size());
+  for (u_int i = 0; i < num; ++i) {
+    size_t base = size_t(getRigRandom(seed + num * 2 + i) * bone_nodes.size()) % bone_nodes.size();
+    for (int k = 0; k < influences; ++k) {
+      weights[(base + k) % bone_nodes.size()].push_back(aiVertexWeight(i, float(influences - k)));
+    }
+  }
+
+  mesh->mNumBones = u_int(bone_nodes.size());
+  mesh->mBones    = new aiBone*[mesh->mNumBones];
+  for (size_t b = 0; b < bone_nodes.size(); ++b) {
+    auto bone = new aiBone();
+    bone->mName       = bone_nodes[b]->mName;
+    bone->mNumWeights = u_int(weights[b].size());
+    bone->mWeights    = new aiVertexWeight[std::max(bone->mNumWeights, 1u)];
+    std::copy(weights[b].begin(), weights[b].end(), bone->mWeights);
+
+    mesh->mBones[b] = bone;
+  }
+
+  return mesh;
+}
+
+// ボーンのノードを動かすアニメーション
+aiAnimation* createRigAnimation(const RigSettings& settings, const std::vector<aiNode*>& bone_nodes) {
+  auto anim = new aiAnimation();
+  anim->mName           = aiString("synthetic");
+  anim->mDuration       = settings.duration;
+  anim->mTicksPerSecond = 1.0;
+
+  u_int keys = u_int(std::max(settings.duration * settings.key_density, 2.0));
+
+  anim->mNumChannels = u_int(bone_nodes.size());
+  anim->mChannels    = new aiNodeAnim*[std::max(anim->mNumChannels, 1u)];
+  for (size_t b = 0; b < bone_nodes.size(); ++b) {
+    auto channel = new aiNodeAnim();
+    channel->mNodeName = bone_nodes[b]->mName;
+
+    channel->mNumPositionKeys = keys;
+    channel->mPositionKeys    = new aiVectorKey[keys];
+    channel->mNumRotationKeys = keys;
+    channel->mRotationKeys    = new aiQuatKey[keys];
+    channel->mNumScalingKeys  = keys;
+    channel->mScalingKeys     = new aiVectorKey[keys];
+
+    for (u_int k = 0; k < keys; ++k) {
+      double time = settings.duration * k / (keys - 1);
+      float angle = std::sin(float(time) * 3.0f + float(b)) * 0.5f;
+
+      channel->mPositionKeys[k] = aiVectorKey(time, aiVector3D(0.0f, 1.0f + angle * 0.1f, 0.0f));
+      channel->mRotationKeys[k] = aiQuatKey(time, aiQuaternion(aiVector3D(0.0f, 0.0f, 1.0f), angle));
+      channel->mScalingKeys[k]  = aiVectorKey(time, aiVector3D(1.0f, 1.0f, 1.0f));
+    }
+
+    anim->mChannels[b] = channel;
+  }
+
+  return anim;
+}
+
+
+// シーンを組み立てる
+std::unique_ptr<aiScene> createRigScene(const RigSettings& settings) {
+  std::unique_ptr<aiScene> scene(new aiScene());
+
+  auto root = new aiNode("root");
+  std::vector<aiNode*> nodes;
+  createRigNodes(settings, root, nodes);
+  scene->mRootNode = root;
+
+  // ルート以外から幅優先で選ぶ
+  std::vector<aiNode*> bone_nodes(nodes.begin() + std::min(size_t(1), nodes.size()),
+                                  nodes.begin() + std::min(size_t(settings.bones) + 1, nodes.size()));
+
+  scene->mNumMaterials = 1;
+  scene->mMaterials    = new aiMaterial*[1]{ new aiMaterial() };
+
+  scene->mNumMeshes = u_int(std::max(settings.meshes, 1));
+  scene->mMeshes    = new aiMesh*[scene->mNumMeshes];
+  root->mNumMeshes  = scene->mNumMeshes;
+  root->mMeshes     = new u_int[scene->mNumMeshes];
+  for (u_int i = 0; i < scene->mNumMeshes; ++i) {
+    scene->mMeshes[i] = createRigMesh(settings, bone_nodes, i * 7919u);
+    root->mMeshes[i]  = i;
+  }
+
+  scene->mNumAnimations = 1;
+  scene->mAnimations    = new aiAnimation*[1]{ createRigAnimation(settings, bone_nodes) };
+
+  return scene;
+}
@@ -0,0 +1,169 @@
+﻿#pragma once
+
+//
+// テクスチャ圧縮とKTXの往復の確認
+//   合成した画像を圧縮 → KTXへ書き出し → 読み込み → 展開して、元の画像と比べる
+//     コンテナ  ヘッダ、キーと値、レベル数、各レベルのデータが書き出したものと一致する
+//     画質      レベルごとのRGBの二乗平均誤差とアルファの最大誤差が形式ごとの上限以内
+//     アルファ  透明と不透明のピクセルが、アルファのある形式でそのまま残る
+//   GLは使わない
+//
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <cmath>
+#include <cstdio>
+#include "textureCompress.hpp"
+#include "ktx.hpp"
+
+
+struct TextureCheckFormat {
+  const char* name;
+  uint32_t format;
+  uint32_t base_format;
+  bool has_alpha;
+
+  // 許容するRGBの二乗平均誤差と、アルファの最大誤差
+  double max_rgb_rmse;
+  int max_alpha_error;
+};
+
+const TextureCheckFormat texture_check_formats[] = {
+  { "BC1",      TEXTURE_COMPRESSED_RGB_BC1,        TEXTURE_BASE_RGB,  false, 12.0,  0 },
+  { "BC3",      TEXTURE_COMPRESSED_RGBA_BC3,       TEXTURE_BASE_RGBA, true,  12.0, 24 },
+  { "ETC2",     TEXTURE_COMPRESSED_RGB8_ETC2,      TEXTURE_BASE_RGB,  false, 10.0,  0 },
+  { "ETC2_EAC", TEXTURE_COMPRESSED_RGBA8_ETC2_EAC, TEXTURE_BASE_RGBA, true,  10.0, 20 },
+};
+
+
+// 滑らかな変化、はっきりした境界、透明な部分と不透明な部分を含む画像
+//   色は2色の間で変える(ブロック圧縮は1ブロックの色を直線上に並べるので、
+//   2次元に色相が変わる画像では小さいミップの誤差が形式の性能と関係なく大きくなる)
+//   has_alphaがfalseなら全て不透明
+RgbaImage createCheckImage(const int width, const int height, const bool has_alpha) {
+  const int dark[]  = {  40,  50,  70 };
+  const int light[] = { 230, 210, 180 };
+
+  RgbaImage image;
+  image.width  = width;
+  image.height = height;
+  image.pixels.resize(width * height * 4);
+
+  for (int y = 0; y < height; ++y) {
+    for (int x = 0; x < width; ++x) {
+      uint8_t* p = &image.pixels[(y * width + x) * 4];
+      // 斜めのグラデーションに縞を重ねる
+      int t = (x * 128 / std::max(width - 1, 1)) + (y * 64 / std::max(height - 1, 1));
+      if ((x / 8) & 1) t += 63;
+      for (int c = 0; c < 3; ++c) {
+        p[c] = uint8_t(dark[c] + (light[c] - dark[c]) * t / 255);
+      }
+
+      // 左は透明、右は不透明、中央は段階的に変える
+      int a = (x < width / 4) ? 0 : (x >= width * 3 / 4) ? 255 : (y * 255 / std::max(height - 1, 1));
+      p[3] = has_alpha ? uint8_t(a) : 255;
+    }
+  }
+
+  return image;
+}
+
+
+bool isSameKtx(const KtxImage& a, const KtxImage& b) {
+  return (a.gl_internal_format == b.gl_internal_format)
+      && (a.gl_base_internal_format == b.gl_base_internal_format)
+      && (a.width == b.width)
+      && (a.height == b.height)
+      && (a.key_values == b.key_values)
+      && (a.levels == b.levels);
+}
+
+// 1つの形式と大きさで往復させる
+bool checkTextureFormat(const TextureCheckFormat& check, const int width, const int height,
+                        const std::string& path) {
+  auto label = std::string(check.name) + " " + std::to_string(width) + "x" + std::to_string(height);
+  auto image = createCheckImage(width, height, check.has_alpha);
+  auto chain = createMipChain(image);
+
+  // cookTextureと同じ作り方にする
+  auto ktx = createKtxImage(image, check.format);
+  if ((ktx.gl_base_internal_format != check.base_format) || (ktx.levels.size() != chain.size())) {
+    std::cerr << label << ": unexpected base format or level count" << std::endl;
+    return false;
+  }
+
+  if (!writeKtx(path, ktx)) {
+    std::cerr << label << ": can't write " << path << std::endl;
+    return false;
+  }
+
+  std::ifstream ifs(path, std::ios::binary);
+  std::vector<uint8_t> file((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+
+  KtxImage read;
+  if (!readKtx(file.data(), file.size(), read) || !isSameKtx(ktx, read)) {
+    std::cerr << label << ": container mismatch" << std::endl;
+    return false;
+  }
+
+  bool ok = true;
+  for (size_t i = 0; i < chain.size(); ++i) {
+    const auto& src = chain[i];
+    if (read.levels[i].size() != getCompressedImageSize(check.format, src.width, src.height)) {
+      std::cerr << label << " level " << i << ": size " << read.levels[i].size() << std::endl;
+      ok = false;
+      continue;
+    }
+
+    auto decoded = decompressImage(read.levels[i], check.format, src.width, src.height);
+
+    double rgb_error = 0.0;
+    int alpha_error  = 0;
+    bool alpha_kept  = true;
+    for (size_t p = 0; p < src.pixels.size(); p += 4) {
+      for (int c = 0; c < 3; ++c) {
+        double d = double(src.pixels[p + c]) - double(decoded.pixels[p + c]);
+        rgb_error += d * d;
+      }
+
+      int a = src.pixels[p + 3];
+      int b = decoded.pixels[p + 3];
+      alpha_error = std::max(std::abs(a - b), alpha_error);
+      // 完全に透明か不透明な部分は変わってはいけない(アルファの無い形式は全て不透明)
+      if (((a == 0) || (a == 255)) && (a != b)) alpha_kept = false;
+    }
+    double rgb_rmse = std::sqrt(rgb_error / double(src.pixels.size() / 4 * 3));
+
+    if ((rgb_rmse > check.max_rgb_rmse) || (alpha_error > check.max_alpha_error) || !alpha_kept) {
+      std::cerr << label << " level " << i << " (" << src.width << "x" << src.height << ")"
+                << ": rgb rmse " << rgb_rmse << " alpha error " << alpha_error
+                << (alpha_kept ? "" : " alpha lost") << std::endl;
+      ok = false;
+    }
+  }
+
+  return ok;
+}
+
+// 全形式と大きさの組み合わせで確認する
+//   pathは一時的に書き出すKTXファイル
+bool checkTextureRoundTrip(const std::string& path) {
+  const int sizes[][2] = { { 1, 1 }, { 3, 5 }, { 64, 48 } };
+
+  size_t failed = 0;
+  size_t total  = 0;
+  for (const auto& check : texture_check_formats) {
+    for (const auto& size : sizes) {
+      total += 1;
+      if (!checkTextureFormat(check, size[0], size[1], path)) failed += 1;
+    }
+  }
+  std::remove(path.c_str());
+
+  std::cout << "Texture round trips:" << total << " failed:" << failed << std::endl;
+
+  return failed == 0;
+}
@@ -13,6 +13,13 @@
 #include "light.hpp"
 #include "shader.hpp"
 #include "model.hpp"
+#include "modelInstance.hpp"
+#include "loader.hpp"
+#include "memoryUsage.hpp"
+#include "renderQueue.hpp"
+#include "instancing.hpp"
+#include "posePipeline.hpp"
+#include "profiler.hpp"
 
 
 using namespace ci;
@@ -44,11 +51,35 @@ class AssimpApp : public App {
   float z_distance;
 
   ShaderHolder shader_holder;
+  RenderQueue render_queue;
+
+  // 群衆表示(インスタンス描画)
+  //   crowd_size x crowd_size 体をずらしたアニメーションで並べる
+  int crowd_size;
+  std::vector<DrawInstance> crowd_instances;
+
+  // 姿勢の計算を別スレッドでおこなう(falseなら描画スレッドで計算する)
+  bool pipelined;
+  PoseSimulator pose_simulator;
+  // 描画スレッドで計算する時のインスタンスと姿勢
+  Pool<ModelInstance> sync_instances;
+  PoseFrame sync_poses;
+
+  // 姿勢を計算する1秒あたりの回数(0なら毎フレーム計算する)
+  double tick_rate;
+
+  // 画面上の大きさでスケルトンのLODを選ぶ(falseなら全て0)
+  bool skeleton_lod;
+  std::vector<u_int> pose_lods;
 	ci::gl::UboRef ubo_light;
   
-  Model model;
+  // 全インスタンスで共有するモデル
+  ModelAssetRef asset;
   vec3 offset;
 
+  // 非同期読み込み
+  ModelLoader model_loader;
+
   double prev_elapsed_time;
 
   bool do_animetion;
@@ -67,6 +98,9 @@ class AssimpApp : public App {
 
   std::string settings;
 
+  // 計測結果(PROFILE_WINDOWフレームごとに更新)
+  std::vector<std::pair<std::string, std::string>> profile_text;
+
 #if !defined (CINDER_COCOA_TOUCH)
   // iOS版はダイアログの実装が無い
 	params::InterfaceGlRef params;
@@ -75,10 +109,16 @@ class AssimpApp : public App {
   
   float getVerticalFov();
   void setupCamera();
+  void changeModel();
+  ci::vec3 getCrowdPosition(const int index);
+  void selectSkeletonLods(const size_t num);
   void drawGrid();
+  void drawPoses(const Pool<Pose>& poses);
+  void drawScene();
 
   // ダイアログ関連
   void makeSettinsText();
+  void makeProfileText();
   void createDialog();
   void drawDialog();
 
@@ -134,10 +174,13 @@ float AssimpApp::getVerticalFov() {
 // 読み込んだモデルの大きさに応じてカメラを設定する
 void AssimpApp::setupCamera() {
   // 初期位置はモデルのAABBの中心位置とする
-  offset = -model.aabb.getCenter();
+  offset = asset ? -asset->model.aabb.getCenter() : vec3();
+
+  // 読み込みが終わるまではモデルの大きさが決まらないので仮の値
+  float size = asset ? length(asset->model.aabb.getSize()) : 1.0f;
 
   // モデルがスッポリ画面に入るようカメラ位置を調整
-  float w = length(model.aabb.getSize()) / 2.0f;
+  float w = size / 2.0f;
   float distance = w / std::tan(toRadians(fov / 2.0f));
 
   z_distance = distance;
@@ -146,7 +189,6 @@ void AssimpApp::setupCamera() {
   translate  = vec3();
 
   // NearクリップとFarクリップを決める
-  float size = length(model.aabb.getSize());
   near_z = size * 0.01f;
   far_z  = size * 100.0f;
 
@@ -157,6 +199,42 @@ void AssimpApp::setupCamera() {
   camera_persp.setFarClip(far_z);
 }
 
+// 読み込みが終わったモデルと入れ替える
+void AssimpApp::changeModel() {
+  auto model = std::move(model_loader.model);
+  loadShader(shader_holder, model);
+
+  {
+    // 行数が多いので1回のログにまとめる
+    std::ostringstream usage;
+    printModelMemoryUsage(usage, model, getModelMemoryUsage(model));
+    logInfo(LOG_GENERAL) << "Memory usage:\n" << usage.str();
+  }
+
+  // 計算スレッドが使っているアセットを入れ替える
+  //   前のアセットはここで解放される
+  waitPoseSimulator(pose_simulator);
+  asset = createModelAsset(std::move(model));
+  setPoseAsset(pose_simulator, asset);
+  sync_instances = Pool<ModelInstance>();
+  clearPool(sync_poses.poses);
+
+  {
+    auto instance = createModelInstance(asset);
+    auto clip     = acquireInstanceClip(instance);
+    updateModelInstance(instance, 0.0, clip.get());
+    logInfo(LOG_GENERAL) << "Instance memory:" << getModelInstanceBytes(instance);
+  }
+
+  // 読み込んだモデルがなんとなく中心に表示されるよう調整
+  setupCamera();
+  current_animation_time = 0.0;
+  touch_num = 0;
+  disp_reverse = false;
+
+  makeSettinsText();
+}
+
 // グリッド描画
 void AssimpApp::drawGrid() {
   gl::ScopedGlslProg shader(gl::getStockShader(gl::ShaderDef().color()));
@@ -185,6 +263,7 @@ void AssimpApp::drawGrid() {
 
 // iOS版はダイアログ関連の実装が無い
 void AssimpApp::makeSettinsText() {}
+void AssimpApp::makeProfileText() {}
 void AssimpApp::createDialog() {}
 void AssimpApp::drawDialog() {}
 
@@ -197,13 +276,54 @@ void AssimpApp::makeSettinsText() {
   str << (two_sided    ? "D" : " ") << " "
       << (do_animetion ? "A" : " ") << " "
       << (no_animation ? "M" : " ") << " "
-      << (disp_reverse ? "F" : " ");
+      << (disp_reverse ? "F" : " ") << " "
+      << (crowd_size > 1 ? "C" : " ") << " "
+      << (pipelined    ? "P" : " ") << " "
+      << (skeleton_lod ? "O" : " ") << " "
+      << (tick_rate > 0.0 ? "K" : " ") << " "
+      << (isLoadingModel(model_loader) ? "L" : " ");
 
   settings = str.str();
   params->removeParam("Settings");
   params->addParam("Settings", &settings, true);
 }
 
+// 計測結果をテキスト化
+//   1フレームあたりの平均
+void AssimpApp::makeProfileText() {
+  const auto& stats = getProfileStats();
+
+  auto zone = [&stats](const char* name, const bool gpu) {
+    std::ostringstream str;
+    str.precision(2);
+    str << std::fixed << getProfileZoneMs(stats, name, gpu) << " ms";
+    return str.str();
+  };
+
+  for (const auto& text : profile_text) {
+    params->removeParam(text.first);
+  }
+
+  std::ostringstream frame;
+  frame.precision(2);
+  frame << std::fixed << stats.frame_ms << " ms (max " << stats.frame_max_ms << ")";
+
+  profile_text = {
+    { "Frame",    frame.str() },
+    { "Update",   zone("update", false) },
+    { "Draw",     zone("draw", false) },
+    { "Pose",     zone("simulatePoses", false) },
+    { "GPU",      zone("model", true) },
+  };
+  for (int i = 0; i < PROFILE_COUNTER_NUM; ++i) {
+    profile_text.push_back({ profile_counter_names[i], std::to_string(int64_t(stats.counters[i])) });
+  }
+
+  for (auto& text : profile_text) {
+    params->addParam(text.first, &text.second, true);
+  }
+}
+
 // ダイアログ作成
 void AssimpApp::createDialog() {
 	// 各種パラメーター設定
@@ -229,6 +349,9 @@ void AssimpApp::createDialog() {
   params->addParam("Speed", &animation_speed).min(0.1).max(10.0).precision(2).step(0.05);
 
   makeSettinsText();
+
+  params->addSeparator();
+  makeProfileText();
 }
 
 // ダイアログ表示
@@ -246,14 +369,18 @@ void AssimpApp::setup() {
 #endif
 
   gl::enableVerticalSync(true);
+  setProfileThreadName("main");
   
   touch_num = 0;
   // アクティブになった時にタッチ情報を初期化
   getSignalDidBecomeActive().connect([this](){ touch_num = 0; });
 
   // モデルデータ読み込み
-  model = loadModel(getAssetPath("test.dae").string());
-  loadShader(shader_holder, model);
+  //   読み込みが終わるまでは何も表示されない
+  setupTextureLimit();
+  // 転送後はカリング用の頂点座標だけ残す
+  model_loader.retention = RETAIN_POSITIONS;
+  startLoadModel(model_loader, getAssetPath("test.dae").string());
   
   prev_elapsed_time = 0.0;
 
@@ -265,6 +392,14 @@ void AssimpApp::setup() {
   do_disp_grid = true;
   grid_scale = 1.0f;
 
+  crowd_size = 1;
+
+  pipelined = true;
+  startPoseSimulator(pose_simulator);
+
+  skeleton_lod = true;
+  tick_rate    = 0.0;
+
   // カメラの設定
   fov = 35.0f;
   setupCamera();
@@ -296,7 +431,10 @@ void AssimpApp::setup() {
 
   // UBOを使い複数のシェーダーで値を共有
   ubo_light = gl::Ubo::create(sizeof (Light), &light);
-	ubo_light->bindBufferBase(0);
+	ubo_light->bindBufferBase(LIGHT_BLOCK_BINDING);
+
+  // 全種類のシェーダーを先に用意しておく
+  prepareShaders(shader_holder);
 
   
   bg_color = Color(0.7f, 0.7f, 0.7f);
@@ -313,6 +451,9 @@ void AssimpApp::setup() {
 }
 
 void AssimpApp::shutdown() {
+  stopPoseSimulator(pose_simulator);
+  // 残っているログを書き出す
+  stopLogger();
 }
 
 
@@ -324,23 +465,11 @@ void AssimpApp::resize() {
 
 void AssimpApp::fileDrop(FileDropEvent event) {
   const auto& path = event.getFiles();
-  console() << "Load: " << path[0] << std::endl;
+  logInfo(LOG_GENERAL) << "Load: " << path[0].string();
 
-  model = loadModel(path[0].string());
-  loadShader(shader_holder, model);
-
-  // 読み込んだモデルがなんとなく中心に表示されるよう調整
-  offset = -model.aabb.getCenter();
-
-  // FIXME:モデルのAABBを計算する時にアニメーションを適用している
-  //       そのままだとアニメーションの情報が残ってしまっているので
-  //       一旦リセット
-  if (no_animation) resetModelNodes(model);
-
-  setupCamera();
-  current_animation_time = 0.0;
-  touch_num = 0;
-  disp_reverse = false;
+  // 読み込みが終わるまでは今のモデルを表示し続ける
+  startLoadModel(model_loader, path[0].string());
+  makeSettinsText();
 }
 
 
@@ -423,9 +552,6 @@ void AssimpApp::keyDown(KeyEvent event) {
   case KeyEvent::KEY_m:
     {
       no_animation = !no_animation;
-      if (no_animation) {
-        resetModelNodes(model);
-      }
       makeSettinsText();
     }
     break;
@@ -446,19 +572,62 @@ void AssimpApp::keyDown(KeyEvent event) {
     }
     break;
 
+  case KeyEvent::KEY_c:
+    {
+      crowd_size = (crowd_size > 1) ? 1 : 8;
+      makeSettinsText();
+    }
+    break;
+
+  case KeyEvent::KEY_p:
+    {
+      waitPoseSimulator(pose_simulator);
+      pipelined = !pipelined;
+      makeSettinsText();
+    }
+    break;
+
   case KeyEvent::KEY_f:
     {
-      reverseModelNode(model);
       disp_reverse = !disp_reverse;
       makeSettinsText();
     }
     break;
 
+  case KeyEvent::KEY_o:
+    {
+      skeleton_lod = !skeleton_lod;
+      makeSettinsText();
+    }
+    break;
+
+  case KeyEvent::KEY_k:
+    {
+      // 毎フレーム → 30Hz → 15Hz
+      tick_rate = (tick_rate == 0.0) ? 30.0
+                : (tick_rate > 15.0) ? 15.0
+                                     : 0.0;
+      logInfo(LOG_GENERAL) << "tick rate:" << tick_rate;
+      makeSettinsText();
+    }
+    break;
+
+
+  case KeyEvent::KEY_t:
+    {
+      // 数秒分の計測結果をトレースとして書き出す
+      if (isProfileTracing()) break;
+
+      auto path = getProfileTracePath();
+      if (!path.empty()) startProfileTrace(300, path);
+    }
+    break;
+
 
   case KeyEvent::KEY_PERIOD:
     {
       animation_speed = std::min(animation_speed * 1.25, 10.0);
-      console() << "speed:" << animation_speed << std::endl;
+      logInfo(LOG_GENERAL) << "speed:" << animation_speed;
       makeSettinsText();
     }
     break;
@@ -466,7 +635,7 @@ void AssimpApp::keyDown(KeyEvent event) {
   case KeyEvent::KEY_COMMA:
     {
       animation_speed = std::max(animation_speed * 0.95, 0.1);
-      console() << "speed:" << animation_speed << std::endl;
+      logInfo(LOG_GENERAL) << "speed:" << animation_speed;
       makeSettinsText();
     }
     break;
@@ -534,18 +703,115 @@ void AssimpApp::touchesEnded(TouchEvent event) {
 
 
 void AssimpApp::update() {
+  beginProfileFrame();
+  ProfileZone profile_zone("update");
+
+  // GPUへの転送は1フレームあたり4ms程度に抑える
+  if (updateLoadModel(model_loader, 0.004)) changeModel();
+
   double elapsed_time = getElapsedSeconds();
   double delta_time   = elapsed_time - prev_elapsed_time;
 
+  // 一時停止中は同じ時刻の姿勢を計算し続ける
   if (do_animetion && !no_animation) {
     current_animation_time += delta_time * animation_speed;
-    updateModel(model, current_animation_time, 0);
+  }
+
+  size_t num = crowd_size * crowd_size;
+  selectSkeletonLods(num);
+  if (pipelined) {
+    // 計算済みのフレームを受け取り、次のフレームを計算させる
+    acquirePoses(pose_simulator);
+    requestPoses(pose_simulator, current_animation_time, num, !no_animation, tick_rate, pose_lods);
+  }
+  else {
+    PoseRequest request{ 0, current_animation_time, num, !no_animation, tick_rate };
+    simulatePoses(asset, request, pose_lods, sync_instances, sync_poses);
   }
 
   prev_elapsed_time = elapsed_time;
 }
 
+// 群衆のindex番目の位置
+//   モデルの大きさに合わせて格子状に並べる(1体なら原点)
+ci::vec3 AssimpApp::getCrowdPosition(const int index) {
+  if (!asset || (crowd_size == 1)) return ci::vec3();
+
+  ci::vec3 size = asset->model.aabb.getSize();
+  float spacing = std::max(size.x, size.z) * 1.25f;
+  float origin  = (crowd_size - 1) * spacing * 0.5f;
+
+  int x = index % crowd_size;
+  int z = index / crowd_size;
+  return ci::vec3(x * spacing - origin, 0.0f, z * spacing - origin);
+}
+
+// インスタンスごとのスケルトンのLODを、画面に映る高さ(ピクセル)で選ぶ
+//   描画と同じ行列でモデルの中心をカメラ空間に移し、外接球の半径を投影する
+void AssimpApp::selectSkeletonLods(const size_t num) {
+  // LOD0とLOD1で計算する最小の高さ
+  const float lod_pixels[] = { 300.0f, 100.0f };
+
+  pose_lods.assign(num, 0);
+  if (!asset || !skeleton_lod) return;
+
+  const auto& aabb = asset->model.aabb;
+  float radius = length(aabb.getSize()) * 0.5f;
+  float scale  = getWindowHeight() / (2.0f * std::tan(toRadians(camera_persp.getFov()) * 0.5f));
+
+  auto view = glm::translate(ci::mat4(), vec3(0, 0.0, -z_distance))
+            * glm::translate(ci::mat4(), translate)
+            * glm::toMat4(rotate)
+            * glm::translate(ci::mat4(), offset);
+
+  for (size_t i = 0; i < num; ++i) {
+    auto center = view * ci::vec4(aabb.getCenter() + getCrowdPosition(int(i)), 1.0f);
+    // カメラより後ろは見えないので一番粗くする
+    float pixels = (center.z < 0.0f) ? (2.0f * radius * scale / -center.z) : 0.0f;
+
+    u_int lod = 0;
+    while ((lod < SKELETON_LOD_NUM - 1) && (pixels < lod_pixels[lod])) {
+      lod += 1;
+    }
+    pose_lods[i] = lod;
+  }
+}
+
+// 計算した姿勢でモデルを描画
+//   1体なら描画キューで、群衆ならモデルの大きさに合わせて格子状に並べてインスタンス描画
+void AssimpApp::drawPoses(const Pool<Pose>& poses) {
+  // モデルを入れ替えた直後は姿勢がまだ無い
+  if (!asset || poses.empty()) return;
+  const auto& model = asset->model;
+  if (poses.front().node_matrices.size() != model.node_list.size()) return;
+
+  if (crowd_size == 1) {
+    drawModel(model, poses.front(), shader_holder, render_queue, disp_reverse);
+    return;
+  }
+
+  crowd_instances.clear();
+  for (size_t i = 0; i < poses.size(); ++i) {
+    auto matrix = glm::translate(ci::mat4(), getCrowdPosition(int(i)));
+    crowd_instances.push_back({ matrix, &poses[i] });
+  }
+
+  // インスタンス用のバッファは描画キューと共有する
+  drawModelInstanced(model, crowd_instances, shader_holder, render_queue.instance, disp_reverse);
+}
+
 void AssimpApp::draw() {
+  {
+    ProfileZone profile_zone("draw");
+    drawScene();
+  }
+
+  // フレームの最後に集計する
+  endProfileFrame();
+  if (isProfileStatsUpdated()) makeProfileText();
+}
+
+void AssimpApp::drawScene() {
   gl::clear(Color(0.0f, 0.0f, 0.0f));
 
   // 背景描画
@@ -570,8 +836,15 @@ void AssimpApp::draw() {
   gl::translate(offset);
 
   ubo_light->copyData(sizeof (Light), &light);
-  
-  drawModel(model, shader_holder);
+  countProfile(PROFILE_UNIFORMS);
+
+  {
+    GpuProfileZone gpu_zone("model");
+
+    drawPoses(pipelined ? getFrontPoses(pose_simulator).poses : sync_poses.poses);
+  }
+
+  GpuProfileZone gpu_zone("overlay");
 
 #if !defined (CINDER_COCOA_TOUCH)
   // FIXME:iOSだと劇重
@@ -0,0 +1,79 @@
+﻿#pragma once
+
+//
+// ヒープ確保の追跡(デバッグ用)
+//   USE_ALLOC_TRACKINGを定義すると、グローバルのoperator new/deleteを置き換えて
+//   確保の回数と量を数える
+//   置き換えはプログラム全体に効くので、定義するのはひとつの翻訳単位だけにする
+//   有効な時は計測のカウンタにフレームごとの確保が出る
+//
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+
+// アプリで調べる時はここで有効にする
+// #define USE_ALLOC_TRACKING
+
+
+struct AllocStats {
+  uint64_t count;
+  uint64_t bytes;
+};
+
+AllocStats operator-(const AllocStats& lhs, const AllocStats& rhs) {
+  return AllocStats{ lhs.count - rhs.count, lhs.bytes - rhs.bytes };
+}
+
+
+#if defined (USE_ALLOC_TRACKING)
+
+std::atomic<uint64_t> alloc_count(0);
+std::atomic<uint64_t> alloc_bytes(0);
+
+void* trackedAllocate(const size_t size) {
+  alloc_count.fetch_add(1, std::memory_order_relaxed);
+  alloc_bytes.fetch_add(size, std::memory_order_relaxed);
+
+  void* p = std::malloc(size ? size : 1);
+  if (!p) throw std::bad_alloc();
+  return p;
+}
+
+void* operator new(size_t size) { return trackedAllocate(size); }
+void* operator new[](size_t size) { return trackedAllocate(size); }
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+  try {
+    return trackedAllocate(size);
+  }
+  catch (...) {
+    return nullptr;
+  }
+}
+
+void* operator new[](size_t size, const std::nothrow_t& tag) noexcept {
+  return operator new(size, tag);
+}
+
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete[](void* p) noexcept { std::free(p); }
+void operator delete(void* p, size_t) noexcept { std::free(p); }
+void operator delete[](void* p, size_t) noexcept { std::free(p); }
+void operator delete(void* p, const std::nothrow_t&) noexcept { std::free(p); }
+void operator delete[](void* p, const std::nothrow_t&) noexcept { std::free(p); }
+
+#endif
+
+
+// プログラム開始からの合計(無効なら常に0)
+//   差を取ってフレームや処理ごとの確保を求める
+AllocStats getAllocStats() {
+#if defined (USE_ALLOC_TRACKING)
+  return AllocStats{ alloc_count.load(std::memory_order_relaxed), alloc_bytes.load(std::memory_order_relaxed) };
+#else
+  return AllocStats{ 0, 0 };
+#endif
+}
@@ -16,15 +16,27 @@ struct QuatKey {
 };
 
 
+struct Node;
+
 struct NodeAnim {
+  NodeAnim()
+    : node(nullptr)
+  {}
+
   std::string node_name;
+  // 名前から解決したノード
+  Node* node;
 
   std::vector<VectorKey> translate;
   std::vector<VectorKey> scaling;
   std::vector<QuatKey>   rotation;
 };
 
+// クリップ
+//   Model::animationのものは名前、長さ、チャンネル(node_name)だけでキーを持たない
+//   キーはClipLibraryから取り出す
 struct Anim {
+  std::string name;
   double duration;
   std::vector<NodeAnim> body;
 };
@@ -102,6 +114,17 @@ ci::quat getLerpValue(const double time, const std::vector<QuatKey>& values) {
   return value;
 }
 
+// 階層アニメーションを取り出してノードの行列を生成
+ci::mat4 getNodeAnimMatrix(const NodeAnim& body, const double time) {
+  ci::mat4 m;
+  m = ci::translate(m, getLerpValue(time, body.translate));
+  ci::mat4 r = glm::toMat4(getLerpValue(time, body.rotation));
+  m = m * r;
+  m = ci::scale(m, getLerpValue(time, body.scaling));
+
+  return m;
+}
+
 
 // ノードに付随するアニメーション情報を作成
 NodeAnim createNodeAnim(const aiNodeAnim* anim) {
@@ -131,11 +154,12 @@ NodeAnim createNodeAnim(const aiNodeAnim* anim) {
 Anim createAnimation(const aiAnimation* anim) {
   Anim animation;
 
+  animation.name     = anim->mName.C_Str();
   animation.duration = anim->mDuration;
 
   {
     // 階層アニメーション
-    ci::app::console() << "Node anim:" << anim->mNumChannels << std::endl;
+    logDebug(LOG_IMPORT) << "Node anim:" << anim->mNumChannels;
 
     aiNodeAnim** node_anim = anim->mChannels;
     for (u_int i = 0; i < anim->mNumChannels; ++i) {
@@ -145,7 +169,7 @@ Anim createAnimation(const aiAnimation* anim) {
 
   {
     // メッシュアニメーション
-    ci::app::console() << "Mesh anim:" << anim->mNumMeshChannels << std::endl;
+    logDebug(LOG_IMPORT) << "Mesh anim:" << anim->mNumMeshChannels;
 
 #if 0
     aiMeshAnim** mesh_anim = anim->mMeshChannels;
@@ -0,0 +1,250 @@
+﻿#pragma once
+
+//
+// アニメーションクリップのキーの読み込みと破棄
+//   Model::animationには名前、長さ、チャンネルだけを置き、キーはクリップを最初に使う時に読み込む
+//   読み込んだキーの合計が予算を超えたら、長く使われていないクリップから捨てる
+//   捨てたクリップは次に使う時に読み込み直す
+//   読み込み元はクックしたクリップファイル
+//   ファイルが無ければ、変換したキーを捨てずに持ち続ける
+//   どのスレッドから使っても良い(取り出したクリップはshared_ptrが残っている間は有効)
+//
+
+#include <mutex>
+#include <memory>
+#include <vector>
+#include <string>
+#include <limits>
+#include "animation.hpp"
+#include "cook.hpp"
+#include "mappedFile.hpp"
+#include "profiler.hpp"
+
+
+// 読み込んだキーの標準の予算
+enum {
+  CLIP_DEFAULT_BUDGET = 32 * 1024 * 1024,
+};
+
+
+struct ClipLibrary {
+  ClipLibrary()
+    : budget(CLIP_DEFAULT_BUDGET),
+      resident_bytes(0),
+      clock(0),
+      loads(0),
+      evictions(0)
+  {}
+
+  struct Entry {
+    Entry()
+      : offset(0),
+        bytes(0),
+        last_used(0)
+    {}
+
+    // クリップファイル内の位置(0ならファイルに無いので捨てない)
+    uint64_t offset;
+    // 読み込んだキー(model.animationと同じ並びのチャンネル)
+    std::shared_ptr<const Anim> keys;
+    size_t bytes;
+    // 最後に使った時のclock
+    uint64_t last_used;
+  };
+
+  // 読み込みと破棄はmutexで守る
+  std::mutex mutex;
+  // Model::animationと同じ並び
+  std::vector<Entry> entries;
+
+  std::unique_ptr<MappedFile> file;
+
+  size_t budget;
+  size_t resident_bytes;
+  uint64_t clock;
+
+  size_t loads;
+  size_t evictions;
+};
+
+
+// キーが使うメモリ
+size_t getClipBytes(const Anim& anim) {
+  size_t bytes = sizeof(Anim) + anim.body.capacity() * sizeof(NodeAnim);
+  for (const auto& body : anim.body) {
+    bytes += body.translate.capacity() * sizeof(VectorKey)
+           + body.scaling.capacity() * sizeof(VectorKey)
+           + body.rotation.capacity() * sizeof(QuatKey);
+  }
+
+  return bytes;
+}
+
+
+// 変換したクリップからキーを取り上げる
+//   animationsには名前、長さ、チャンネルだけが残る
+//   ファイルを割り当てるまではキーを捨てない
+std::shared_ptr<ClipLibrary> createClipLibrary(std::vector<Anim>& animations) {
+  auto library = std::make_shared<ClipLibrary>();
+  library->entries.resize(animations.size());
+
+  for (size_t i = 0; i < animations.size(); ++i) {
+    auto keys = std::make_shared<Anim>(std::move(animations[i]));
+
+    auto& info = animations[i];
+    info.name     = keys->name;
+    info.duration = keys->duration;
+    info.body.resize(keys->body.size());
+    for (size_t j = 0; j < keys->body.size(); ++j) {
+      info.body[j].node_name = keys->body[j].node_name;
+    }
+
+    auto& entry = library->entries[i];
+    entry.bytes = getClipBytes(*keys);
+    entry.keys  = std::move(keys);
+    library->resident_bytes += entry.bytes;
+  }
+
+  return library;
+}
+
+
+// 予算を超えていたら、長く使われていないクリップから捨てる
+//   keepは読み込んだばかりなので捨てない
+//   使用中のクリップは、使い終わった時に解放される
+void trimClipLibrary(ClipLibrary& library, const size_t keep) {
+  while (library.resident_bytes > library.budget) {
+    size_t oldest = library.entries.size();
+    for (size_t i = 0; i < library.entries.size(); ++i) {
+      const auto& entry = library.entries[i];
+      if ((i == keep) || !entry.keys || !entry.offset) continue;
+
+      if ((oldest == library.entries.size()) || (entry.last_used < library.entries[oldest].last_used)) {
+        oldest = i;
+      }
+    }
+    if (oldest == library.entries.size()) break;
+
+    auto& entry = library.entries[oldest];
+    entry.keys.reset();
+    library.resident_bytes -= entry.bytes;
+    library.evictions += 1;
+  }
+}
+
+void setClipBudget(ClipLibrary& library, const size_t bytes) {
+  std::lock_guard<std::mutex> lock(library.mutex);
+  library.budget = bytes;
+  trimClipLibrary(library, std::numeric_limits<size_t>::max());
+}
+
+size_t getClipResidentBytes(ClipLibrary& library) {
+  std::lock_guard<std::mutex> lock(library.mutex);
+  return library.resident_bytes;
+}
+
+
+// クリップのキーを取り出す
+//   読み込んでいなければここで読み込む(読み込めなければnullptr)
+std::shared_ptr<const Anim> acquireClip(ClipLibrary& library, const size_t index) {
+  std::lock_guard<std::mutex> lock(library.mutex);
+
+  auto& entry = library.entries[index];
+  entry.last_used = ++library.clock;
+  if (entry.keys) return entry.keys;
+  if (!library.file || !entry.offset) return nullptr;
+
+  ProfileZone profile_zone("loadClip");
+
+  const auto& file = *library.file;
+  CookedReader reader{ file.data() + entry.offset, file.data() + file.size(), size_t(entry.offset), false };
+  auto keys = std::make_shared<Anim>(readAnimKeys(reader));
+  if (reader.error) {
+    logWarning(LOG_IMPORT) << "Can't read clip:" << index;
+    return nullptr;
+  }
+
+  entry.bytes = getClipBytes(*keys);
+  entry.keys  = std::move(keys);
+  library.resident_bytes += entry.bytes;
+  library.loads += 1;
+  logDebug(LOG_IMPORT) << "Load clip:" << index << " bytes:" << entry.bytes;
+
+  trimClipLibrary(library, index);
+
+  return entry.keys;
+}
+
+
+// クックしたクリップファイルのパス
+std::string getCookedClipPath(const std::string& path) {
+  return path + ".clips";
+}
+
+// 全クリップのキーを書き出す
+//   全てのキーを持っているライブラリ(ファイルを割り当てる前)を書き出す
+//   offsetsには各クリップの位置が入る
+bool writeCookedClips(ClipLibrary& library, const std::string& path, const uint64_t hash,
+                      std::vector<uint64_t>& offsets) {
+  CookedWriter writer{ std::ofstream(path, std::ios::binary), 0 };
+  if (!writer.ofs) return false;
+
+  writeBytes(writer, cooked_clip_magic, sizeof(cooked_clip_magic));
+  writeValue(writer, uint32_t(COOKED_MODEL_VERSION));
+  writeValue(writer, hash);
+  writeValue(writer, uint32_t(library.entries.size()));
+
+  offsets.clear();
+  for (size_t i = 0; i < library.entries.size(); ++i) {
+    // 使ったことにはしない
+    std::shared_ptr<const Anim> keys;
+    {
+      std::lock_guard<std::mutex> lock(library.mutex);
+      keys = library.entries[i].keys;
+    }
+    if (!keys) return false;
+
+    alignWriter(writer);
+    offsets.push_back(writer.offset);
+    writeAnimKeys(writer, *keys);
+  }
+
+  return bool(writer.ofs);
+}
+
+// クリップファイルを割り当てる
+//   以降はキーを捨てても読み込み直せるので、まだ使っていないキーはここで捨てる
+//   ファイルが違う(ハッシュ値やクリップの数が合わない)場合はfalse
+bool attachClipFile(ClipLibrary& library, const std::string& path, const uint64_t hash,
+                    const std::vector<uint64_t>& offsets) {
+  std::unique_ptr<MappedFile> file(new MappedFile(path));
+  if (!file->isOpen()) return false;
+
+  CookedReader reader{ file->data(), file->data() + file->size(), 0, false };
+
+  char magic[sizeof(cooked_clip_magic)];
+  readBytes(reader, magic, sizeof(magic));
+  if (reader.error || std::memcmp(magic, cooked_clip_magic, sizeof(magic))) return false;
+  if (readValue<uint32_t>(reader) != COOKED_MODEL_VERSION) return false;
+  if (readValue<uint64_t>(reader) != hash) return false;
+  if (reader.error || (readValue<uint32_t>(reader) != offsets.size())) return false;
+  for (auto offset : offsets) {
+    if (offset >= file->size()) return false;
+  }
+
+  std::lock_guard<std::mutex> lock(library.mutex);
+  if (offsets.size() != library.entries.size()) return false;
+
+  library.file = std::move(file);
+  for (size_t i = 0; i < offsets.size(); ++i) {
+    auto& entry = library.entries[i];
+    entry.offset = offsets[i];
+
+    if (entry.keys && !entry.last_used) {
+      entry.keys.reset();
+      library.resident_bytes -= entry.bytes;
+    }
+  }
+
+  return true;
+}
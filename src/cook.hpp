@@ -0,0 +1,348 @@
+﻿#pragma once
+
+//
+// クックしたモデルデータの読み書き
+//   Assimpで読み込んで変換した後のデータをそのまま書き出す
+//   配列は16バイト境界に揃えてあるので、マップしたメモリからまとめてコピーできる
+//
+
+#include <fstream>
+#include <vector>
+#include <string>
+#include <cstring>
+#include <type_traits>
+#include "mesh.hpp"
+#include "material.hpp"
+#include "node.hpp"
+#include "animation.hpp"
+
+
+// データ形式を変えたら更新する
+enum {
+  COOKED_MODEL_VERSION = 5,
+  COOKED_ALIGNMENT     = 16,
+};
+
+const char cooked_model_magic[4] = { 'S', 'K', 'C', 'M' };
+const char cooked_clip_magic[4]  = { 'S', 'K', 'C', 'A' };
+
+
+struct CookedWriter {
+  std::ofstream ofs;
+  size_t offset;
+};
+
+struct CookedReader {
+  const uint8_t* ptr;
+  const uint8_t* end;
+  size_t offset;
+  bool error;
+};
+
+
+void writeBytes(CookedWriter& writer, const void* data, const size_t size) {
+  writer.ofs.write(static_cast<const char*>(data), size);
+  writer.offset += size;
+}
+
+void alignWriter(CookedWriter& writer) {
+  static const char zero[COOKED_ALIGNMENT] = {};
+  size_t padding = (COOKED_ALIGNMENT - writer.offset % COOKED_ALIGNMENT) % COOKED_ALIGNMENT;
+  writeBytes(writer, zero, padding);
+}
+
+template <typename T>
+void writeValue(CookedWriter& writer, const T& value) {
+  static_assert(std::is_trivially_copyable<T>::value, "POD only");
+  writeBytes(writer, &value, sizeof(T));
+}
+
+template <typename T>
+void writeArray(CookedWriter& writer, const std::vector<T>& values) {
+  static_assert(std::is_trivially_copyable<T>::value, "POD only");
+  writeValue(writer, uint64_t(values.size()));
+  alignWriter(writer);
+  if (!values.empty()) writeBytes(writer, &values[0], sizeof(T) * values.size());
+}
+
+void writeString(CookedWriter& writer, const std::string& text) {
+  writeValue(writer, uint32_t(text.size()));
+  writeBytes(writer, text.data(), text.size());
+}
+
+
+// 読み込み
+//   範囲外を読もうとしたらエラーを記録して以降は何もしない
+bool readBytes(CookedReader& reader, void* data, const size_t size) {
+  if (reader.error || (size_t(reader.end - reader.ptr) < size)) {
+    reader.error = true;
+    return false;
+  }
+
+  std::memcpy(data, reader.ptr, size);
+  reader.ptr    += size;
+  reader.offset += size;
+  return true;
+}
+
+void alignReader(CookedReader& reader) {
+  size_t padding = (COOKED_ALIGNMENT - reader.offset % COOKED_ALIGNMENT) % COOKED_ALIGNMENT;
+  if (size_t(reader.end - reader.ptr) < padding) {
+    reader.error = true;
+    return;
+  }
+  reader.ptr    += padding;
+  reader.offset += padding;
+}
+
+template <typename T>
+T readValue(CookedReader& reader) {
+  static_assert(std::is_trivially_copyable<T>::value, "POD only");
+  T value{};
+  readBytes(reader, &value, sizeof(T));
+  return value;
+}
+
+template <typename T>
+std::vector<T> readArray(CookedReader& reader) {
+  static_assert(std::is_trivially_copyable<T>::value, "POD only");
+  std::vector<T> values;
+
+  auto num = readValue<uint64_t>(reader);
+  alignReader(reader);
+  if (reader.error) return values;
+
+  // 壊れたデータで巨大な確保をしないよう、残りサイズと比較
+  if (num > uint64_t(reader.end - reader.ptr) / sizeof(T)) {
+    reader.error = true;
+    return values;
+  }
+
+  values.resize(size_t(num));
+  if (num > 0) readBytes(reader, &values[0], sizeof(T) * values.size());
+  return values;
+}
+
+std::string readString(CookedReader& reader) {
+  auto size = readValue<uint32_t>(reader);
+  if (reader.error || (size > size_t(reader.end - reader.ptr))) {
+    reader.error = true;
+    return std::string();
+  }
+
+  std::string text(reinterpret_cast<const char*>(reader.ptr), size);
+  reader.ptr    += size;
+  reader.offset += size;
+  return text;
+}
+
+
+// AABB
+void writeAABB(CookedWriter& writer, const ci::AxisAlignedBox& aabb) {
+  writeValue(writer, aabb.getMin());
+  writeValue(writer, aabb.getMax());
+}
+
+ci::AxisAlignedBox readAABB(CookedReader& reader) {
+  auto min_vtx = readValue<ci::vec3>(reader);
+  auto max_vtx = readValue<ci::vec3>(reader);
+  return ci::AxisAlignedBox(min_vtx, max_vtx);
+}
+
+
+// マテリアル
+void writeMaterial(CookedWriter& writer, const Material& material) {
+  writeValue(writer, material.diffuse);
+  writeValue(writer, material.ambient);
+  writeValue(writer, material.specular);
+  writeValue(writer, material.shininess);
+  writeValue(writer, material.emission);
+
+  writeValue(writer, uint8_t(material.has_texture));
+  if (material.has_texture) {
+    writeString(writer, material.texture_name);
+    writeValue(writer, material.wrap_s);
+    writeValue(writer, material.wrap_t);
+  }
+}
+
+Material readMaterial(CookedReader& reader) {
+  Material material;
+
+  material.diffuse   = readValue<ci::ColorA>(reader);
+  material.ambient   = readValue<ci::ColorA>(reader);
+  material.specular  = readValue<ci::ColorA>(reader);
+  material.shininess = readValue<float>(reader);
+  material.emission  = readValue<ci::ColorA>(reader);
+
+  material.has_texture = readValue<uint8_t>(reader) != 0;
+  if (material.has_texture) {
+    material.texture_name = readString(reader);
+    material.wrap_s       = readValue<GLenum>(reader);
+    material.wrap_t       = readValue<GLenum>(reader);
+  }
+
+  return material;
+}
+
+
+// メッシュ
+void writeMesh(CookedWriter& writer, const Mesh& mesh) {
+  writeValue(writer, mesh.material_index);
+  writeValue(writer, uint8_t(mesh.has_vertex_color));
+  writeValue(writer, uint8_t(mesh.has_bone));
+  writeValue(writer, mesh.bone_influences);
+  writeAABB(writer, mesh.aabb);
+
+  writeArray(writer, mesh.body.getPositions());
+  writeArray(writer, mesh.body.getNormals());
+  writeArray(writer, mesh.body.getTexCoords());
+  writeArray(writer, mesh.body.getColors());
+  writeArray(writer, mesh.body.getIndices());
+  writeArray(writer, mesh.body.getBoneIndices());
+  writeArray(writer, mesh.body.getBoneWeights());
+
+  writeValue(writer, uint32_t(mesh.bones.size()));
+  for (const auto& bone : mesh.bones) {
+    writeString(writer, bone.name);
+    writeValue(writer, bone.offset);
+    writeValue(writer, uint8_t(bone.has_aabb));
+    writeAABB(writer, bone.aabb);
+    writeValue(writer, bone.influence);
+    writeArray(writer, bone.weights);
+  }
+}
+
+Mesh readMesh(CookedReader& reader) {
+  Mesh mesh;
+
+  mesh.material_index   = readValue<u_int>(reader);
+  mesh.has_vertex_color = readValue<uint8_t>(reader) != 0;
+  mesh.has_bone         = readValue<uint8_t>(reader) != 0;
+  mesh.bone_influences  = readValue<u_int>(reader);
+  mesh.aabb             = readAABB(reader);
+
+  mesh.body.setPositions(readArray<ci::vec3>(reader));
+  mesh.body.setNormals(readArray<ci::vec3>(reader));
+  mesh.body.setTexCoords(readArray<ci::vec2>(reader));
+  mesh.body.setColors(readArray<ci::ColorA>(reader));
+  mesh.body.setIndices(readArray<uint32_t>(reader));
+  mesh.body.setBoneIndices(readArray<index_t>(reader));
+  mesh.body.setBoneWeights(readArray<ci::vec4>(reader));
+
+  auto num_bones = readValue<uint32_t>(reader);
+  for (uint32_t i = 0; (i < num_bones) && !reader.error; ++i) {
+    Bone bone;
+    bone.name      = readString(reader);
+    bone.offset    = readValue<ci::mat4>(reader);
+    bone.has_aabb  = readValue<uint8_t>(reader) != 0;
+    bone.aabb      = readAABB(reader);
+    bone.influence = readValue<float>(reader);
+    bone.weights   = readArray<Weight>(reader);
+
+    mesh.bones.push_back(std::move(bone));
+  }
+
+  return mesh;
+}
+
+
+// ノード
+//   子供も再帰で書き出す
+//   メッシュはインデックスのみ
+void writeNode(CookedWriter& writer, const Node& node) {
+  writeString(writer, node.name);
+  writeValue(writer, node.matrix_orig);
+
+  writeValue(writer, uint32_t(node.mesh.size()));
+  for (const auto& mesh : node.mesh) {
+    writeValue(writer, mesh.index);
+  }
+
+  writeValue(writer, uint32_t(node.children.size()));
+  for (const auto& child : node.children) {
+    writeNode(writer, *child);
+  }
+}
+
+std::shared_ptr<Node> readNode(CookedReader& reader, const std::vector<Mesh>& meshes) {
+  auto node = std::make_shared<Node>();
+
+  node->name        = readString(reader);
+  node->matrix_orig = readValue<ci::mat4>(reader);
+  node->matrix      = node->matrix_orig;
+
+  auto num_meshes = readValue<uint32_t>(reader);
+  for (uint32_t i = 0; (i < num_meshes) && !reader.error; ++i) {
+    auto index = readValue<u_int>(reader);
+    if (index >= meshes.size()) {
+      reader.error = true;
+      break;
+    }
+    node->mesh.push_back({ index, std::vector<ci::mat4>(meshes[index].bones.size()), 0 });
+  }
+
+  auto num_children = readValue<uint32_t>(reader);
+  for (uint32_t i = 0; (i < num_children) && !reader.error; ++i) {
+    node->children.push_back(readNode(reader, meshes));
+  }
+
+  return node;
+}
+
+
+// アニメーション
+//   名前、長さ、チャンネルはモデルのデータに、キーはクリップファイルに書く
+void writeAnimInfo(CookedWriter& writer, const Anim& anim) {
+  writeString(writer, anim.name);
+  writeValue(writer, anim.duration);
+
+  writeValue(writer, uint32_t(anim.body.size()));
+  for (const auto& body : anim.body) {
+    writeString(writer, body.node_name);
+  }
+}
+
+Anim readAnimInfo(CookedReader& reader) {
+  Anim anim;
+
+  anim.name     = readString(reader);
+  anim.duration = readValue<double>(reader);
+
+  auto num = readValue<uint32_t>(reader);
+  for (uint32_t i = 0; (i < num) && !reader.error; ++i) {
+    NodeAnim body;
+    body.node_name = readString(reader);
+
+    anim.body.push_back(std::move(body));
+  }
+
+  return anim;
+}
+
+void writeAnimKeys(CookedWriter& writer, const Anim& anim) {
+  writeValue(writer, uint32_t(anim.body.size()));
+  for (const auto& body : anim.body) {
+    writeArray(writer, body.translate);
+    writeArray(writer, body.scaling);
+    writeArray(writer, body.rotation);
+  }
+}
+
+// キーだけを読む(名前は空)
+Anim readAnimKeys(CookedReader& reader) {
+  Anim anim;
+  anim.duration = 0.0;
+
+  auto num = readValue<uint32_t>(reader);
+  for (uint32_t i = 0; (i < num) && !reader.error; ++i) {
+    NodeAnim body;
+    body.translate = readArray<VectorKey>(reader);
+    body.scaling   = readArray<VectorKey>(reader);
+    body.rotation  = readArray<QuatKey>(reader);
+
+    anim.body.push_back(std::move(body));
+  }
+
+  return anim;
+}
@@ -0,0 +1,143 @@
+﻿#pragma once
+
+//
+// 毎フレームの処理で使うメモリ
+//   FrameArena フレームの中だけで使う一時データ。先頭から切り出し、次のフレームでまとめて捨てる
+//   Pool       インスタンスごとの状態。数が減っても要素を捨てず、確保済みの容量ごと使い回す
+//   どちらも最初の数フレームで必要な大きさになった後はヒープを使わない
+//
+
+#include <vector>
+#include <algorithm>
+#include <memory>
+#include <cstddef>
+#include <cstdint>
+
+
+struct FrameArena {
+  FrameArena(const size_t block_size = 64 * 1024)
+    : block_size(block_size),
+      block_index(0),
+      offset(0)
+  {}
+
+  struct Block {
+    std::unique_ptr<uint8_t[]> data;
+    size_t size;
+  };
+  std::vector<Block> blocks;
+  size_t block_size;
+
+  // 切り出し中の位置
+  size_t block_index;
+  size_t offset;
+};
+
+
+void* allocateFrameArena(FrameArena& arena, const size_t bytes, const size_t align) {
+  while (arena.block_index < arena.blocks.size()) {
+    auto& block = arena.blocks[arena.block_index];
+    size_t aligned = (arena.offset + align - 1) & ~(align - 1);
+    if (aligned + bytes <= block.size) {
+      arena.offset = aligned + bytes;
+      return block.data.get() + aligned;
+    }
+
+    arena.block_index += 1;
+    arena.offset = 0;
+  }
+
+  // 足りなければブロックを追加(new[]の境界はalignof(max_align_t)に揃っている)
+  size_t size = std::max(arena.block_size, bytes);
+  arena.blocks.push_back({ std::unique_ptr<uint8_t[]>(new uint8_t[size]), size });
+  arena.block_index = arena.blocks.size() - 1;
+  arena.offset = bytes;
+  return arena.blocks.back().data.get();
+}
+
+// 切り出したメモリを全て捨てる(デストラクタは呼ばない)
+//   複数のブロックを使っていたら、次からは1つで足りるようにまとめる
+void resetFrameArena(FrameArena& arena) {
+  if (arena.blocks.size() > 1) {
+    size_t total = 0;
+    for (const auto& block : arena.blocks) {
+      total += block.size;
+    }
+    arena.blocks.clear();
+    arena.blocks.push_back({ std::unique_ptr<uint8_t[]>(new uint8_t[total]), total });
+  }
+
+  arena.block_index = 0;
+  arena.offset = 0;
+}
+
+
+// FrameArenaから切り出すアロケータ
+//   std::vectorなどに渡す。解放は何もしない
+template <typename T>
+struct ArenaAllocator {
+  using value_type = T;
+
+  ArenaAllocator(FrameArena& arena)
+    : arena(&arena)
+  {}
+
+  template <typename U>
+  ArenaAllocator(const ArenaAllocator<U>& rhs)
+    : arena(rhs.arena)
+  {}
+
+  T* allocate(const size_t n) {
+    return static_cast<T*>(allocateFrameArena(*arena, sizeof(T) * n, alignof(T)));
+  }
+
+  void deallocate(T*, size_t) {}
+
+  FrameArena* arena;
+};
+
+template <typename T, typename U>
+bool operator==(const ArenaAllocator<T>& lhs, const ArenaAllocator<U>& rhs) {
+  return lhs.arena == rhs.arena;
+}
+
+template <typename T, typename U>
+bool operator!=(const ArenaAllocator<T>& lhs, const ArenaAllocator<U>& rhs) {
+  return lhs.arena != rhs.arena;
+}
+
+
+// 使い終わった要素を捨てずに次で使い回す
+//   要素が持つstd::vectorなどの容量もそのまま残る
+template <typename T>
+struct Pool {
+  Pool()
+    : num(0)
+  {}
+
+  // 先頭のnum個が使用中
+  std::vector<T> items;
+  size_t num;
+
+  size_t size() const { return num; }
+  bool empty() const { return num == 0; }
+
+  T& operator[](const size_t i) { return items[i]; }
+  const T& operator[](const size_t i) const { return items[i]; }
+
+  const T& front() const { return items.front(); }
+};
+
+// 使用中の数を変える
+//   増やす時だけ要素を作る
+template <typename T>
+void resizePool(Pool<T>& pool, const size_t num) {
+  if (pool.items.size() < num) pool.items.resize(num);
+  pool.num = num;
+}
+
+// 全て未使用にする(要素は残す)
+template <typename T>
+void clearPool(Pool<T>& pool) {
+  pool.num = 0;
+}
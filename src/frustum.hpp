@@ -0,0 +1,93 @@
+﻿#pragma once
+
+//
+// 視錐台カリング
+//
+
+#include <cinder/AxisAlignedBox.h>
+#include <cinder/Matrix44.h>
+#include <vector>
+#include <limits>
+
+
+struct Frustum {
+  // ax + by + cz + d >= 0 が内側
+  ci::vec4 planes[6];
+};
+
+
+// 座標変換行列から視錐台の平面を取り出す
+//   ビュー×射影行列を渡せばワールド座標
+//   モデル行列まで含めればモデルのローカル座標での視錐台になる
+Frustum createFrustum(const ci::mat4& m) {
+  // TIPS:glmの行列はcolumn-major
+  ci::vec4 row[4];
+  for (int i = 0; i < 4; ++i) {
+    row[i] = ci::vec4(m[0][i], m[1][i], m[2][i], m[3][i]);
+  }
+
+  Frustum frustum;
+  frustum.planes[0] = row[3] + row[0];      // 左
+  frustum.planes[1] = row[3] - row[0];      // 右
+  frustum.planes[2] = row[3] + row[1];      // 下
+  frustum.planes[3] = row[3] - row[1];      // 上
+  frustum.planes[4] = row[3] + row[2];      // 手前
+  frustum.planes[5] = row[3] - row[2];      // 奥
+
+  return frustum;
+}
+
+// AABBが視錐台と交差しているか調べる
+//   平面の法線方向に一番遠い頂点が外側なら、箱全体が外側
+bool isVisible(const Frustum& frustum, const ci::AxisAlignedBox& aabb) {
+  const auto& min_vtx = aabb.getMin();
+  const auto& max_vtx = aabb.getMax();
+
+  for (const auto& plane : frustum.planes) {
+    ci::vec3 p{ plane.x >= 0.0f ? max_vtx.x : min_vtx.x,
+                plane.y >= 0.0f ? max_vtx.y : min_vtx.y,
+                plane.z >= 0.0f ? max_vtx.z : min_vtx.z };
+
+    if ((plane.x * p.x + plane.y * p.y + plane.z * p.z + plane.w) < 0.0f) return false;
+  }
+
+  return true;
+}
+
+
+// 頂点列を包むAABBを求める
+ci::AxisAlignedBox createAABB(const std::vector<ci::vec3>& positions) {
+  if (positions.empty()) return ci::AxisAlignedBox();
+
+  ci::vec3 min_vtx = positions[0];
+  ci::vec3 max_vtx = positions[0];
+  for (const auto& p : positions) {
+    min_vtx = glm::min(min_vtx, p);
+    max_vtx = glm::max(max_vtx, p);
+  }
+
+  return ci::AxisAlignedBox(min_vtx, max_vtx);
+}
+
+// AABBをアフィン変換して、それを包むAABBを求める
+//   ８頂点を変換する代わりに中心と半径で計算
+ci::AxisAlignedBox transformAABB(const ci::AxisAlignedBox& aabb, const ci::mat4& m) {
+  ci::vec3 center  = (aabb.getMin() + aabb.getMax()) * 0.5f;
+  ci::vec3 extents = (aabb.getMax() - aabb.getMin()) * 0.5f;
+
+  ci::vec3 new_center(m * ci::vec4(center, 1.0f));
+  ci::vec3 new_extents;
+  for (int i = 0; i < 3; ++i) {
+    new_extents[i] = std::abs(m[0][i]) * extents.x
+                   + std::abs(m[1][i]) * extents.y
+                   + std::abs(m[2][i]) * extents.z;
+  }
+
+  return ci::AxisAlignedBox(new_center - new_extents, new_center + new_extents);
+}
+
+// ２つのAABBを包むAABBを求める
+ci::AxisAlignedBox mergeAABB(const ci::AxisAlignedBox& a, const ci::AxisAlignedBox& b) {
+  return ci::AxisAlignedBox(glm::min(a.getMin(), b.getMin()),
+                            glm::max(a.getMax(), b.getMax()));
+}
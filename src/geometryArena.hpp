@@ -0,0 +1,214 @@
+﻿#pragma once
+
+//
+// メッシュのバッファをまとめる
+//   頂点属性の組み合わせが同じメッシュの頂点とインデックスを
+//   ひとつのVboMeshに詰め込み、各メッシュは範囲で描画する
+//   インデックスは詰め込んだ位置に合わせて書き換えておく
+//   (ES3.0にはbase vertex付きの描画が無いため)
+//
+
+#include <vector>
+#include <map>
+#include <limits>
+#include <cinder/gl/Vao.h>
+#include "mesh.hpp"
+#include "profiler.hpp"
+
+
+// 同じ状態の描画をglMultiDrawElementsIndirectでまとめる
+//   ESには無く、macOSのGLは4.1までで関数が宣言されていないので、範囲ごとに描画する
+#if !defined (CINDER_GL_ES) && !defined (CINDER_MAC)
+#define USE_MULTI_DRAW_INDIRECT
+#endif
+
+// まとめたバッファ
+struct GeometryGroup {
+  // 頂点属性の組み合わせ
+  u_int format;
+
+  // GPUへ転送したら空にする
+  TriMesh body;
+  ci::gl::VboMeshRef vbo_mesh;
+};
+
+
+// 頂点属性の組み合わせを数値化
+u_int getVertexFormat(const TriMesh& body) {
+  u_int format = 0;
+  for (auto attrib : body.getAvailableAttribs()) {
+    format |= 1 << u_int(attrib);
+  }
+  return format;
+}
+
+// ひとつのバッファに入れられる頂点数
+//   インデックスが16bitならその範囲に収める
+size_t getMaxGroupVertices() {
+  return (sizeof(element_t) == 2) ? std::numeric_limits<uint16_t>::max() + size_t(1)
+                                  : std::numeric_limits<uint32_t>::max();
+}
+
+
+template <typename T>
+void appendArray(std::vector<T>& dst, const std::vector<T>& src) {
+  dst.insert(std::end(dst), std::begin(src), std::end(src));
+}
+
+// メッシュをまとめる
+//   GLは使わないので別スレッドから呼んでも良い
+//   各メッシュのgeometry_group、first_index、index_count、vertex_countを決める
+std::vector<GeometryGroup> createGeometryGroups(std::vector<Mesh>& meshes) {
+  std::vector<GeometryGroup> groups;
+
+  // 頂点属性の組み合わせごとに、現在詰め込んでいるグループ
+  std::map<u_int, size_t> current_group;
+
+  struct Arrays {
+    std::vector<ci::vec3> positions;
+    std::vector<ci::vec3> normals;
+    std::vector<ci::vec2> uvs;
+    std::vector<ci::ColorA> colors;
+    std::vector<uint32_t> indices;
+    std::vector<index_t> bone_indices;
+    std::vector<ci::vec4> bone_weights;
+  };
+  std::vector<Arrays> arrays;
+
+  for (auto& mesh : meshes) {
+    const auto& body = mesh.body;
+    u_int format = getVertexFormat(body);
+
+    auto it = current_group.find(format);
+    if ((it == current_group.end())
+        || (arrays[it->second].positions.size() + body.getNumVertices() > getMaxGroupVertices())) {
+      // 新しいグループを作る
+      groups.push_back(GeometryGroup{ format, TriMesh(), ci::gl::VboMeshRef() });
+      arrays.push_back(Arrays());
+      current_group[format] = groups.size() - 1;
+      it = current_group.find(format);
+    }
+
+    auto& a = arrays[it->second];
+    uint32_t base_vertex = uint32_t(a.positions.size());
+
+    mesh.geometry_group = u_int(it->second);
+    mesh.first_index    = u_int(a.indices.size());
+    mesh.index_count    = u_int(body.getNumIndices());
+    mesh.vertex_count   = u_int(body.getNumVertices());
+
+    appendArray(a.positions,    body.getPositions());
+    appendArray(a.normals,      body.getNormals());
+    appendArray(a.uvs,          body.getTexCoords());
+    appendArray(a.colors,       body.getColors());
+    appendArray(a.bone_indices, body.getBoneIndices());
+    appendArray(a.bone_weights, body.getBoneWeights());
+    for (auto index : body.getIndices()) {
+      a.indices.push_back(index + base_vertex);
+    }
+  }
+
+  for (size_t i = 0; i < groups.size(); ++i) {
+    auto& a = arrays[i];
+    auto& body = groups[i].body;
+    body.setPositions(std::move(a.positions));
+    body.setNormals(std::move(a.normals));
+    body.setTexCoords(std::move(a.uvs));
+    body.setColors(std::move(a.colors));
+    body.setIndices(std::move(a.indices));
+    body.setBoneIndices(std::move(a.bone_indices));
+    body.setBoneWeights(std::move(a.bone_weights));
+  }
+
+  return groups;
+}
+
+// グループをひとつGPUへ転送
+//   所属するメッシュはまとめたバッファを参照する
+void uploadGeometryGroup(GeometryGroup& group, const u_int index, std::vector<Mesh>& meshes) {
+  group.vbo_mesh = ci::gl::VboMesh::create(group.body);
+  group.body = TriMesh();
+
+  for (auto& mesh : meshes) {
+    if (mesh.geometry_group == index) mesh.vbo_mesh = group.vbo_mesh;
+  }
+}
+
+// まとめずにメッシュ単体で使う場合の範囲
+void setupMeshRange(Mesh& mesh) {
+  mesh.geometry_group = 0;
+  mesh.first_index    = 0;
+  mesh.index_count    = u_int(mesh.body.getNumIndices());
+  mesh.vertex_count   = u_int(mesh.body.getNumVertices());
+}
+
+
+// VboMeshとシェーダーの組み合わせごとのVAO
+//   VboMeshが破棄されたら作り直す
+struct VaoCache {
+  struct Entry {
+    std::weak_ptr<ci::gl::VboMesh> vbo_mesh;
+    ci::gl::VaoRef vao;
+  };
+  std::map<std::pair<const ci::gl::VboMesh*, const ci::gl::GlslProg*>, Entry> entries;
+};
+
+// VAOを取り出す
+//   無ければ作る(インスタンス用のバッファは先に追加しておくこと)
+const ci::gl::VaoRef& getMeshVao(VaoCache& cache, const ci::gl::VboMeshRef& vbo_mesh, const ci::gl::GlslProgRef& prog) {
+  auto& entry = cache.entries[std::make_pair(vbo_mesh.get(), prog.get())];
+  if (entry.vao && (entry.vbo_mesh.lock() == vbo_mesh)) return entry.vao;
+
+  entry.vbo_mesh = vbo_mesh;
+  entry.vao      = ci::gl::Vao::create();
+
+  ci::gl::ScopedVao scoped_vao(entry.vao);
+  vbo_mesh->buildVao(prog);
+  return entry.vao;
+}
+
+// 破棄されたVboMeshのVAOを捨てる
+void purgeVaoCache(VaoCache& cache) {
+  for (auto it = cache.entries.begin(); it != cache.entries.end(); ) {
+    if (it->second.vbo_mesh.expired()) {
+      it = cache.entries.erase(it);
+    }
+    else {
+      ++it;
+    }
+  }
+}
+
+
+#if defined (USE_MULTI_DRAW_INDIRECT)
+
+// 実行時に使えるか(4.3以降か拡張)
+//   コマンドごとのインスタンスの位置をbaseInstanceで渡すので、4.2か拡張も要る
+bool isMultiDrawIndirectSupported() {
+  static const bool supported = (ci::gl::getVersion() >= std::make_pair(GLint(4), GLint(3)))
+                             || (ci::gl::isExtensionAvailable("GL_ARB_multi_draw_indirect")
+                                 && ((ci::gl::getVersion() >= std::make_pair(GLint(4), GLint(2)))
+                                     || ci::gl::isExtensionAvailable("GL_ARB_base_instance")));
+  return supported;
+}
+
+#endif
+
+
+// メッシュの範囲を描画
+//   VAOとシェーダーは束縛済みであること
+void drawMeshRange(const Mesh& mesh, const GLsizei instance_num = 1) {
+  GLenum type = mesh.vbo_mesh->getIndexDataType();
+  size_t index_size = (type == GL_UNSIGNED_SHORT) ? 2 : 4;
+  auto offset = reinterpret_cast<const GLvoid*>(mesh.first_index * index_size);
+
+  countProfile(PROFILE_DRAWS);
+  countProfile(PROFILE_TRIANGLES, (mesh.index_count / 3) * instance_num);
+
+  if (instance_num > 1) {
+    glDrawElementsInstanced(GL_TRIANGLES, GLsizei(mesh.index_count), type, offset, instance_num);
+  }
+  else {
+    glDrawElements(GL_TRIANGLES, GLsizei(mesh.index_count), type, offset);
+  }
+}
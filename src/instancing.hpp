@@ -0,0 +1,209 @@
+﻿#pragma once
+
+//
+// インスタンス描画
+//   同じモデルを異なる位置、姿勢で複数描画する
+//   メッシュごとに全インスタンスを1回で描画する
+//   インスタンスごとの行列とボーン行列の開始位置は頂点属性で渡し
+//   ボーン行列は全インスタンス分をテクスチャにまとめる
+//
+
+#include <map>
+#include <vector>
+#include <cstddef>
+#include "model.hpp"
+#include "pose.hpp"
+
+
+struct DrawInstance {
+  // モデル行列
+  ci::mat4 matrix;
+  const Pose* pose;
+};
+
+// 頂点属性として渡すインスタンスごとの値
+struct InstanceRecord {
+  ci::mat4 matrix;
+  float palette_offset;
+};
+
+enum {
+  // 1回の描画でのインスタンスの最大数
+  INSTANCE_BATCH_SIZE   = 256,
+  // ボーン行列テクスチャの幅(4の倍数)
+  PALETTE_TEXTURE_WIDTH = 1024,
+};
+
+
+struct InstanceRenderer {
+  struct InstanceVbo {
+    std::weak_ptr<ci::gl::VboMesh> vbo_mesh;
+    ci::gl::VboRef vbo;
+  };
+  // メッシュに追加したインスタンス用のバッファ
+  std::map<const ci::gl::VboMesh*, InstanceVbo> instance_vbos;
+
+  // メッシュ(グループ)とシェーダーごとのVAO
+  VaoCache vao_cache;
+
+  ci::gl::Texture2dRef palette_texture;
+
+  // 作業用
+  std::vector<ci::mat4> palette;
+  std::vector<InstanceRecord> records;
+};
+
+
+// メッシュにインスタンス用のバッファを追加する
+//   初回のみ追加し、以降は内容だけを書き換える
+//   同じVboMeshに別のInstanceRendererから追加すると、後から作ったVAOは後のバッファを使うので
+//   描画キューとインスタンス描画で同じInstanceRendererを使う
+const ci::gl::VboRef& getInstanceVbo(InstanceRenderer& renderer, const ci::gl::VboMeshRef& vbo_mesh) {
+  auto& instance_vbo = renderer.instance_vbos[vbo_mesh.get()];
+  if (instance_vbo.vbo && (instance_vbo.vbo_mesh.lock() == vbo_mesh)) return instance_vbo.vbo;
+
+  auto vbo = ci::gl::Vbo::create(GL_ARRAY_BUFFER, sizeof(InstanceRecord) * INSTANCE_BATCH_SIZE, nullptr, GL_STREAM_DRAW);
+
+  // シェーダーの名前との対応はcreateShaderFormatで指定する
+  ci::geom::BufferLayout layout;
+  layout.append(ci::geom::CUSTOM_0, 4, sizeof(InstanceRecord), sizeof(ci::vec4) * 0, 1);
+  layout.append(ci::geom::CUSTOM_1, 4, sizeof(InstanceRecord), sizeof(ci::vec4) * 1, 1);
+  layout.append(ci::geom::CUSTOM_2, 4, sizeof(InstanceRecord), sizeof(ci::vec4) * 2, 1);
+  layout.append(ci::geom::CUSTOM_3, 4, sizeof(InstanceRecord), sizeof(ci::vec4) * 3, 1);
+  layout.append(ci::geom::CUSTOM_4, 1, sizeof(InstanceRecord), offsetof(InstanceRecord, palette_offset), 1);
+  vbo_mesh->appendVbo(layout, vbo);
+
+  instance_vbo.vbo_mesh = vbo_mesh;
+  instance_vbo.vbo      = vbo;
+  return instance_vbo.vbo;
+}
+
+// 破棄されたメッシュのバッファを捨てる
+void purgeInstanceVbos(InstanceRenderer& renderer) {
+  for (auto it = renderer.instance_vbos.begin(); it != renderer.instance_vbos.end(); ) {
+    if (it->second.vbo_mesh.expired()) {
+      it = renderer.instance_vbos.erase(it);
+    }
+    else {
+      ++it;
+    }
+  }
+}
+
+
+// ボーン行列をテクスチャへ転送
+//   行列ひとつを横に並んだ4テクセルに格納する
+void uploadPalette(InstanceRenderer& renderer) {
+  const size_t matrices_per_row = PALETTE_TEXTURE_WIDTH / 4;
+  size_t rows = std::max((renderer.palette.size() + matrices_per_row - 1) / matrices_per_row, size_t(1));
+  renderer.palette.resize(rows * matrices_per_row);
+
+  if (!renderer.palette_texture || (size_t(renderer.palette_texture->getHeight()) < rows)) {
+    // 足りなくなったら作り直す
+    int height = int2pow(int(rows));
+    renderer.palette_texture = ci::gl::Texture2d::create(PALETTE_TEXTURE_WIDTH, height,
+                                                         ci::gl::Texture2d::Format()
+                                                         .internalFormat(GL_RGBA32F)
+                                                         .minFilter(GL_NEAREST)
+                                                         .magFilter(GL_NEAREST));
+  }
+
+  ci::gl::ScopedTextureBind bind(renderer.palette_texture);
+  glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, PALETTE_TEXTURE_WIDTH, GLsizei(rows),
+                  GL_RGBA, GL_FLOAT, renderer.palette.data());
+}
+
+
+// モデルを全インスタンス分描画
+//   モデル行列はその時点の値をインスタンスの行列に掛ける
+//   reverseならノードとメッシュを逆順に描画する
+void drawModelInstanced(const Model& model,
+                        const std::vector<DrawInstance>& instances,
+                        const ShaderHolder& shader_holder,
+                        InstanceRenderer& renderer,
+                        const bool reverse = false) {
+  if (instances.empty()) return;
+
+  ProfileZone profile_zone("drawModelInstanced");
+
+  purgeInstanceVbos(renderer);
+  purgeVaoCache(renderer.vao_cache);
+
+  const auto model_matrix = ci::gl::getModelMatrix();
+#if defined (USE_FRUSTUM_CULLING)
+  const auto view_projection = ci::gl::getProjectionMatrix() * ci::gl::getViewMatrix();
+#endif
+
+  // 全インスタンスのボーン行列をまとめる
+  bool has_palette = model.palette_size > 0;
+  if (has_palette) {
+    renderer.palette.clear();
+    for (const auto& instance : instances) {
+      renderer.palette.insert(std::end(renderer.palette),
+                              std::begin(instance.pose->palette), std::end(instance.pose->palette));
+    }
+    uploadPalette(renderer);
+    countProfile(PROFILE_UNIFORMS);
+    renderer.palette_texture->bind(PALETTE_TEXTURE_UNIT);
+  }
+
+  const size_t node_num = model.node_list.size();
+  for (size_t k = 0; k < node_num; ++k) {
+    size_t n = reverse ? (node_num - 1 - k) : k;
+    const auto& node = model.node_list[n];
+
+    const size_t ref_num = node->mesh.size();
+    for (size_t j = 0; j < ref_num; ++j) {
+      const auto& ref  = node->mesh[reverse ? (ref_num - 1 - j) : j];
+      const auto& mesh = model.mesh[ref.index];
+
+      // 画面内のインスタンスだけを集める
+      renderer.records.clear();
+      for (size_t i = 0; i < instances.size(); ++i) {
+        const auto& instance = instances[i];
+        const auto matrix = model_matrix * instance.matrix * instance.pose->node_matrices[n];
+
+#if defined (USE_FRUSTUM_CULLING)
+        const auto frustum = createFrustum(view_projection * matrix);
+        const auto& aabb = mesh.has_bone ? calcSkinnedAABB(mesh, &instance.pose->palette[ref.palette_offset])
+                                         : mesh.aabb;
+        if (!isVisible(frustum, aabb)) continue;
+#endif
+
+        renderer.records.push_back({ matrix, float(i * model.palette_size + ref.palette_offset) });
+      }
+      if (renderer.records.empty()) continue;
+
+      const auto& shader   = shader_holder.at(mesh.shader_index | SHADER_INSTANCING);
+      const auto& material = model.material[mesh.material_index];
+
+      shader.prog->bind();
+      model.material_ubo->bindBufferRange(MATERIAL_BLOCK_BINDING,
+                                          mesh.material_index * model.material_stride,
+                                          sizeof(MaterialBlock));
+
+      const auto texture = getMaterialTexture(model, material);
+      if (texture.id) bindMaterialTexture(texture, material);
+
+      // 他のメッシュとまとめたバッファでも、インスタンス用のバッファは共有できる
+      const auto& vbo = getInstanceVbo(renderer, mesh.vbo_mesh);
+      ci::gl::ScopedVao scoped_vao(getMeshVao(renderer.vao_cache, mesh.vbo_mesh, shader.prog));
+      ci::gl::context()->setDefaultShaderVars();
+      countProfile(PROFILE_UNIFORMS);
+
+      for (size_t i = 0; i < renderer.records.size(); i += INSTANCE_BATCH_SIZE) {
+        size_t num = std::min(renderer.records.size() - i, size_t(INSTANCE_BATCH_SIZE));
+
+        // 書き換え前の内容で描画中でも待たないように、毎回確保し直す
+        vbo->bufferData(sizeof(InstanceRecord) * num, &renderer.records[i], GL_STREAM_DRAW);
+        drawMeshRange(mesh, GLsizei(num));
+      }
+
+      if (texture.id) unbindMaterialTexture(texture);
+    }
+  }
+
+  if (has_palette) {
+    renderer.palette_texture->unbind(PALETTE_TEXTURE_UNIT);
+  }
+}
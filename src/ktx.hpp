@@ -0,0 +1,178 @@
+﻿#pragma once
+
+//
+// KTX(1.1)形式の読み書き
+//   圧縮テクスチャをミップマップごと保存する
+//   https://www.khronos.org/opengles/sdk/tools/KTX/file_format_spec/
+//
+
+#include <fstream>
+#include <string>
+#include <vector>
+#include <utility>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+
+
+struct KtxImage {
+  KtxImage()
+    : gl_internal_format(0),
+      gl_base_internal_format(0),
+      width(0),
+      height(0)
+  {}
+
+  uint32_t gl_internal_format;
+  uint32_t gl_base_internal_format;
+  uint32_t width;
+  uint32_t height;
+
+  // 任意のキーと値(値は文字列のみ扱う)
+  std::vector<std::pair<std::string, std::string> > key_values;
+
+  // ミップマップの各レベルのデータ
+  std::vector<std::vector<uint8_t> > levels;
+};
+
+
+const uint8_t ktx_identifier[12] = {
+  0xAB, 'K', 'T', 'X', ' ', '1', '1', 0xBB, '\r', '\n', 0x1A, '\n'
+};
+
+enum {
+  KTX_ENDIANNESS = 0x04030201,
+};
+
+
+// 書き出し
+//   圧縮テクスチャ専用なのでglType、glFormatは0
+bool writeKtx(const std::string& path, const KtxImage& image) {
+  std::ofstream ofs(path, std::ios::binary);
+  if (!ofs) return false;
+
+  auto write32 = [&ofs](const uint32_t value) {
+    ofs.write(reinterpret_cast<const char*>(&value), sizeof(value));
+  };
+  auto padding = [&ofs](const size_t size) {
+    static const char zero[4] = {};
+    ofs.write(zero, (4 - size % 4) % 4);
+  };
+
+  // キーと値の合計サイズ
+  uint32_t key_value_size = 0;
+  for (const auto& kv : image.key_values) {
+    uint32_t size = uint32_t(kv.first.size() + 1 + kv.second.size() + 1);
+    key_value_size += 4 + size + (4 - size % 4) % 4;
+  }
+
+  ofs.write(reinterpret_cast<const char*>(ktx_identifier), sizeof(ktx_identifier));
+  write32(KTX_ENDIANNESS);
+  write32(0);                                 // glType
+  write32(1);                                 // glTypeSize
+  write32(0);                                 // glFormat
+  write32(image.gl_internal_format);
+  write32(image.gl_base_internal_format);
+  write32(image.width);
+  write32(image.height);
+  write32(0);                                 // pixelDepth
+  write32(0);                                 // numberOfArrayElements
+  write32(1);                                 // numberOfFaces
+  write32(uint32_t(image.levels.size()));
+  write32(key_value_size);
+
+  for (const auto& kv : image.key_values) {
+    uint32_t size = uint32_t(kv.first.size() + 1 + kv.second.size() + 1);
+    write32(size);
+    ofs.write(kv.first.c_str(), kv.first.size() + 1);
+    ofs.write(kv.second.c_str(), kv.second.size() + 1);
+    padding(size);
+  }
+
+  for (const auto& level : image.levels) {
+    write32(uint32_t(level.size()));
+    ofs.write(reinterpret_cast<const char*>(level.data()), level.size());
+    padding(level.size());
+  }
+
+  return bool(ofs);
+}
+
+
+// 読み込み
+//   header_onlyがtrueならキーと値まで読む
+bool readKtx(const uint8_t* data, const size_t size, KtxImage& image,
+             const bool header_only = false) {
+  const uint8_t* ptr = data;
+  const uint8_t* end = data + size;
+
+  auto read32 = [&ptr, end](uint32_t& value) {
+    if (size_t(end - ptr) < sizeof(value)) return false;
+    std::memcpy(&value, ptr, sizeof(value));
+    ptr += sizeof(value);
+    return true;
+  };
+
+  if ((size < sizeof(ktx_identifier)) || std::memcmp(data, ktx_identifier, sizeof(ktx_identifier))) return false;
+  ptr += sizeof(ktx_identifier);
+
+  uint32_t header[13];
+  for (auto& value : header) {
+    if (!read32(value)) return false;
+  }
+
+  // 異なるエンディアンで書かれたものは扱わない
+  if (header[0] != KTX_ENDIANNESS) return false;
+
+  image.gl_internal_format      = header[4];
+  image.gl_base_internal_format = header[5];
+  image.width                   = header[6];
+  image.height                  = header[7];
+
+  uint32_t num_levels     = std::max(header[11], 1u);
+  uint32_t key_value_size = header[12];
+  if (size_t(end - ptr) < key_value_size) return false;
+
+  const uint8_t* kv_end = ptr + key_value_size;
+  image.key_values.clear();
+  while (ptr < kv_end) {
+    uint32_t kv_size;
+    if (!read32(kv_size) || (size_t(kv_end - ptr) < kv_size)) return false;
+
+    const char* kv = reinterpret_cast<const char*>(ptr);
+    size_t key_length = strnlen(kv, kv_size);
+    std::string key(kv, key_length);
+    std::string value;
+    if (key_length + 1 < kv_size) {
+      const char* v = kv + key_length + 1;
+      value.assign(v, strnlen(v, kv_size - key_length - 1));
+    }
+    image.key_values.push_back(std::make_pair(key, value));
+
+    ptr += kv_size + (4 - kv_size % 4) % 4;
+  }
+  ptr = kv_end;
+
+  if (header_only) return true;
+
+  image.levels.clear();
+  for (uint32_t i = 0; i < num_levels; ++i) {
+    uint32_t level_size;
+    if (!read32(level_size) || (size_t(end - ptr) < level_size)) return false;
+
+    image.levels.emplace_back(ptr, ptr + level_size);
+    ptr += level_size;
+    ptr += std::min(size_t(end - ptr), size_t((4 - level_size % 4) % 4));
+  }
+
+  return true;
+}
+
+
+// キーから値を探す
+std::string findKtxValue(const KtxImage& image, const std::string& key) {
+  for (const auto& kv : image.key_values) {
+    if (kv.first == key) return kv.second;
+  }
+  return std::string();
+}
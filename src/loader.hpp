@@ -0,0 +1,142 @@
+﻿#pragma once
+
+//
+// モデルの非同期読み込み
+//   ファイル読み込みと変換は別スレッドでおこない
+//   GPUへの転送はメインスレッドで少しずつおこなう
+//
+
+#include <future>
+#include <chrono>
+#include <string>
+#include <vector>
+#include "model.hpp"
+
+
+struct ModelLoader {
+  ModelLoader()
+    : state(IDLE),
+      retention(RETAIN_ALL),
+      upload_index(0)
+  {}
+
+  enum State {
+    IDLE,
+    READING,             // 別スレッドで読み込み中
+    UPLOADING,           // GPUへ転送中
+  };
+  State state;
+
+  std::string path;
+  std::future<Model> future;
+
+  // 転送後にCPU側へ残すデータ
+  MeshRetention retention;
+
+  // 読み込み中に次のファイルが指定された
+  std::string next_path;
+
+  // 転送中のモデル
+  Model model;
+  size_t upload_index;
+};
+
+
+// 読み込みを開始
+//   読み込み中なら、終わってから次を読み込む
+void startLoadModel(ModelLoader& loader, const std::string& path) {
+  if (loader.state != ModelLoader::IDLE) {
+    loader.next_path = path;
+    return;
+  }
+
+  loader.path   = path;
+  loader.future = std::async(std::launch::async, readModel, path, loader.retention);
+  loader.state  = ModelLoader::READING;
+}
+
+bool isLoadingModel(const ModelLoader& loader) {
+  return loader.state != ModelLoader::IDLE;
+}
+
+
+// 読み込みを進める
+//   毎フレーム呼び出す
+//   GPUへの転送はtime_budget秒を超えない範囲でおこなう(最低でもひとつは転送する)
+//   全て終わったらtrueを返すので、loader.modelを取り出して使う
+bool updateLoadModel(ModelLoader& loader, const double time_budget) {
+  using Clock = std::chrono::steady_clock;
+  const auto start_time = Clock::now();
+
+  switch (loader.state) {
+  case ModelLoader::IDLE:
+    return false;
+
+  case ModelLoader::READING:
+    {
+      if (loader.future.wait_for(std::chrono::seconds(0)) != std::future_status::ready) return false;
+
+      loader.model = loader.future.get();
+
+      if (!loader.next_path.empty()) {
+        // 次のファイルが指定されていたら、読み込んだものは捨てる
+        loader.model = Model();
+        loader.state = ModelLoader::IDLE;
+
+        auto path = loader.next_path;
+        loader.next_path.clear();
+        startLoadModel(loader, path);
+        return false;
+      }
+
+      // マテリアルは小さいのですぐ転送
+      uploadMaterials(loader.model);
+
+      loader.upload_index = 0;
+      loader.state = ModelLoader::UPLOADING;
+    }
+    // 残り時間で転送を始める
+    // fall through
+
+  case ModelLoader::UPLOADING:
+    {
+      auto elapsed = [start_time]() {
+        return std::chrono::duration<double>(Clock::now() - start_time).count();
+      };
+
+      ProfileZone profile_zone("upload");
+
+      bool first = true;
+      while (first || (elapsed() < time_budget)) {
+        first = false;
+
+        if (hasPendingTexture(loader.model)) {
+          uploadNextTexture(loader.model);
+        }
+        else if (loader.upload_index < getUploadUnitNum(loader.model)) {
+          uploadUnit(loader.model, loader.upload_index);
+          loader.upload_index += 1;
+        }
+        else {
+          break;
+        }
+      }
+
+      if (hasPendingTexture(loader.model) || (loader.upload_index < getUploadUnitNum(loader.model))) return false;
+
+      loader.state = ModelLoader::IDLE;
+
+      if (!loader.next_path.empty()) {
+        // 転送中に次のファイルが指定された
+        auto path = loader.next_path;
+        loader.next_path.clear();
+        startLoadModel(loader, path);
+        loader.model = Model();
+        return false;
+      }
+    }
+    return true;
+  }
+
+  return false;
+}
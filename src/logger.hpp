@@ -0,0 +1,256 @@
+﻿#pragma once
+
+//
+// ログ
+//   重要度とカテゴリで絞り込み、出力は別スレッドでおこなう
+//   呼び出し側はメッセージを作ってキューに積むだけ(ロックもフラッシュも無い)
+//   時刻やカテゴリを付けた整形とgetConsole()への書き込みは出力スレッドがおこなう
+//     logInfo(LOG_IMPORT) << "Meshes:" << num;
+//   1回の呼び出しが1行になる(std::endlは要らない)
+//   無効な重要度とカテゴリの組み合わせは、<<の右辺を文字列にしない
+//
+
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <sstream>
+#include <iomanip>
+#include "misc.hpp"
+
+
+enum LogLevel {
+  LOG_DEBUG,
+  LOG_INFO,
+  LOG_WARNING,
+  LOG_ERROR,
+
+  // setLogLevelに渡すと全て出力しない
+  LOG_NONE
+};
+
+enum LogCategory {
+  LOG_GENERAL,
+  // 読み込みと変換(メッシュ、ノード、マテリアル、アニメーション)
+  LOG_IMPORT,
+  LOG_TEXTURE,
+  LOG_SHADER,
+  LOG_PROFILE,
+
+  LOG_CATEGORY_NUM
+};
+
+const char* const log_level_names[] = {
+  "debug", "info", "warning", "error",
+};
+
+const char* const log_category_names[LOG_CATEGORY_NUM] = {
+  "general", "import", "texture", "shader", "profile",
+};
+
+
+struct LogRecord {
+  LogLevel level;
+  LogCategory category;
+  // ログを開始してからの秒数
+  double time;
+  std::string text;
+
+  std::atomic<LogRecord*> next;
+};
+
+// 複数のスレッドから積み、出力スレッドだけが取り出すキュー
+//   積む側はアトミックな交換ひとつだけで待たない
+//   先頭には空のレコードを置いておく
+struct LogQueue {
+  LogQueue()
+    : stub{ LOG_DEBUG, LOG_GENERAL, 0.0, std::string(), { nullptr } },
+      head(&stub),
+      tail(&stub)
+  {}
+
+  LogRecord stub;
+  // 最後に積んだレコード(積む側が使う)
+  std::atomic<LogRecord*> head;
+  // 次に取り出すレコードのひとつ前(出力スレッドだけが使う)
+  LogRecord* tail;
+};
+
+void pushLogQueue(LogQueue& queue, LogRecord* record) {
+  record->next.store(nullptr, std::memory_order_relaxed);
+  auto prev = queue.head.exchange(record, std::memory_order_acq_rel);
+  prev->next.store(record, std::memory_order_release);
+}
+
+// 取り出したレコードはqueue.tailになり、次に取り出した時に解放できる
+//   積んでいる途中(headは変わったがnextが未設定)の場合は空として扱う
+LogRecord* popLogQueue(LogQueue& queue) {
+  auto next = queue.tail->next.load(std::memory_order_acquire);
+  if (!next) return nullptr;
+
+  if (queue.tail != &queue.stub) delete queue.tail;
+  queue.tail = next;
+  return next;
+}
+
+
+struct Logger {
+  Logger()
+    : start(std::chrono::steady_clock::now()),
+      pushed(0),
+      written(0),
+      quit(false)
+  {
+    // 項目ごとの詳細はデバッグ扱いなので、標準では概要だけが出る
+    for (auto& level : levels) {
+      level = LOG_INFO;
+    }
+    thread = std::thread([this]() { run(); });
+  }
+
+  ~Logger() {
+    stop();
+  }
+
+  // 残っているレコードを全て書き出してから終わる
+  void stop() {
+    if (!thread.joinable()) return;
+
+    quit = true;
+    thread.join();
+  }
+
+  void run() {
+    for (;;) {
+      // 終了の指示は、先に取り出しきってから確認する
+      bool stopping = quit.load();
+      bool any = false;
+      while (auto record = popLogQueue(queue)) {
+        write(*record);
+        written.fetch_add(1, std::memory_order_release);
+        any = true;
+      }
+
+      if (any) {
+        getConsole().flush();
+      }
+      else if (stopping) {
+        break;
+      }
+      else {
+        std::this_thread::sleep_for(std::chrono::milliseconds(2));
+      }
+    }
+
+    if (queue.tail != &queue.stub) delete queue.tail;
+    queue.tail = &queue.stub;
+  }
+
+  void write(const LogRecord& record) {
+    std::ostringstream line;
+    line << std::fixed << std::setprecision(3) << std::setw(9) << record.time
+         << " [" << log_level_names[record.level] << "][" << log_category_names[record.category] << "] "
+         << record.text << '\n';
+    getConsole() << line.str();
+  }
+
+  std::chrono::steady_clock::time_point start;
+  std::atomic<int> levels[LOG_CATEGORY_NUM];
+
+  LogQueue queue;
+  std::atomic<uint64_t> pushed;
+  std::atomic<uint64_t> written;
+
+  std::thread thread;
+  std::atomic<bool> quit;
+};
+
+
+Logger& getLogger() {
+  static Logger logger;
+  return logger;
+}
+
+// カテゴリごとに出力する最低の重要度を決める
+void setLogLevel(const LogCategory category, const LogLevel level) {
+  getLogger().levels[category].store(level, std::memory_order_relaxed);
+}
+
+void setLogLevel(const LogLevel level) {
+  for (int i = 0; i < LOG_CATEGORY_NUM; ++i) {
+    setLogLevel(LogCategory(i), level);
+  }
+}
+
+bool isLogEnabled(const LogCategory category, const LogLevel level) {
+  return level >= getLogger().levels[category].load(std::memory_order_relaxed);
+}
+
+void postLog(const LogCategory category, const LogLevel level, std::string text) {
+  auto& logger = getLogger();
+  if (!logger.thread.joinable()) return;
+
+  double time = std::chrono::duration<double>(std::chrono::steady_clock::now() - logger.start).count();
+  auto record = new LogRecord{ level, category, time, std::move(text), { nullptr } };
+  logger.pushed.fetch_add(1, std::memory_order_relaxed);
+  pushLogQueue(logger.queue, record);
+}
+
+// それまでに積んだレコードが書き出されるまで待つ
+void flushLog() {
+  auto& logger = getLogger();
+  auto target = logger.pushed.load();
+  while (logger.thread.joinable() && (logger.written.load(std::memory_order_acquire) < target)) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+}
+
+// 出力スレッドを止める(アプリの終了時に呼ぶ)
+//   以降のログは捨てる
+void stopLogger() {
+  getLogger().stop();
+}
+
+
+// 1行分のメッセージを作り、デストラクタで積む
+class LogStream {
+public:
+  LogStream(const LogCategory category, const LogLevel level)
+    : category(category),
+      level(level)
+  {
+    if (isLogEnabled(category, level)) stream.reset(new std::ostringstream);
+  }
+
+  LogStream(LogStream&& rhs)
+    : category(rhs.category),
+      level(rhs.level),
+      stream(std::move(rhs.stream))
+  {}
+
+  ~LogStream() {
+    if (stream) postLog(category, level, stream->str());
+  }
+
+  template <typename T>
+  LogStream& operator<<(const T& value) {
+    if (stream) *stream << value;
+    return *this;
+  }
+
+  LogStream(const LogStream&) = delete;
+  LogStream& operator=(const LogStream&) = delete;
+
+
+private:
+  LogCategory category;
+  LogLevel level;
+  std::unique_ptr<std::ostringstream> stream;
+};
+
+
+LogStream logDebug(const LogCategory category)   { return LogStream(category, LOG_DEBUG); }
+LogStream logInfo(const LogCategory category)    { return LogStream(category, LOG_INFO); }
+LogStream logWarning(const LogCategory category) { return LogStream(category, LOG_WARNING); }
+LogStream logError(const LogCategory category)   { return LogStream(category, LOG_ERROR); }
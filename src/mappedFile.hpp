@@ -0,0 +1,94 @@
+﻿#pragma once
+
+//
+// メモリマップドファイル
+//   読み込み専用
+//
+
+#if defined (_MSC_VER)
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include <string>
+#include <cstdint>
+
+
+class MappedFile {
+  const uint8_t* ptr;
+  size_t length;
+
+#if defined (_MSC_VER)
+  HANDLE file;
+  HANDLE mapping;
+#else
+  int fd;
+#endif
+
+
+public:
+  explicit MappedFile(const std::string& path)
+    : ptr(nullptr),
+      length(0)
+  {
+#if defined (_MSC_VER)
+    mapping = nullptr;
+    file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                       OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (file == INVALID_HANDLE_VALUE) return;
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size) || (size.QuadPart == 0)) return;
+
+    mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (!mapping) return;
+
+    ptr = static_cast<const uint8_t*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+    if (ptr) length = size_t(size.QuadPart);
+#else
+    fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return;
+
+    struct stat st;
+    if ((fstat(fd, &st) != 0) || (st.st_size == 0)) return;
+
+    void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED) return;
+
+    ptr    = static_cast<const uint8_t*>(p);
+    length = size_t(st.st_size);
+#endif
+  }
+
+  ~MappedFile() {
+#if defined (_MSC_VER)
+    if (ptr) UnmapViewOfFile(ptr);
+    if (mapping) CloseHandle(mapping);
+    if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+#else
+    if (ptr) munmap(const_cast<uint8_t*>(ptr), length);
+    if (fd >= 0) close(fd);
+#endif
+  }
+
+  // コピー禁止
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+
+  bool isOpen() const {
+    return ptr != nullptr;
+  }
+
+  const uint8_t* data() const {
+    return ptr;
+  }
+
+  size_t size() const {
+    return length;
+  }
+};
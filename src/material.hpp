@@ -8,6 +8,7 @@
 #include <string>
 #include "common.hpp"
 #include "misc.hpp"
+#include "logger.hpp"
 
 
 struct Material {
@@ -17,7 +18,10 @@ struct Material {
       specular(0.0f, 0.0f, 0.0f, 1.0f),
       shininess(80.0f),
       emission(0.0f, 0.0f, 0.0f, 1.0f),
-      has_texture(false)
+      has_texture(false),
+      texture_array(0),
+      texture_layer(0),
+      sampler(0)
   { }
 
   ci::ColorA diffuse;
@@ -29,8 +33,43 @@ struct Material {
   bool has_texture;
   std::string texture_name;
   GLenum wrap_s, wrap_t;
+
+  // テクスチャ配列を使う場合の参照先
+  u_int texture_array;
+  u_int texture_layer;
+  // ラップの指定(GPUへ転送する時に決める)
+  GLuint sampler;
+};
+
+
+// シェーダーのuniformブロックと同じ並び(std140)
+//   vec4の後にfloatを置き、残りは詰め物
+struct MaterialBlock {
+  ci::vec4 ambient;
+  ci::vec4 diffuse;
+  ci::vec4 specular;
+  ci::vec4 emission;
+  float shininess;
+  // テクスチャ配列のレイヤー
+  float layer;
+  float padding[2];
 };
 
+MaterialBlock createMaterialBlock(const Material& material) {
+  auto toVec4 = [](const ci::ColorA& c) { return ci::vec4(c.r, c.g, c.b, c.a); };
+
+  MaterialBlock block;
+  block.ambient    = toVec4(material.ambient);
+  block.diffuse    = toVec4(material.diffuse);
+  block.specular   = toVec4(material.specular);
+  block.emission   = toVec4(material.emission);
+  block.shininess  = material.shininess;
+  block.layer      = float(material.texture_layer);
+  block.padding[0] = block.padding[1] = 0.0f;
+
+  return block;
+}
+
 
 GLenum getTextureWrap(const int wrap) {
   switch (wrap) {
@@ -91,14 +130,12 @@ Material createMaterial(const aiMaterial* const mat) {
     material.wrap_t = getTextureWrap(map_v);
   }
 
-  ci::app::console() << "Diffuse:"   << material.diffuse   << std::endl;
-  ci::app::console() << "Ambient:"   << material.ambient   << std::endl;
-  ci::app::console() << "Specular:"  << material.specular  << std::endl;
-  ci::app::console() << "Shininess:" << material.shininess << std::endl;
-  ci::app::console() << "Emission:"  << material.emission  << std::endl;
-  if (material.has_texture) {
-    ci::app::console() << "Texture:" << material.texture_name << std::endl;
-  }
+  logDebug(LOG_IMPORT) << "Diffuse:"    << material.diffuse
+                       << " Ambient:"   << material.ambient
+                       << " Specular:"  << material.specular
+                       << " Shininess:" << material.shininess
+                       << " Emission:"  << material.emission
+                       << " Texture:"   << (material.has_texture ? material.texture_name : std::string("-"));
 
   return material;
 }
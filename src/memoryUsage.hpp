@@ -0,0 +1,324 @@
+﻿#pragma once
+
+//
+// モデルのメモリ使用量
+//   CPU側はコンテナの確保済みサイズ、GPU側はバッファとテクスチャのサイズ
+//   テクスチャのGPUサイズは形式とミップマップから計算した値
+//
+
+#include <string>
+#include <vector>
+#include <map>
+#include <ostream>
+#include "model.hpp"
+#include "textureCompress.hpp"
+
+
+struct MemoryUsage {
+  MemoryUsage()
+    : cpu(0),
+      gpu(0)
+  {}
+
+  size_t cpu;
+  size_t gpu;
+
+  MemoryUsage& operator+=(const MemoryUsage& rhs) {
+    cpu += rhs.cpu;
+    gpu += rhs.gpu;
+    return *this;
+  }
+};
+
+struct ModelMemoryUsage {
+  // model.meshと同じ並び
+  std::vector<MemoryUsage> mesh;
+  // テクスチャ名ごと
+  std::map<std::string, MemoryUsage> texture;
+  // model.animationと同じ並び(名前とチャンネルだけ)
+  std::vector<MemoryUsage> animation;
+  // 読み込み済みのクリップのキー
+  MemoryUsage clips;
+  // model.node_listと同じ並び
+  std::vector<MemoryUsage> node;
+  // 全マテリアル
+  MemoryUsage material;
+  // まとめたバッファ(メッシュ側のGPUサイズには含めない)
+  MemoryUsage geometry;
+
+  MemoryUsage total;
+};
+
+
+template <typename T>
+size_t getCapacityBytes(const std::vector<T>& values) {
+  return values.capacity() * sizeof(T);
+}
+
+size_t getCapacityBytes(const std::string& str) {
+  return str.capacity();
+}
+
+
+size_t getVboMeshBytes(const ci::gl::VboMeshRef& vbo_mesh) {
+  size_t bytes = 0;
+  for (const auto& vbo : vbo_mesh->getVertexArrayVbos()) {
+    bytes += vbo->getSize();
+  }
+  if (vbo_mesh->getIndexVbo()) {
+    bytes += vbo_mesh->getIndexVbo()->getSize();
+  }
+  return bytes;
+}
+
+
+// shared_gpuがtrueならVboMeshは他のメッシュと共有している
+MemoryUsage getMeshMemoryUsage(const Mesh& mesh, const bool shared_gpu = false) {
+  MemoryUsage usage;
+
+  usage.cpu = sizeof(Mesh)
+            + getCapacityBytes(mesh.body.getPositions())
+            + getCapacityBytes(mesh.body.getNormals())
+            + getCapacityBytes(mesh.body.getTexCoords())
+            + getCapacityBytes(mesh.body.getColors())
+            + getCapacityBytes(mesh.body.getIndices())
+            + getCapacityBytes(mesh.body.getBoneIndices())
+            + getCapacityBytes(mesh.body.getBoneWeights())
+            + getCapacityBytes(mesh.bones);
+
+  for (const auto& bone : mesh.bones) {
+    usage.cpu += getCapacityBytes(bone.name) + getCapacityBytes(bone.weights);
+  }
+
+  if (mesh.vbo_mesh && !shared_gpu) {
+    usage.gpu = getVboMeshBytes(mesh.vbo_mesh);
+  }
+
+  return usage;
+}
+
+
+// ミップマップ1段分のサイズ
+//   圧縮形式は4x4ピクセルのブロック単位
+size_t getTextureLevelBytes(const GLint internal_format, const int width, const int height) {
+  size_t blocks = size_t((width + 3) / 4) * size_t((height + 3) / 4);
+  size_t pixels = size_t(width) * size_t(height);
+
+  switch (internal_format) {
+  case TEXTURE_COMPRESSED_RGB_BC1:
+  case TEXTURE_COMPRESSED_RGB8_ETC2:
+    return blocks * 8;
+
+  case TEXTURE_COMPRESSED_RGBA_BC3:
+  case TEXTURE_COMPRESSED_RGBA8_ETC2_EAC:
+    return blocks * 16;
+
+  case GL_RED:
+  case GL_R8:
+    return pixels;
+
+  case GL_RG:
+  case GL_RG8:
+    return pixels * 2;
+
+  case GL_RGB:
+  case GL_RGB8:
+    return pixels * 3;
+
+  default:
+    return pixels * 4;
+  }
+}
+
+MemoryUsage getTextureMemoryUsage(const ci::gl::Texture2dRef& texture) {
+  MemoryUsage usage;
+  usage.cpu = sizeof(ci::gl::Texture2d);
+
+  int width  = texture->getWidth();
+  int height = texture->getHeight();
+  while (true) {
+    usage.gpu += getTextureLevelBytes(texture->getInternalFormat(), width, height);
+    if (!texture->hasMipmapping() || ((width == 1) && (height == 1))) break;
+
+    width  = std::max(width / 2, 1);
+    height = std::max(height / 2, 1);
+  }
+
+  return usage;
+}
+
+#if defined (USE_TEXTURE_ARRAY)
+
+MemoryUsage getTextureArrayMemoryUsage(const TextureArray& texture) {
+  MemoryUsage usage;
+  usage.cpu = sizeof(TextureArray);
+
+  int width  = texture.width;
+  int height = texture.height;
+  for (int level = 0; level < texture.level_num; ++level) {
+    usage.gpu += getTextureLevelBytes(texture.internal_format, width, height) * texture.layer_num;
+
+    width  = std::max(width / 2, 1);
+    height = std::max(height / 2, 1);
+  }
+
+  return usage;
+}
+
+// GPUへ転送前の画像
+MemoryUsage getTextureArrayMemoryUsage(const TextureArrayImage& image) {
+  MemoryUsage usage;
+  usage.cpu = getCapacityBytes(image.names) + getCapacityBytes(image.layers);
+  for (const auto& name : image.names) {
+    usage.cpu += getCapacityBytes(name);
+  }
+  for (const auto& layer : image.layers) {
+    usage.cpu += getCapacityBytes(layer.levels);
+    for (const auto& level : layer.levels) {
+      usage.cpu += getCapacityBytes(level);
+    }
+  }
+
+  return usage;
+}
+
+#endif
+
+// GPUへ転送前の画像
+MemoryUsage getTextureMemoryUsage(const TextureImage& image) {
+  MemoryUsage usage;
+  usage.cpu = sizeof(TextureImage) + getCapacityBytes(image.path) + getCapacityBytes(image.ktx_path);
+  if (image.surface) {
+    usage.cpu += image.surface.getRowBytes() * image.surface.getHeight();
+  }
+
+  return usage;
+}
+
+
+MemoryUsage getAnimMemoryUsage(const Anim& anim) {
+  MemoryUsage usage;
+  usage.cpu = sizeof(Anim) + getCapacityBytes(anim.name) + getCapacityBytes(anim.body);
+
+  for (const auto& body : anim.body) {
+    usage.cpu += getCapacityBytes(body.node_name)
+               + getCapacityBytes(body.translate)
+               + getCapacityBytes(body.scaling)
+               + getCapacityBytes(body.rotation);
+  }
+
+  return usage;
+}
+
+
+MemoryUsage getNodeMemoryUsage(const Node& node) {
+  MemoryUsage usage;
+  usage.cpu = sizeof(Node)
+            + getCapacityBytes(node.name)
+            + getCapacityBytes(node.mesh)
+            + getCapacityBytes(node.children);
+
+  for (const auto& ref : node.mesh) {
+    usage.cpu += getCapacityBytes(ref.bone_matrices);
+  }
+
+  return usage;
+}
+
+
+// モデル全体の使用量を調べる
+//   テクスチャは他のモデルと共有している場合もある
+ModelMemoryUsage getModelMemoryUsage(const Model& model) {
+  ModelMemoryUsage usage;
+
+  bool shared_gpu = !model.geometry.empty();
+  for (const auto& mesh : model.mesh) {
+    usage.mesh.push_back(getMeshMemoryUsage(mesh, shared_gpu));
+    usage.total += usage.mesh.back();
+  }
+
+  usage.geometry.cpu = getCapacityBytes(model.geometry);
+  for (const auto& group : model.geometry) {
+    usage.geometry.cpu += getCapacityBytes(group.body.getPositions())
+                        + getCapacityBytes(group.body.getNormals())
+                        + getCapacityBytes(group.body.getTexCoords())
+                        + getCapacityBytes(group.body.getColors())
+                        + getCapacityBytes(group.body.getIndices())
+                        + getCapacityBytes(group.body.getBoneIndices())
+                        + getCapacityBytes(group.body.getBoneWeights());
+    if (group.vbo_mesh) {
+      usage.geometry.gpu += getVboMeshBytes(group.vbo_mesh);
+    }
+  }
+  usage.total += usage.geometry;
+
+  for (const auto& texture : model.textures) {
+    if (!texture.second) continue;
+    usage.texture[texture.first] += getTextureMemoryUsage(texture.second);
+  }
+  for (const auto& image : model.images) {
+    usage.texture[image.first] += getTextureMemoryUsage(image.second);
+  }
+#if defined (USE_TEXTURE_ARRAY)
+  for (size_t i = 0; i < model.array_images.size(); ++i) {
+    auto& u = usage.texture["array:" + std::to_string(i)];
+    u += getTextureArrayMemoryUsage(model.array_images[i]);
+    if (i < model.texture_arrays.size()) {
+      u += getTextureArrayMemoryUsage(*model.texture_arrays[i]);
+    }
+  }
+#endif
+  for (const auto& texture : usage.texture) {
+    usage.total += texture.second;
+  }
+
+  for (const auto& anim : model.animation) {
+    usage.animation.push_back(getAnimMemoryUsage(anim));
+    usage.total += usage.animation.back();
+  }
+  if (model.clips) {
+    usage.clips.cpu = getClipResidentBytes(*model.clips);
+    usage.total += usage.clips;
+  }
+
+  for (const auto& node : model.node_list) {
+    usage.node.push_back(getNodeMemoryUsage(*node));
+    usage.total += usage.node.back();
+  }
+
+  usage.material.cpu = getCapacityBytes(model.material);
+  for (const auto& material : model.material) {
+    usage.material.cpu += getCapacityBytes(material.texture_name);
+  }
+  if (model.material_ubo) {
+    usage.material.gpu = model.material_ubo->getSize();
+  }
+  usage.total += usage.material;
+
+  return usage;
+}
+
+
+// 使用量を出力
+void printModelMemoryUsage(std::ostream& os, const Model& model, const ModelMemoryUsage& usage) {
+  auto print = [&os](const std::string& name, const MemoryUsage& u) {
+    os << name << " cpu:" << u.cpu << " gpu:" << u.gpu << std::endl;
+  };
+
+  for (size_t i = 0; i < usage.mesh.size(); ++i) {
+    print("mesh:" + std::to_string(i), usage.mesh[i]);
+  }
+  for (const auto& texture : usage.texture) {
+    print("texture:" + texture.first, texture.second);
+  }
+  for (size_t i = 0; i < usage.animation.size(); ++i) {
+    print("animation:" + model.animation[i].name, usage.animation[i]);
+  }
+  print("clips", usage.clips);
+  for (size_t i = 0; i < usage.node.size(); ++i) {
+    print("node:" + model.node_list[i]->name, usage.node[i]);
+  }
+  print("material", usage.material);
+  print("geometry", usage.geometry);
+  print("total", usage.total);
+}
@@ -10,47 +10,96 @@
 #include <glm/gtc/type_ptr.hpp>
 #include <assimp/scene.h>
 #include <string>
+#include <ostream>
 #include "common.hpp"
 #include "misc.hpp"
+#include "logger.hpp"
 #include "triMesh.hpp"
+#include "frustum.hpp"
 
 
+struct Node;
+
 struct Weight {
   u_int vertex_id;
   float value;
 };
 
 struct Bone {
+  Bone()
+    : has_aabb(false),
+      influence(0.0f),
+      node(nullptr)
+  {}
+
   std::string name;
   ci::mat4 offset;
 
   std::vector<Weight> weights;
+
+  // ウェイトを持つ頂点を包むAABB(メッシュ座標系)
+  bool has_aabb;
+  ci::AxisAlignedBox aabb;
+
+  // ウェイトの合計(動かす頂点の量。スケルトンのLODで使う)
+  float influence;
+
+  // 名前から解決したノード(毎フレーム名前で探さない)
+  Node* node;
 };
 
 struct Mesh {
   Mesh()
-    : has_vertex_color(false),
-      has_bone(false)
+    : geometry_group(0),
+      first_index(0),
+      index_count(0),
+      vertex_count(0),
+      has_vertex_color(false),
+      has_bone(false),
+      bone_influences(0)
   {}
 
   TriMesh body;
+  // 他のメッシュとまとめたバッファの場合もある
   ci::gl::VboMeshRef vbo_mesh;
 
+  // vbo_mesh内での位置(インデックスは先頭の頂点からの値に変換済み)
+  u_int geometry_group;
+  u_int first_index;
+  u_int index_count;
+  u_int vertex_count;
+
   u_int material_index;
 
   bool has_vertex_color;
   bool has_bone;
+  // 頂点に影響するボーンの数の最大値(1〜4。シェーダーの種類を決める)
+  u_int bone_influences;
 
   std::vector<Bone> bones;
-  std::vector<ci::mat4> bone_matrices;
 
   u_int shader_index;
+
+  // 全頂点を包むAABB(アニメーションは考慮しない)
+  ci::AxisAlignedBox aabb;
 };
 
 
+// 頂点に影響するボーンの数
+u_int countBoneInfluences(const ci::vec4& weights) {
+  u_int num = 0;
+  for (int h = 0; h < 4; ++h) {
+    if (weights[h] > 0.0f) num += 1;
+  }
+  return num;
+}
+
+
 // ボーンの情報を作成
-Bone createBone(const aiBone* b) {
+//   複数スレッドから呼ばれるのでログは呼び出し元でまとめて出力する
+Bone createBone(const aiBone* b, std::ostream& log) {
   Bone bone;
+  bone.has_aabb = false;
   
   bone.name = b->mName.C_Str();
 
@@ -59,7 +108,7 @@ Bone createBone(const aiBone* b) {
   ci::mat4 m = glm::make_mat4(b->mOffsetMatrix[0]);
   bone.offset = glm::transpose(m);
 
-  ci::app::console() << "bone:" << bone.name << " weights:" << b->mNumWeights << std::endl;
+  log << "bone:" << bone.name << " weights:" << b->mNumWeights << std::endl;
 
   {
     const aiVertexWeight* w = b->mWeights;
@@ -67,6 +116,7 @@ Bone createBone(const aiBone* b) {
     for (i = 0; i < b->mNumWeights; ++i) {
       Weight weight{ w[i].mVertexId, w[i].mWeight };
       bone.weights.push_back(weight);
+      bone.influence += weight.value;
     }
     // 残りはウェイト０
     for (; i < 4; ++i) {
@@ -79,7 +129,8 @@ Bone createBone(const aiBone* b) {
 
 
 // メッシュを生成
-Mesh createMesh(const aiMesh* const m) {
+//   複数スレッドから呼ばれるのでログは呼び出し元でまとめて出力する
+Mesh createMesh(const aiMesh* const m, std::ostream& log) {
   Mesh mesh;
 
   // VBOのレイアウトを決める
@@ -87,7 +138,7 @@ Mesh createMesh(const aiMesh* const m) {
   
   // 頂点データを取り出す
   u_int num_vtx = m->mNumVertices;
-  ci::app::console() << "Vertices:" << num_vtx << std::endl;
+  log << "Vertices:" << num_vtx << std::endl;
   layout.push_back({ ci::gl::VboMesh::Layout().interleave(true).usage(GL_STATIC_DRAW).attrib(ci::geom::Attrib::POSITION, 3) });
 
   const aiVector3D* vtx = m->mVertices;
@@ -97,7 +148,7 @@ Mesh createMesh(const aiMesh* const m) {
 
   // 法線
   if (m->HasNormals()) {
-    ci::app::console() << "Has Normals." << std::endl;
+    log << "Has Normals." << std::endl;
     layout.push_back({ ci::gl::VboMesh::Layout().interleave(true).usage(GL_STATIC_DRAW).attrib(ci::geom::Attrib::NORMAL, 3) });
 
     const aiVector3D* normal = m->mNormals;
@@ -108,7 +159,7 @@ Mesh createMesh(const aiMesh* const m) {
 
   // テクスチャ座標(マルチテクスチャには非対応)
   if (m->HasTextureCoords(0)) {
-    ci::app::console() << "Has TextureCoords." << std::endl;
+    log << "Has TextureCoords." << std::endl;
     layout.push_back({ ci::gl::VboMesh::Layout().interleave(true).usage(GL_STATIC_DRAW).attrib(ci::geom::Attrib::TEX_COORD_0, 2) });
 
     const aiVector3D* uv = m->mTextureCoords[0];
@@ -120,7 +171,7 @@ Mesh createMesh(const aiMesh* const m) {
   // 頂点カラー(マルチカラーには非対応)
   mesh.has_vertex_color = m->HasVertexColors(0);
   if (mesh.has_vertex_color) {
-    ci::app::console() << "Has VertexColors." << std::endl;
+    log << "Has VertexColors." << std::endl;
     layout.push_back({ ci::gl::VboMesh::Layout().interleave(true).usage(GL_STATIC_DRAW).attrib(ci::geom::Attrib::COLOR, 4) });
 
     const aiColor4D* color = m->mColors[0];
@@ -131,7 +182,7 @@ Mesh createMesh(const aiMesh* const m) {
 
   // 面情報
   if (m->HasFaces()) {
-    ci::app::console() << "Has Faces." << std::endl;
+    log << "Has Faces." << std::endl;
     const aiFace* face = m->mFaces;
     for (u_int h = 0; h < m->mNumFaces; ++h) {
       assert(face[h].mNumIndices == 3);
@@ -144,15 +195,28 @@ Mesh createMesh(const aiMesh* const m) {
   // 骨情報
   mesh.has_bone = m->HasBones();
   if (mesh.has_bone) {
-    ci::app::console() << "Has Bones." << std::endl;
+    log << "Has Bones." << std::endl;
     layout.push_back({ ci::gl::VboMesh::Layout().interleave(true).usage(GL_STATIC_DRAW).attrib(ci::geom::Attrib::BONE_INDEX, 4) });
     layout.push_back({ ci::gl::VboMesh::Layout().interleave(true).usage(GL_STATIC_DRAW).attrib(ci::geom::Attrib::BONE_WEIGHT, 4) });
 
     aiBone** b = m->mBones;
     for (u_int i = 0; i < m->mNumBones; ++i) {
-      mesh.bones.push_back(createBone(b[i]));
+      mesh.bones.push_back(createBone(b[i], log));
+    }
+
+    // 骨ごとに影響する頂点のAABBを求めておく
+    //   毎フレーム骨の行列で変換すればアニメーション後のAABBになる
+    const auto& positions = mesh.body.getPositions();
+    for (auto& bone : mesh.bones) {
+      std::vector<ci::vec3> influenced;
+      for (const auto& weight : bone.weights) {
+        if (weight.value > 0.0f) influenced.push_back(positions[weight.vertex_id]);
+      }
+      if (influenced.empty()) continue;
+
+      bone.has_aabb = true;
+      bone.aabb     = createAABB(influenced);
     }
-    mesh.bone_matrices.resize(m->mNumBones);
 
     std::vector<ci::ivec4> bone_indices(num_vtx);
     std::vector<ci::vec4>  bone_weights(num_vtx);
@@ -170,14 +234,43 @@ Mesh createMesh(const aiMesh* const m) {
       }
     }
     
+    for (const auto& bw : bone_weights) {
+      mesh.bone_influences = std::max(countBoneInfluences(bw), mesh.bone_influences);
+    }
+
     // データをコピー
     mesh.body.appendBoneIndices(bone_indices);
     mesh.body.appendBoneWeights(bone_weights);
   }
 
-  mesh.vbo_mesh = ci::gl::VboMesh::create(mesh.body);
+  mesh.aabb = createAABB(mesh.body.getPositions());
 
   mesh.material_index = m->mMaterialIndex;
 
   return mesh;
 }
+
+
+// 骨の行列からアニメーション後のAABBを求める
+//   各頂点は骨で変換した位置の重み付き平均なので
+//   骨ごとのAABBを変換して合わせたものに必ず収まる
+//   bone_matricesはメッシュのボーン数だけ並んでいること
+ci::AxisAlignedBox calcSkinnedAABB(const Mesh& mesh, const ci::mat4* bone_matrices) {
+  bool first = true;
+  ci::AxisAlignedBox aabb = mesh.aabb;
+
+  for (size_t i = 0; i < mesh.bones.size(); ++i) {
+    const auto& bone = mesh.bones[i];
+    if (!bone.has_aabb) continue;
+
+    auto bone_aabb = transformAABB(bone.aabb, bone_matrices[i]);
+    aabb  = first ? bone_aabb : mergeAABB(aabb, bone_aabb);
+    first = false;
+  }
+
+  return aabb;
+}
+
+ci::AxisAlignedBox calcSkinnedAABB(const Mesh& mesh, const std::vector<ci::mat4>& bone_matrices) {
+  return calcSkinnedAABB(mesh, bone_matrices.data());
+}
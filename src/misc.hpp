@@ -9,6 +9,26 @@
 #endif
 
 #include <string>
+#include <cstdint>
+#include <ostream>
+#include <iostream>
+#include <cinder/app/App.h>
+
+
+// ログの出力先
+//   SKELETAL_HEADLESS(アプリ無しのビルド)ではconsole()が使えないので標準出力
+//   ベンチマークなどでは出力先を差し替える
+#if defined (SKELETAL_HEADLESS)
+std::ostream* headless_console = &std::cout;
+
+std::ostream& getConsole() {
+  return *headless_console;
+}
+#else
+std::ostream& getConsole() {
+  return ci::app::console();
+}
+#endif
 
 #if defined (_MSC_VER)
 using u_int = unsigned int;
@@ -62,3 +82,17 @@ int int2pow(const int value) {
 
 	return res;
 }
+
+
+// FNV-1aでハッシュ値を求める
+//   前回の値を渡せば続きから計算できる
+uint64_t getHash(const void* data, const size_t size,
+                 uint64_t hash = 14695981039346656037ULL) {
+  const uint8_t* p = static_cast<const uint8_t*>(data);
+  for (size_t i = 0; i < size; ++i) {
+    hash ^= p[i];
+    hash *= 1099511628211ULL;
+  }
+
+  return hash;
+}
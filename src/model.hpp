@@ -25,11 +25,30 @@
 #define WEIGHT_WORKAROUND
 // フルパス指定
 #define USE_FULL_PATH
+// 視錐台カリング
+#define USE_FRUSTUM_CULLING
+// 変換済みのデータをキャッシュする
+#define USE_COOKED_MODEL
+// テクスチャを圧縮して保存する(ES2.0はETC2が使えない)
+#if !defined (CINDER_GL_ES_2)
+#define USE_COMPRESSED_TEXTURE
+#endif
+// 同じ頂点形式のメッシュをひとつのバッファにまとめる
+#define USE_GEOMETRY_ARENA
+// 動かないメッシュをマテリアルごとにまとめる
+#define USE_STATIC_MERGE
+// スキニングするメッシュを、ひとつのボーンに従う部分と影響数ごとの部分に分ける
+#define USE_SKIN_PARTITION
+// テクスチャを配列にまとめる(ES2.0には無い)
+#if !defined (CINDER_GL_ES_2)
+#define USE_TEXTURE_ARRAY
+#endif
 
 
 #include <map>
 #include <set>
 #include <limits>
+#include <sstream>
 
 #include "common.hpp"
 #include "mesh.hpp"
@@ -37,31 +56,119 @@
 #include "texture.hpp"
 #include "node.hpp"
 #include "animation.hpp"
+#include "clipLibrary.hpp"
+#include "frustum.hpp"
+#include "cook.hpp"
+#include "mappedFile.hpp"
+#include "parallel.hpp"
+#include "shader.hpp"
+#include "profiler.hpp"
+#include "geometryArena.hpp"
+#include "staticMerge.hpp"
+#include "skinPartition.hpp"
+#if defined (USE_TEXTURE_ARRAY)
+#include "textureArray.hpp"
+#endif
 
 
-using ShaderHolder = std::map<u_int, ci::gl::GlslProgRef>;
+// uniformブロックの割り当て
+enum {
+  LIGHT_BLOCK_BINDING    = 0,
+  MATERIAL_BLOCK_BINDING = 1,
+};
 
+// シェーダーとuniformの位置
+//   描画のたびに名前で探さないように位置を覚えておく
+struct ShaderProgram {
+  ci::gl::GlslProgRef prog;
 
+  GLint bone_matrices;
+};
+
+ShaderProgram createShaderProgram(const ci::gl::GlslProgRef& prog) {
+  ShaderProgram program;
+
+  program.prog          = prog;
+  program.bone_matrices = prog->getUniformLocation("boneMatrices");
+
+  return program;
+}
+
+using ShaderHolder = std::map<u_int, ShaderProgram>;
+
+
+// GPUへ転送した後にCPU側へ残すメッシュのデータ
+enum MeshRetention {
+  RETAIN_ALL,                 // 全て残す
+  RETAIN_POSITIONS,           // 頂点座標とインデックスのみ(カリングやピッキング用)
+  RETAIN_NONE,                // 何も残さない
+};
+
+
+// 読み込んだモデル
+//   ノードやメッシュはshared_ptrやGLのリソースを持つので、コピーすると複製されずに共有してしまう
+//   ムーブだけを許し、複数で使う場合はModelAsset(modelInstance.hpp)にする
 struct Model {
+  Model()
+    : has_anim(false),
+      palette_size(0),
+      material_stride(0),
+      retention(RETAIN_ALL)
+  {}
+
+  Model(Model&&) = default;
+  Model& operator=(Model&&) = default;
+
+  Model(const Model&) = delete;
+  Model& operator=(const Model&) = delete;
+
   std::vector<Material> material;
 
   // マテリアルからのテクスチャ参照は名前引き
   std::map<std::string, ci::gl::Texture2dRef> textures;
+  // GPUへ転送する前のテクスチャ画像
+  std::map<std::string, TextureImage> images;
+
+#if defined (USE_TEXTURE_ARRAY)
+  // テクスチャ配列(texturesとimagesは使わない)
+  std::vector<TextureArrayRef> texture_arrays;
+  // GPUへ転送する前のテクスチャ配列
+  std::vector<TextureArrayImage> array_images;
+  std::shared_ptr<SamplerTable> samplers;
+#endif
+
+  // 全メッシュ
+  //   ノードからはインデックスで参照する
+  std::vector<Mesh> mesh;
+
+  // まとめたバッファ(USE_GEOMETRY_ARENAが無効なら空)
+  std::vector<GeometryGroup> geometry;
 
   // 親子関係にあるノード
   std::shared_ptr<Node> node;
 
-  // 名前からノードを探す用(アニメーションで使う)
+  // 名前からノードを探す用(読み込み時にボーンとアニメーションの参照を解決する)
   std::map<std::string, std::shared_ptr<Node> > node_index;
 
   // 親子関係を解除した状態(全ノードの行列を更新する時に使う)
   std::vector<std::shared_ptr<Node> > node_list;
 
   bool has_anim;
+  // クリップの名前、長さ、チャンネル(キーはclipsから取り出す)
   std::vector<Anim> animation;
+  std::shared_ptr<ClipLibrary> clips;
+
+  // 全MeshRefのボーン行列の合計数
+  size_t palette_size;
+
+  // 全マテリアルのパラメータ(MaterialBlockをmaterial_strideごとに並べたもの)
+  ci::gl::UboRef material_ubo;
+  size_t material_stride;
 
   ci::AxisAlignedBox aabb;
 
+  MeshRetention retention;
+
 #if defined (USE_FULL_PATH)
   // 読み込みディレクトリ
   std::string directory;
@@ -75,36 +182,34 @@ struct Model {
 //   ウェイト編集時にウェイトが極端に小さい頂点が発生しうる
 //   その場合に見た目におかしくなってしまうのをいい感じに直す
 void normalizeMeshWeight(Model& model) {
-  for (const auto& node : model.node_list) {
-    for (auto& mesh : node->mesh) {
-      if (!mesh.has_bone) continue;
+  for (auto& mesh : model.mesh) {
+    if (!mesh.has_bone) continue;
 
-      // 各頂点へのウェイト書き込みを記録
-      std::set<u_int> weight_index;
-      std::multimap<u_int, Weight*> weight_values;
+    // 各頂点へのウェイト書き込みを記録
+    std::set<u_int> weight_index;
+    std::multimap<u_int, Weight*> weight_values;
 
-      for (auto& bone : mesh.bones) {
-        for (auto& weight : bone.weights) {
-          weight_index.insert(weight.vertex_id);
-          weight_values.emplace(weight.vertex_id, &weight);
-        }
+    for (auto& bone : mesh.bones) {
+      for (auto& weight : bone.weights) {
+        weight_index.insert(weight.vertex_id);
+        weight_values.emplace(weight.vertex_id, &weight);
+      }
+    }
+
+    // 正規化
+    for (const auto i : weight_index) {
+      const auto p = weight_values.equal_range(i);
+      float weight = 0.0f;
+      for (auto it = p.first; it != p.second; ++it) {
+        weight += it->second->value;
       }
+      assert(weight > 0.0f);
 
-      // 正規化
-      for (const auto i : weight_index) {
-        const auto p = weight_values.equal_range(i);
-        float weight = 0.0f;
+      {
+        // logDebug(LOG_IMPORT) << "Weight min: " << weight;
+        float n = 1.0f / weight;
         for (auto it = p.first; it != p.second; ++it) {
-          weight += it->second->value;
-        }
-        assert(weight > 0.0f);
-
-        {
-          // ci::app::console() << "Weight min: " << weight << std::endl;
-          float n = 1.0f / weight;
-          for (auto it = p.first; it != p.second; ++it) {
-            it->second->value *= n;
-          }
+          it->second->value *= n;
         }
       }
     }
@@ -114,15 +219,47 @@ void normalizeMeshWeight(Model& model) {
 #endif
 
 
+// 全MeshRefのボーン行列を連結した時の位置を決める
+void setupPalette(Model& model) {
+  size_t offset = 0;
+  for (const auto& node : model.node_list) {
+    for (auto& ref : node->mesh) {
+      ref.palette_offset = u_int(offset);
+      offset += ref.bone_matrices.size();
+    }
+  }
+  model.palette_size = offset;
+}
+
+
+// ボーンとアニメーションが参照するノードを名前から解決する
+//   ノードの構成が決まった後に呼ぶ
+void bindModelNodes(Model& model) {
+  for (auto& mesh : model.mesh) {
+    for (auto& bone : mesh.bones) {
+      bone.node = model.node_index.at(bone.name).get();
+    }
+  }
+
+  for (auto& anim : model.animation) {
+    for (auto& body : anim.body) {
+      body.node = model.node_index.at(body.node_name).get();
+    }
+  }
+}
+
+
 // モデルの全頂点数とポリゴン数を数える
 std::pair<size_t, size_t> getMeshInfo(const Model& model) {
   size_t vertex_num   = 0;
   size_t triangle_num = 0;
 
   for (const auto& node : model.node_list) {
-    for (const auto& mesh : node->mesh) {
-      vertex_num += mesh.body.getNumVertices();
-      triangle_num += mesh.body.getNumIndices() / 3;
+    for (const auto& ref : node->mesh) {
+      const auto& mesh = model.mesh[ref.index];
+      // 転送後はCPU側のデータが無い場合もあるので、記録した範囲を使う
+      vertex_num   += mesh.vertex_count;
+      triangle_num += mesh.index_count / 3;
     }
   }
 
@@ -131,31 +268,30 @@ std::pair<size_t, size_t> getMeshInfo(const Model& model) {
 
 
 // 階層アニメーション用の行列を計算
-void updateNodeMatrix(Model& model, const double time, const Anim& animation) {
-  for (const auto& body : animation.body) {
-    // 階層アニメーションを取り出して行列を生成
-    ci::mat4 m;
-    m = ci::translate(m, getLerpValue(time, body.translate));
-    ci::mat4 r = glm::toMat4(getLerpValue(time, body.rotation));
-    m = m * r;
-    m = ci::scale(m, getLerpValue(time, body.scaling));
+// animationはチャンネル、clipは同じ並びのキー
+void updateNodeMatrix(const Anim& animation, const Anim& clip, const double time) {
+  ProfileZone profile_zone("updateNodeMatrix");
 
+  for (size_t i = 0; i < animation.body.size(); ++i) {
     // ノードの行列を書き換える
-    auto node = model.node_index.at(body.node_name);
-    node->matrix = m;
+    animation.body[i].node->matrix = getNodeAnimMatrix(clip.body[i], time);
   }
 }
 
 void updateMesh(Model& model) {
+  ProfileZone profile_zone("updateMesh");
+
   for (const auto& node : model.node_list) {
-    for (auto& mesh : node->mesh) {
+    for (auto& ref : node->mesh) {
+      const auto& mesh = model.mesh[ref.index];
       if (!mesh.has_bone) continue;
 
+      countProfile(PROFILE_BONES, mesh.bones.size());
+
       // 座標変換に必要な行列を用意
       for (u_int i = 0; i < mesh.bones.size(); ++i) {
         const auto& bone = mesh.bones[i];
-        auto local_node = model.node_index.at(bone.name);
-        mesh.bone_matrices[i] = node->invert_matrix * local_node->global_matrix * bone.offset;
+        ref.bone_matrices[i] = node->invert_matrix * bone.node->global_matrix * bone.offset;
       }
     }
   }
@@ -165,14 +301,24 @@ void updateMesh(Model& model) {
 void updateModel(Model& model, const double time, const size_t index) {
   if (!model.has_anim) return;
 
+  ProfileZone profile_zone("updateModel");
+
+  // キーは最初に使う時に読み込む
+  auto clip = acquireClip(*model.clips, index);
+  if (!clip) return;
+
   // 最大時間でループさせている
   double current_time = std::fmod(time, model.animation[index].duration);
 
   // アニメーションで全ノードの行列を更新
-  updateNodeMatrix(model, current_time, model.animation[index]);
+  updateNodeMatrix(model.animation[index], *clip, current_time);
 
   // ノードの行列を再計算
-  updateNodeDerivedMatrix(model.node, ci::mat4());
+  {
+    ProfileZone derived_zone("updateNodeDerivedMatrix");
+    updateNodeDerivedMatrix(model.node, ci::mat4());
+    countProfile(PROFILE_NODES, model.node_list.size());
+  }
 
   // メッシュアニメーションを適用
   updateMesh(model);
@@ -211,7 +357,8 @@ ci::AxisAlignedBox calcAABB(Model& model) {
 
   // 全頂点を調べてAABBの頂点座標を割り出す
   for (const auto& node : model.node_list) {
-    for (const auto& mesh : node->mesh) {
+    for (const auto& ref : node->mesh) {
+      const auto& mesh = model.mesh[ref.index];
       const auto& verticies = mesh.body.getPositions();
       size_t num = mesh.body.getNumVertices();
       for (size_t i = 0; i < num; ++i) {
@@ -233,51 +380,56 @@ ci::AxisAlignedBox calcAABB(Model& model) {
 }
 
 
-// モデル読み込み
-Model loadModel(const std::string& path) {
-  Assimp::Importer importer;
+// Assimpでの読み込み時の後処理
+//   クックしたデータの識別にも使う
+const u_int import_flags = aiProcess_Triangulate
+                         | aiProcess_JoinIdenticalVertices
+                         | aiProcess_OptimizeMeshes
+                         | aiProcess_LimitBoneWeights
+                         | aiProcess_RemoveRedundantMaterials;
 
-  const aiScene* scene = importer.ReadFile(path,
-                                             aiProcess_Triangulate
-                                           | aiProcess_JoinIdenticalVertices
-                                           | aiProcess_OptimizeMeshes
-                                           | aiProcess_LimitBoneWeights
-                                           | aiProcess_RemoveRedundantMaterials);
 
-  assert(scene);
-  
-  Model model;
+// Assimpのシーンをモデルデータに変換する
+//   GPUへの転送はおこなわない
+Model createModel(const aiScene* const scene) {
+  ProfileZone profile_zone("createModel");
 
-#if defined (USE_FULL_PATH)
-  // ファイルの親ディレクトリを取得
-  ci::fs::path full_path{ path };
-  model.directory = full_path.parent_path().string();
-#endif
+  Model model;
 
   if (scene->HasMaterials()) {
     u_int num = scene->mNumMaterials;
-    ci::app::console() << "Materials:" << num << std::endl;
 
     aiMaterial** mat = scene->mMaterials;
     for (u_int i = 0; i < num; ++i) {
       model.material.push_back(createMaterial(mat[i]));
+    }
+  }
 
-      // テクスチャ読み込み
-      const auto& m = model.material.back();
-      if (!m.has_texture) continue;
-
-#if defined (USE_FULL_PATH)
-      std::string path = model.directory + "/" + PATH_WORKAROUND(m.texture_name);
-      auto texture = loadTexrture(path);
-#else
-      auto texture = loadTexrture(PATH_WORKAROUND(m.texture_name));
-#endif
-
-      model.textures.insert(std::make_pair(m.texture_name, texture));
+  // メッシュはそれぞれ独立しているので並列に変換
+  //   同じメッシュを複数のノードが参照していても変換は一度だけ
+  model.mesh.resize(scene->mNumMeshes);
+  if (isLogEnabled(LOG_IMPORT, LOG_DEBUG)) {
+    std::vector<std::ostringstream> logs(scene->mNumMeshes);
+    parallelFor(scene->mNumMeshes, [&](size_t i) {
+        model.mesh[i] = createMesh(scene->mMeshes[i], logs[i]);
+      });
+
+    // メッシュごとの詳細は順番通りに出力
+    for (const auto& log : logs) {
+      auto text = log.str();
+      if (!text.empty() && (text.back() == '\n')) text.pop_back();
+      logDebug(LOG_IMPORT) << text;
     }
   }
+  else {
+    // 詳細を出力しない時はバッファの無いストリームに書く(文字列にならない)
+    parallelFor(scene->mNumMeshes, [&](size_t i) {
+        std::ostream null_log(nullptr);
+        model.mesh[i] = createMesh(scene->mMeshes[i], null_log);
+      });
+  }
 
-  model.node = createNode(scene->mRootNode, scene->mMeshes);
+  model.node = createNode(scene->mRootNode, model.mesh);
 
   // ノードを名前から探せるようにする
   createNodeInfo(model.node,
@@ -286,8 +438,6 @@ Model loadModel(const std::string& path) {
 
   model.has_anim = scene->HasAnimations();
   if (model.has_anim) {
-    ci::app::console() << "Animations:" << scene->mNumAnimations << std::endl;
-
     aiAnimation** anim = scene->mAnimations;
     for (u_int i = 0; i < scene->mNumAnimations; ++i) {
       model.animation.push_back(createAnimation(anim[i]));
@@ -298,118 +448,563 @@ Model loadModel(const std::string& path) {
   normalizeMeshWeight(model);
 #endif
 
-  model.aabb = calcAABB(model);
+#if defined (USE_STATIC_MERGE)
+  mergeStaticMeshes(model.node, model.node_list, model.animation, model.mesh);
+#endif
 
-  auto info = getMeshInfo(model);
+#if defined (USE_SKIN_PARTITION)
+  partitionSkinnedMeshes(model.node_list, model.node_index, model.mesh);
+#endif
+
+  // キーはクリップごとに持つ
+  model.clips = createClipLibrary(model.animation);
 
-  ci::app::console() << "Total vertex num:" << info.first << " triangle num:" << info.second << std::endl;
+  bindModelNodes(model);
+
+  // 項目ごとの詳細の代わりに概要をひとつ出力
+  {
+    size_t bone_num = 0;
+    for (const auto& mesh : model.mesh) {
+      bone_num += mesh.bones.size();
+    }
+    size_t channel_num = 0;
+    for (const auto& anim : model.animation) {
+      channel_num += anim.body.size();
+    }
+
+    logInfo(LOG_IMPORT) << "Materials:" << model.material.size()
+                        << " meshes:" << model.mesh.size()
+                        << " bones:" << bone_num
+                        << " nodes:" << model.node_list.size()
+                        << " animations:" << model.animation.size()
+                        << " channels:" << channel_num;
+  }
 
   return model;
 }
 
+// Assimpで読み込んでモデルデータに変換する
+Model importModel(const std::string& path) {
+  Assimp::Importer importer;
 
-// マテリアルからシェーダーを想定して読み込む
-void loadShader(ShaderHolder& shaders, Model& model) {
-  for (auto& node : model.node_list) {
-    if (node->mesh.empty()) continue;
+  const aiScene* scene = nullptr;
+  {
+    ProfileZone profile_zone("ReadFile");
+    scene = importer.ReadFile(path, import_flags);
+  }
 
-    for (auto& mesh : node->mesh) {
-      const auto& material = model.material[mesh.material_index];
+  assert(scene);
 
-      // メッシュとノードの情報からシェーダーを決める
-      //   0 ~ 7のIDを計算
-      enum {
-        HAS_BONE         = 1 << 0,
-        HAS_VERTEX_COLOR = 1 << 1,
-        HAS_TEXTURE      = 1 << 2,
-      };
+  return createModel(scene);
+}
 
-      u_int shader_index = 0;
-      if (mesh.has_bone)         shader_index += HAS_BONE;
-      if (mesh.has_vertex_color) shader_index += HAS_VERTEX_COLOR;
-      if (material.has_texture)  shader_index += HAS_TEXTURE;
 
-      mesh.shader_index = shader_index;
+#if defined (USE_COOKED_MODEL)
+
+// クックしたデータのパス
+std::string getCookedPath(const std::string& path) {
+  return path + ".cooked";
+}
+
+// 元ファイルの内容と読み込み設定からハッシュ値を求める
+//   これが一致すればクックしたデータを使える
+uint64_t getSourceHash(const std::string& path) {
+  MappedFile file(path);
+  uint64_t hash = getHash(file.data(), file.size());
+
+  // 環境によってデータの型が違うのも考慮
+  const uint32_t settings[] = {
+    import_flags,
+    COOKED_MODEL_VERSION,
+    sizeof(index_t),
+    sizeof(element_t),
+#if defined (USE_STATIC_MERGE)
+    1,
+#else
+    0,
+#endif
+#if defined (USE_SKIN_PARTITION)
+    1,
+#else
+    0,
+#endif
+  };
+
+  return getHash(settings, sizeof(settings), hash);
+}
+
+// モデルデータを書き出す
+//   クリップのキーは先にwriteCookedClipsで書き出し、その位置を渡す
+bool writeCookedModel(const Model& model, const std::string& path, const uint64_t hash,
+                      const std::vector<uint64_t>& clip_offsets) {
+  CookedWriter writer{ std::ofstream(path, std::ios::binary), 0 };
+  if (!writer.ofs) return false;
+
+  writeBytes(writer, cooked_model_magic, sizeof(cooked_model_magic));
+  writeValue(writer, uint32_t(COOKED_MODEL_VERSION));
+  writeValue(writer, hash);
+
+  writeValue(writer, uint32_t(model.material.size()));
+  for (const auto& material : model.material) {
+    writeMaterial(writer, material);
+  }
+
+  writeValue(writer, uint32_t(model.mesh.size()));
+  for (const auto& mesh : model.mesh) {
+    writeMesh(writer, mesh);
+  }
+
+  writeNode(writer, *model.node);
+
+  writeValue(writer, uint8_t(model.has_anim));
+  writeValue(writer, uint32_t(model.animation.size()));
+  for (const auto& anim : model.animation) {
+    writeAnimInfo(writer, anim);
+  }
+  writeArray(writer, clip_offsets);
+
+  return bool(writer.ofs);
+}
+
+// クックしたモデルデータを読み込む
+//   クリップはキーを読まずに、クリップファイルを割り当てておく
+//   ハッシュ値が一致しない、データが壊れているなどの場合はfalse
+bool readCookedModel(Model& model, const std::string& path, const std::string& clip_path, const uint64_t hash) {
+  ProfileZone profile_zone("readCookedModel");
+
+  MappedFile file(path);
+  if (!file.isOpen()) return false;
+
+  CookedReader reader{ file.data(), file.data() + file.size(), 0, false };
+
+  char magic[sizeof(cooked_model_magic)];
+  readBytes(reader, magic, sizeof(magic));
+  if (reader.error || std::memcmp(magic, cooked_model_magic, sizeof(magic))) return false;
+  if (readValue<uint32_t>(reader) != COOKED_MODEL_VERSION) return false;
+  if (readValue<uint64_t>(reader) != hash) return false;
+
+  auto num_materials = readValue<uint32_t>(reader);
+  for (uint32_t i = 0; (i < num_materials) && !reader.error; ++i) {
+    model.material.push_back(readMaterial(reader));
+  }
+
+  auto num_meshes = readValue<uint32_t>(reader);
+  for (uint32_t i = 0; (i < num_meshes) && !reader.error; ++i) {
+    model.mesh.push_back(readMesh(reader));
+  }
+
+  model.node = readNode(reader, model.mesh);
+
+  model.has_anim = readValue<uint8_t>(reader) != 0;
+  auto num_anims = readValue<uint32_t>(reader);
+  for (uint32_t i = 0; (i < num_anims) && !reader.error; ++i) {
+    model.animation.push_back(readAnimInfo(reader));
+  }
+  auto clip_offsets = readArray<uint64_t>(reader);
+
+  if (reader.error) return false;
+
+  model.clips = std::make_shared<ClipLibrary>();
+  model.clips->entries.resize(model.animation.size());
+  if (!attachClipFile(*model.clips, clip_path, hash, clip_offsets)) return false;
+
+  createNodeInfo(model.node,
+                 model.node_index,
+                 model.node_list);
+  bindModelNodes(model);
+
+  return true;
+}
+
+#endif
+
+
+// テクスチャ画像を読み込む
+//   GPUへの転送はおこなわない
+//   デコードは重いので並列でおこなう
+void decodeModelTextures(Model& model) {
+  ProfileZone profile_zone("decodeModelTextures");
+
+  std::vector<std::string> names;
+  for (const auto& m : model.material) {
+    if (!m.has_texture || model.images.count(m.texture_name)) continue;
+    if (std::find(names.begin(), names.end(), m.texture_name) != names.end()) continue;
 
-      // 読み込み済みなら次へ
-      if (shaders.count(shader_index)) continue;
-
-      struct ShaderInfo {
-        std::string vertex_shader;
-        std::string fragment_shader;
-      };
-      ShaderInfo shader_info[] = {
-        { "color_light",          "color" },
-        { "color_light_skining",  "color" },
-          
-        { "vertex_light",         "color" },
-        { "vertex_light_skining", "color" },
-          
-        { "texture_light",         "texture_light" },
-        { "texture_light_skining", "texture_light" },
-
-        { "vertex_texture_light",         "texture_light" },
-        { "vertex_texture_light_skining", "texture_light" },
-      };
-
-      const auto& info = shader_info[shader_index];
-
-      ci::app::console() << "read shader:" << info.vertex_shader << "," << info.fragment_shader << std::endl;
-      
-      auto shader      = readShader(info.vertex_shader, info.fragment_shader);
-      auto shader_prog = ci::gl::GlslProg::create(shader.first, shader.second);
-      shader_prog->uniformBlock("Light", 0);
-
-      shaders.insert(std::make_pair(shader_index, shader_prog));
+    names.push_back(m.texture_name);
+  }
+
+  std::vector<TextureImage> images(names.size());
+  parallelFor(names.size(), [&](size_t i) {
+#if defined (USE_FULL_PATH)
+      std::string path = model.directory + "/" + PATH_WORKAROUND(names[i]);
+      images[i] = readTextureImage(path);
+#else
+      images[i] = readTextureImage(PATH_WORKAROUND(names[i]));
+#endif
+    });
+
+#if defined (USE_TEXTURE_ARRAY)
+  // レイヤーの画像にしてまとめる
+  std::vector<TextureLayerImage> layers(names.size());
+  std::vector<char> valid(names.size());
+  parallelFor(names.size(), [&](size_t i) {
+      valid[i] = createLayerImage(images[i], layers[i]);
+    });
+
+  std::vector<std::string> layer_names;
+  std::vector<TextureLayerImage> valid_layers;
+  for (size_t i = 0; i < names.size(); ++i) {
+    if (valid[i]) {
+      layer_names.push_back(names[i]);
+      valid_layers.push_back(std::move(layers[i]));
+    }
+    else {
+      logWarning(LOG_TEXTURE) << "Texture layer failed:" << names[i];
     }
   }
+
+  std::vector<std::pair<u_int, u_int> > layer_index;
+  model.array_images = packTextureLayers(layer_names, valid_layers, layer_index);
+
+  for (auto& m : model.material) {
+    if (!m.has_texture) continue;
+
+    auto it = std::find(layer_names.begin(), layer_names.end(), m.texture_name);
+    if (it == layer_names.end()) {
+      // 読めなかったテクスチャは使わない
+      m.has_texture = false;
+      continue;
+    }
+    const auto& index = layer_index[std::distance(layer_names.begin(), it)];
+    m.texture_array = index.first;
+    m.texture_layer = index.second;
+  }
+
+  logInfo(LOG_TEXTURE) << "Texture arrays:" << model.array_images.size();
+#else
+  for (size_t i = 0; i < names.size(); ++i) {
+    model.images.insert(std::make_pair(names[i], std::move(images[i])));
+  }
+#endif
 }
 
+// テクスチャ画像をひとつGPUへ転送
+void uploadTexture(Model& model, const std::string& name) {
+  auto it = model.images.find(name);
+  if (it == model.images.end()) return;
 
-// モデル描画
-// TIPS:全ノード最終的な行列が計算されているので、再帰で描画する必要は無い
-void drawModel(const Model& model,
-               const ShaderHolder& shader_holder) {
-  for (const auto& node : model.node_list) {
-    if (node->mesh.empty()) continue;
-    ci::gl::pushModelView();
-    ci::gl::multModelMatrix(node->global_matrix);
+  model.textures.insert(std::make_pair(name, createTexture(it->second)));
+  model.images.erase(it);
+}
 
-    for (const auto& mesh : node->mesh) {
-      const auto& material = model.material[mesh.material_index];
-      const auto& shader = shader_holder.at(mesh.shader_index);
-
-      shader->uniform("mat_ambient",   material.ambient);
-      shader->uniform("mat_diffuse",   material.diffuse);
-      shader->uniform("mat_specular",  material.specular);
-      shader->uniform("mat_shininess", material.shininess);
-      shader->uniform("mat_emission",  material.emission);
-
-      if (material.has_texture) {
-        const auto& texture = model.textures.at(material.texture_name);
-        texture->setWrap(material.wrap_s, material.wrap_t);
-        texture->bind();
-      }
-      if (mesh.has_bone) {
-        shader->uniform("boneMatrices",  &mesh.bone_matrices[0], mesh.bone_matrices.size());
-      }
-      shader->bind();
+// 転送していないテクスチャがあるか
+bool hasPendingTexture(const Model& model) {
+#if defined (USE_TEXTURE_ARRAY)
+  return model.texture_arrays.size() < model.array_images.size();
+#else
+  return !model.images.empty();
+#endif
+}
 
-      ci::gl::draw(mesh.vbo_mesh);
+// テクスチャをひとつ(配列ならひとまとまり)GPUへ転送
+void uploadNextTexture(Model& model) {
+  ProfileZone profile_zone("uploadNextTexture");
 
-      if (material.has_texture) {
-        model.textures.at(material.texture_name)->unbind();
-      }
+#if defined (USE_TEXTURE_ARRAY)
+  // 転送したら画像は要らない(並びはマテリアルから参照するので残す)
+  auto& image = model.array_images[model.texture_arrays.size()];
+  model.texture_arrays.push_back(createTextureArray(image));
+  image.layers = std::vector<TextureLayerImage>();
+#else
+  uploadTexture(model, model.images.begin()->first);
+#endif
+}
+
+
+// 描画時に束縛するテクスチャ
+struct MaterialTexture {
+  GLenum target;
+  GLuint id;
+  // 0ならテクスチャのラップの指定を書き換える
+  GLuint sampler;
+};
+
+MaterialTexture getMaterialTexture(const Model& model, const Material& material) {
+  if (!material.has_texture) return MaterialTexture{ GL_TEXTURE_2D, 0, 0 };
+
+#if defined (USE_TEXTURE_ARRAY)
+  return MaterialTexture{ GL_TEXTURE_2D_ARRAY, model.texture_arrays[material.texture_array]->id, material.sampler };
+#else
+  return MaterialTexture{ GL_TEXTURE_2D, model.textures.at(material.texture_name)->getId(), 0 };
+#endif
+}
+
+// テクスチャを束縛してラップを設定
+void bindMaterialTexture(const MaterialTexture& texture, const Material& material) {
+  ci::gl::context()->bindTexture(texture.target, texture.id, 0);
+  if (texture.sampler) {
+    glBindSampler(0, texture.sampler);
+  }
+  else {
+    glTexParameteri(texture.target, GL_TEXTURE_WRAP_S, material.wrap_s);
+    glTexParameteri(texture.target, GL_TEXTURE_WRAP_T, material.wrap_t);
+  }
+}
+
+void unbindMaterialTexture(const MaterialTexture& texture) {
+  ci::gl::context()->bindTexture(texture.target, 0, 0);
+  if (texture.sampler) glBindSampler(0, 0);
+}
+
+// CPU側のメッシュデータを解放
+//   代入で空にするとメモリも解放される
+void releaseMeshData(Mesh& mesh, const MeshRetention retention) {
+  switch (retention) {
+  case RETAIN_ALL:
+    return;
+
+  case RETAIN_POSITIONS:
+    mesh.body.setNormals(std::vector<ci::vec3>());
+    mesh.body.setTexCoords(std::vector<ci::vec2>());
+    mesh.body.setColors(std::vector<ci::ColorA>());
+    mesh.body.setBoneIndices(std::vector<index_t>());
+    mesh.body.setBoneWeights(std::vector<ci::vec4>());
+    break;
+
+  case RETAIN_NONE:
+    mesh.body = TriMesh();
+    break;
+  }
+
+  // ウェイトは頂点データに変換済み(カリングはボーンのAABBを使う)
+  for (auto& bone : mesh.bones) {
+    bone.weights = std::vector<Weight>();
+  }
+}
+
+// 全マテリアルのパラメータをGPUへ転送
+//   描画時はbindBufferRangeで使うマテリアルを選ぶので
+//   各要素の先頭をGPUの要求する境界に揃える
+void uploadMaterials(Model& model) {
+  GLint alignment = 0;
+  glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+  alignment = std::max(alignment, 1);
+
+  size_t stride = (sizeof(MaterialBlock) + alignment - 1) / alignment * alignment;
+  std::vector<uint8_t> data(std::max(model.material.size(), size_t(1)) * stride);
+  for (size_t i = 0; i < model.material.size(); ++i) {
+    auto block = createMaterialBlock(model.material[i]);
+    std::memcpy(&data[i * stride], &block, sizeof(block));
+  }
+
+  model.material_ubo    = ci::gl::Ubo::create(data.size(), data.data());
+  model.material_stride = stride;
+
+#if defined (USE_TEXTURE_ARRAY)
+  model.samplers = std::make_shared<SamplerTable>();
+  for (auto& material : model.material) {
+    if (!material.has_texture) continue;
+    material.sampler = getSampler(*model.samplers, material.wrap_s, material.wrap_t);
+  }
+#endif
+}
+
+// メッシュをひとつGPUへ転送
+void uploadMesh(Mesh& mesh, const MeshRetention retention = RETAIN_ALL) {
+  mesh.vbo_mesh = ci::gl::VboMesh::create(mesh.body);
+  releaseMeshData(mesh, retention);
+}
+
+// 転送の単位の数
+//   バッファをまとめていればグループ、そうでなければメッシュ
+size_t getUploadUnitNum(const Model& model) {
+  return model.geometry.empty() ? model.mesh.size() : model.geometry.size();
+}
+
+// 転送の単位をひとつGPUへ転送
+void uploadUnit(Model& model, const size_t index) {
+  ProfileZone profile_zone("uploadUnit");
+
+  if (model.geometry.empty()) {
+    uploadMesh(model.mesh[index], model.retention);
+    return;
+  }
+
+  uploadGeometryGroup(model.geometry[index], u_int(index), model.mesh);
+  for (auto& mesh : model.mesh) {
+    if (mesh.geometry_group == index) releaseMeshData(mesh, model.retention);
+  }
+}
+
+
+// ファイルからモデルを読み込み、描画に必要なデータを全て用意する
+//   GLは使わないので別スレッドから呼んでも良い
+//   クックしたデータが使えればそちらを読み込む
+//   retentionはGPUへ転送した後に残すデータ
+Model readModel(const std::string& path, const MeshRetention retention = RETAIN_ALL) {
+  ProfileZone profile_zone("readModel");
+
+  Model model;
+
+#if defined (USE_COOKED_MODEL)
+  const auto cooked_path = getCookedPath(path);
+  const auto clip_path   = getCookedClipPath(path);
+  const auto hash        = getSourceHash(path);
+
+  if (readCookedModel(model, cooked_path, clip_path, hash)) {
+    logInfo(LOG_IMPORT) << "Cooked model:" << cooked_path;
+  }
+  else {
+    model = importModel(path);
+
+    // 書き出せたら、クリップのキーは使う時にファイルから読む
+    std::vector<uint64_t> clip_offsets;
+    if (!writeCookedClips(*model.clips, clip_path, hash, clip_offsets)
+        || !writeCookedModel(model, cooked_path, hash, clip_offsets)
+        || !attachClipFile(*model.clips, clip_path, hash, clip_offsets)) {
+      logWarning(LOG_IMPORT) << "Can't write cooked model:" << cooked_path;
     }
-    ci::gl::popModelView();
   }
+#else
+  model = importModel(path);
+#endif
+
+#if defined (USE_FULL_PATH)
+  // ファイルの親ディレクトリを取得
+  ci::fs::path full_path{ path };
+  model.directory = full_path.parent_path().string();
+#endif
+
+  decodeModelTextures(model);
+
+  model.aabb      = calcAABB(model);
+  model.retention = retention;
+  setupPalette(model);
+
+#if defined (USE_GEOMETRY_ARENA)
+  model.geometry = createGeometryGroups(model.mesh);
+  logInfo(LOG_IMPORT) << "Geometry groups:" << model.geometry.size();
+#else
+  for (auto& mesh : model.mesh) {
+    setupMeshRange(mesh);
+  }
+#endif
+
+  auto info = getMeshInfo(model);
+
+  logInfo(LOG_IMPORT) << "Total vertex num:" << info.first << " triangle num:" << info.second;
+
+  return model;
 }
 
-// 描画順を逆にする
-void reverseModelNode(Model& model) {
-  for (const auto& node : model.node_list) {
-    std::reverse(std::begin(node->mesh), std::end(node->mesh));
+// マテリアル、全テクスチャ、全メッシュをGPUへ転送
+void uploadModel(Model& model) {
+  uploadMaterials(model);
+
+  while (hasPendingTexture(model)) {
+    uploadNextTexture(model);
   }
-  
-  std::reverse(std::begin(model.node_list), std::end(model.node_list));
+
+  for (size_t i = 0; i < getUploadUnitNum(model); ++i) {
+    uploadUnit(model, i);
+  }
+}
+
+
+// モデル読み込み
+Model loadModel(const std::string& path, const MeshRetention retention = RETAIN_ALL) {
+  auto model = readModel(path, retention);
+  uploadModel(model);
+
+  return model;
 }
+
+
+// シェーダーの種類
+//   0 ~ 63のIDになる
+//   SHADER_ONE_BONEとSHADER_TWO_BONESはSHADER_HAS_BONEと併用(どちらも無ければ4本)
+enum {
+  SHADER_HAS_BONE         = 1 << 0,
+  SHADER_HAS_VERTEX_COLOR = 1 << 1,
+  SHADER_HAS_TEXTURE      = 1 << 2,
+  SHADER_INSTANCING       = 1 << 3,
+  SHADER_ONE_BONE         = 1 << 4,
+  SHADER_TWO_BONES        = 1 << 5,
+
+  SHADER_VARIANT_NUM      = 1 << 6,
+};
+
+// 組み合わせとして有効か
+bool isValidShaderVariant(const u_int shader_index) {
+  u_int influence = shader_index & (SHADER_ONE_BONE | SHADER_TWO_BONES);
+  if (!influence) return true;
+
+  return (shader_index & SHADER_HAS_BONE) && (influence != (SHADER_ONE_BONE | SHADER_TWO_BONES));
+}
+
+// インスタンス描画でボーン行列を読むテクスチャのユニット
+enum {
+  PALETTE_TEXTURE_UNIT = 1,
+};
+
+// 全種類のシェーダーを用意する
+//   ソースは一度だけ読み、#defineを変えて作る
+void prepareShaders(ShaderHolder& shaders) {
+  auto vertex_shader   = readFile(ci::app::getAssetPath("model.vsh").string());
+  auto fragment_shader = readFile(ci::app::getAssetPath("model.fsh").string());
+
+  for (u_int shader_index = 0; shader_index < SHADER_VARIANT_NUM; ++shader_index) {
+    if (!isValidShaderVariant(shader_index) || shaders.count(shader_index)) continue;
+
+    std::vector<std::string> defines;
+    if (shader_index & SHADER_HAS_BONE)         defines.push_back("HAS_BONE");
+    if (shader_index & SHADER_HAS_VERTEX_COLOR) defines.push_back("HAS_VERTEX_COLOR");
+    if (shader_index & SHADER_HAS_TEXTURE)      defines.push_back("HAS_TEXTURE");
+    if (shader_index & SHADER_INSTANCING)       defines.push_back("INSTANCING");
+    if (shader_index & SHADER_ONE_BONE)         defines.push_back("BONE_INFLUENCES 1");
+    if (shader_index & SHADER_TWO_BONES)        defines.push_back("BONE_INFLUENCES 2");
+#if defined (USE_TEXTURE_ARRAY)
+    if (shader_index & SHADER_HAS_TEXTURE)      defines.push_back("TEXTURE_ARRAY");
+#endif
+
+    logDebug(LOG_SHADER) << "prepare shader:" << shader_index;
+
+    auto shader_prog = createShader(std::make_pair(replaceText(vertex_shader, defines),
+                                                   replaceText(fragment_shader, defines)));
+    shader_prog->uniformBlock("Light", LIGHT_BLOCK_BINDING);
+    shader_prog->uniformBlock("Material", MATERIAL_BLOCK_BINDING);
+    if ((shader_index & SHADER_INSTANCING) && (shader_index & SHADER_HAS_BONE)) {
+      shader_prog->uniform("uPalette", int(PALETTE_TEXTURE_UNIT));
+    }
+
+    shaders.insert(std::make_pair(shader_index, createShaderProgram(shader_prog)));
+  }
+}
+
+// マテリアルから使うシェーダーを決める
+void loadShader(ShaderHolder& shaders, Model& model) {
+  for (auto& node : model.node_list) {
+    if (node->mesh.empty()) continue;
+
+    for (const auto& ref : node->mesh) {
+      auto& mesh = model.mesh[ref.index];
+      const auto& material = model.material[mesh.material_index];
+
+      // メッシュとノードの情報からシェーダーを決める
+      u_int shader_index = 0;
+      if (mesh.has_bone)         shader_index += SHADER_HAS_BONE;
+      if (mesh.has_vertex_color) shader_index += SHADER_HAS_VERTEX_COLOR;
+
+      // 頂点に影響するボーンの数で、行列を読む数を減らす
+      if (mesh.has_bone && (mesh.bone_influences <= 1))      shader_index += SHADER_ONE_BONE;
+      else if (mesh.has_bone && (mesh.bone_influences == 2)) shader_index += SHADER_TWO_BONES;
+      if (material.has_texture)  shader_index += SHADER_HAS_TEXTURE;
+
+      mesh.shader_index = shader_index;
+    }
+  }
+
+  // 用意されていなければここで作る
+  prepareShaders(shaders);
+}
+
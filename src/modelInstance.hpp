@@ -0,0 +1,360 @@
+﻿#pragma once
+
+//
+// モデルのアセットとインスタンス
+//   ModelAsset    読み込んだ後は書き換えないデータ(メッシュ、マテリアル、テクスチャ、アニメーション)
+//                 shared_ptr<const>で共有し、参照が無くなると解放される
+//   ModelInstance インスタンスごとの状態(再生状態と、計算したノード行列とボーン行列)
+//                 行列はnode_listの並びの配列で持ち、ModelのNodeには書き込まない
+//   ひとつのアセットから、違う姿勢のインスタンスをいくつでも作れる
+//   決まった間隔での計算
+//     tickModelInstanceは刻みの時刻の姿勢だけを計算し、間の時刻は2つの姿勢を補間する
+//     刻みをインスタンスごとにずらすと、計算するフレームが分散する
+//   スケルトンのLOD
+//     影響(ウェイトの合計)の小さいノードほど、小さく表示した時に省く
+//     省いたノードはアニメーションを適用せず、計算する祖先の下で初期の姿勢のまま動く
+//     auto asset    = createModelAsset(std::move(model));
+//     auto instance = createModelInstance(asset);
+//     auto clip     = acquireInstanceClip(instance);
+//     updateModelInstance(instance, time, clip.get());
+//     drawModel(asset->model, instance.pose, shader_holder, queue);
+//
+
+#include <memory>
+#include <vector>
+#include <map>
+#include <cmath>
+#include <cassert>
+#include "model.hpp"
+#include "pose.hpp"
+
+
+// スケルトンのLODの数(0が全てのノードを計算する)
+enum {
+  SKELETON_LOD_NUM = 3,
+};
+
+// LODごとに省くノードの影響の割合(全体に対して)
+//   深さに比例して大きくするので、指や顔などの末端から省かれる
+const float skeleton_lod_thresholds[SKELETON_LOD_NUM] = { 0.0f, 0.01f, 0.04f };
+
+
+struct SkeletonLod {
+  // 計算するノード(親は子より前)
+  std::vector<u_int> nodes;
+  // model.animationと同じ並びの、適用するチャンネルの番号
+  std::vector<std::vector<u_int>> channels;
+
+  // model.meshと同じ並びの、ボーンが参照するノード(省いていたら計算する祖先)
+  std::vector<std::vector<u_int>> bone_nodes;
+  // そのノードからボーンまでの初期の行列とボーンのオフセットを掛けたもの
+  std::vector<std::vector<ci::mat4>> bone_offsets;
+};
+
+
+struct ModelAsset {
+  Model model;
+
+  // node_listと同じ並びの親の番号(ルートは-1)
+  //   親は必ず子より前にある
+  std::vector<int> node_parents;
+  // アニメーションしていない時のノード行列(親行列は適用しない)
+  std::vector<ci::mat4> rest_matrices;
+
+  // model.animation[i].body[j]が書き換えるノードの番号
+  std::vector<std::vector<u_int>> channel_nodes;
+
+  // ボーンのあるMeshRef
+  struct SkinRef {
+    u_int node;
+    u_int mesh;
+    u_int palette_offset;
+  };
+  std::vector<SkinRef> skin_refs;
+
+  SkeletonLod lods[SKELETON_LOD_NUM];
+};
+
+using ModelAssetRef = std::shared_ptr<const ModelAsset>;
+
+
+struct ModelInstance {
+  ModelInstance()
+    : animation(0),
+      time_offset(0.0),
+      speed(1.0),
+      lod(0),
+      tick_phase(0.0),
+      tick_time(0.0),
+      ticked(false)
+  {}
+
+  ModelAssetRef asset;
+
+  // 再生状態
+  size_t animation;
+  double time_offset;
+  double speed;
+
+  // スケルトンのLOD
+  u_int lod;
+
+  // 決まった間隔で計算する時の刻みのずれ(0〜1)
+  double tick_phase;
+
+  // 計算結果
+  Pose pose;
+
+  // 決まった間隔で計算した結果
+  //   poseがtick_timeの姿勢、tick_poseが次の刻みの姿勢
+  double tick_time;
+  bool ticked;
+  Pose tick_pose;
+};
+
+
+// スケルトンのLODを作る
+//   ノードの影響は、子孫を含めたボーンのウェイトとメッシュの頂点数の合計
+//   メッシュの付いたノードとルートは常に計算し、計算するノードの親も計算する
+void setupSkeletonLods(ModelAsset& asset, const std::vector<std::vector<u_int>>& bone_nodes) {
+  const auto& model = asset.model;
+  const size_t node_num = model.node_list.size();
+
+  std::vector<u_int> depths(node_num, 0);
+  std::vector<float> influences(node_num, 0.0f);
+  u_int max_depth = 1;
+  for (size_t i = 0; i < node_num; ++i) {
+    int parent = asset.node_parents[i];
+    if (parent >= 0) depths[i] = depths[parent] + 1;
+    max_depth = std::max(depths[i], max_depth);
+
+    for (const auto& ref : model.node_list[i]->mesh) {
+      influences[i] += float(model.mesh[ref.index].vertex_count);
+    }
+  }
+  for (size_t k = 0; k < model.mesh.size(); ++k) {
+    const auto& bones = model.mesh[k].bones;
+    for (size_t b = 0; b < bones.size(); ++b) {
+      influences[bone_nodes[k][b]] += bones[b].influence;
+    }
+  }
+
+  // 子孫の分を親に足す(子は親より後ろにある)
+  float total = 0.0f;
+  for (size_t i = node_num; i > 0; --i) {
+    int parent = asset.node_parents[i - 1];
+    if (parent >= 0) influences[parent] += influences[i - 1];
+    else             total += influences[i - 1];
+  }
+
+  for (u_int level = 0; level < SKELETON_LOD_NUM; ++level) {
+    auto& lod = asset.lods[level];
+
+    std::vector<bool> keep(node_num);
+    for (size_t i = 0; i < node_num; ++i) {
+      float threshold = skeleton_lod_thresholds[level] * total * float(depths[i]) / float(max_depth);
+      keep[i] = (asset.node_parents[i] < 0) || !model.node_list[i]->mesh.empty() || (influences[i] >= threshold);
+    }
+    for (size_t i = node_num; i > 0; --i) {
+      int parent = asset.node_parents[i - 1];
+      if (keep[i - 1] && (parent >= 0)) keep[parent] = true;
+    }
+
+    for (u_int i = 0; i < node_num; ++i) {
+      if (keep[i]) lod.nodes.push_back(i);
+    }
+
+    for (const auto& nodes : asset.channel_nodes) {
+      std::vector<u_int> channels;
+      for (u_int c = 0; c < nodes.size(); ++c) {
+        if (keep[nodes[c]]) channels.push_back(c);
+      }
+      lod.channels.push_back(std::move(channels));
+    }
+
+    // 省いたノードの初期の行列を、計算する祖先まで遡って掛けておく
+    for (size_t k = 0; k < model.mesh.size(); ++k) {
+      const auto& bones = model.mesh[k].bones;
+      std::vector<u_int> nodes;
+      std::vector<ci::mat4> offsets;
+      for (size_t b = 0; b < bones.size(); ++b) {
+        u_int node = bone_nodes[k][b];
+        ci::mat4 offset = bones[b].offset;
+        while (!keep[node]) {
+          offset = asset.rest_matrices[node] * offset;
+          node   = u_int(asset.node_parents[node]);
+        }
+        nodes.push_back(node);
+        offsets.push_back(offset);
+      }
+      lod.bone_nodes.push_back(std::move(nodes));
+      lod.bone_offsets.push_back(std::move(offsets));
+    }
+
+    logDebug(LOG_IMPORT) << "Skeleton LOD" << level << " nodes:" << lod.nodes.size() << "/" << node_num;
+  }
+}
+
+
+// 読み込んだモデルからアセットを作る
+//   モデルはreadModelで用意したもの(パレットの位置とシェーダーが決まっている)
+//   ノードの親子関係と、ボーンやアニメーションの参照を番号に置き換えておく
+ModelAssetRef createModelAsset(Model model) {
+  auto asset = std::make_shared<ModelAsset>();
+  asset->model = std::move(model);
+  const auto& m = asset->model;
+
+  std::map<const Node*, u_int> node_numbers;
+  for (u_int i = 0; i < m.node_list.size(); ++i) {
+    node_numbers.insert(std::make_pair(m.node_list[i].get(), i));
+  }
+
+  asset->node_parents.assign(m.node_list.size(), -1);
+  asset->rest_matrices.reserve(m.node_list.size());
+  for (u_int i = 0; i < m.node_list.size(); ++i) {
+    const auto& node = m.node_list[i];
+    asset->rest_matrices.push_back(node->matrix_orig);
+
+    for (const auto& child : node->children) {
+      u_int child_index = node_numbers.at(child.get());
+      assert(child_index > i);
+      asset->node_parents[child_index] = int(i);
+    }
+
+    for (const auto& ref : node->mesh) {
+      if (!m.mesh[ref.index].has_bone) continue;
+      asset->skin_refs.push_back({ i, ref.index, ref.palette_offset });
+    }
+  }
+
+  for (const auto& anim : m.animation) {
+    std::vector<u_int> nodes;
+    for (const auto& body : anim.body) {
+      nodes.push_back(node_numbers.at(body.node));
+    }
+    asset->channel_nodes.push_back(std::move(nodes));
+  }
+
+  std::vector<std::vector<u_int>> bone_nodes;
+  for (const auto& mesh : m.mesh) {
+    std::vector<u_int> nodes;
+    for (const auto& bone : mesh.bones) {
+      nodes.push_back(node_numbers.at(bone.node));
+    }
+    bone_nodes.push_back(std::move(nodes));
+  }
+
+  setupSkeletonLods(*asset, bone_nodes);
+
+  return asset;
+}
+
+
+ModelInstance createModelInstance(const ModelAssetRef& asset, const size_t animation = 0, const double time_offset = 0.0) {
+  ModelInstance instance;
+  instance.asset       = asset;
+  instance.animation   = animation;
+  instance.time_offset = time_offset;
+
+  return instance;
+}
+
+
+// インスタンスが再生するクリップのキー
+//   キーは最初に使う時に読み込む(animateがfalseか、読み込めなければnullptr)
+//   ライブラリのmutexを使うので、インスタンスごとではなくまとめて取り出して渡す
+std::shared_ptr<const Anim> acquireInstanceClip(const ModelInstance& instance, const bool animate = true) {
+  const auto& model = instance.asset->model;
+  return (animate && model.has_anim) ? acquireClip(*model.clips, instance.animation) : nullptr;
+}
+
+
+// インスタンスの再生状態でtimeの姿勢を計算
+//   clipはinstance.animationのキー(nullptrなら初期の姿勢)
+//   instance.lodで省いたノードの行列は計算しない(メッシュの付いたノードは省かない)
+//   一度計算した後は行列の容量を使い回すので、ヒープを使わない
+void calcInstancePose(const ModelInstance& instance, const double time, const Anim* clip, Pose& pose) {
+  const auto& asset = *instance.asset;
+  const auto& model = asset.model;
+  const auto& lod   = asset.lods[std::min(instance.lod, u_int(SKELETON_LOD_NUM - 1))];
+
+  // 親行列を掛ける前の行列から始める
+  auto& matrices = pose.node_matrices;
+  matrices.resize(asset.rest_matrices.size());
+  for (auto n : lod.nodes) {
+    matrices[n] = asset.rest_matrices[n];
+  }
+
+  if (clip) {
+    const auto& anim = model.animation[instance.animation];
+    const auto& channel_nodes = asset.channel_nodes[instance.animation];
+
+    // 最大時間でループさせている
+    double current_time = std::fmod(time * instance.speed + instance.time_offset, anim.duration);
+    for (auto c : lod.channels[instance.animation]) {
+      matrices[channel_nodes[c]] = getNodeAnimMatrix(clip->body[c], current_time);
+    }
+  }
+
+  // 親は子より前にあるので、先頭から親の行列を掛けていけば良い
+  for (auto n : lod.nodes) {
+    int parent = asset.node_parents[n];
+    if (parent >= 0) matrices[n] = matrices[parent] * matrices[n];
+  }
+  countProfile(PROFILE_NODES, lod.nodes.size());
+
+  auto& palette = pose.palette;
+  palette.resize(model.palette_size);
+  for (const auto& ref : asset.skin_refs) {
+    const auto& bone_nodes   = lod.bone_nodes[ref.mesh];
+    const auto& bone_offsets = lod.bone_offsets[ref.mesh];
+    countProfile(PROFILE_BONES, bone_nodes.size());
+
+    auto invert_matrix = glm::inverse(matrices[ref.node]);
+    for (size_t i = 0; i < bone_nodes.size(); ++i) {
+      palette[ref.palette_offset + i] = invert_matrix * matrices[bone_nodes[i]] * bone_offsets[i];
+    }
+  }
+}
+
+// アニメーションを適用した姿勢をinstance.poseに計算
+void updateModelInstance(ModelInstance& instance, const double time, const Anim* clip) {
+  calcInstancePose(instance, time, clip, instance.pose);
+  instance.ticked = false;
+}
+
+// 1秒にtick_rate回の刻みで姿勢を計算し、timeの姿勢を補間してoutに書き込む
+//   刻みの時刻とその次の刻みの時刻の姿勢を持ち、刻みを越えた時だけ計算する
+//   次の刻みへ進んだだけなら、計算済みの姿勢を使い回す(計算は1回)
+//   戻り値は姿勢を計算したらtrue
+bool tickModelInstance(ModelInstance& instance, const double time, const double tick_rate,
+                       const Anim* clip, Pose& out) {
+  const double interval = 1.0 / tick_rate;
+  double tick = (std::floor(time * tick_rate - instance.tick_phase) + instance.tick_phase) * interval;
+
+  bool updated = !instance.ticked || (tick != instance.tick_time);
+  if (updated) {
+    bool next = instance.ticked && (std::abs(tick - instance.tick_time - interval) < interval * 0.5);
+    if (next) std::swap(instance.pose, instance.tick_pose);
+    else      calcInstancePose(instance, tick, clip, instance.pose);
+
+    calcInstancePose(instance, tick + interval, clip, instance.tick_pose);
+    instance.tick_time = tick;
+    instance.ticked    = true;
+  }
+
+  float t = float(std::min(std::max((time - tick) * tick_rate, 0.0), 1.0));
+  interpolatePose(instance.pose, instance.tick_pose, t, out);
+
+  return updated;
+}
+
+
+// インスタンスひとつが使うメモリ(アセットの分は含まない)
+size_t getModelInstanceBytes(const ModelInstance& instance) {
+  return sizeof(ModelInstance)
+       + instance.pose.node_matrices.capacity() * sizeof(ci::mat4)
+       + instance.pose.palette.capacity() * sizeof(ci::mat4)
+       + instance.tick_pose.node_matrices.capacity() * sizeof(ci::mat4)
+       + instance.tick_pose.palette.capacity() * sizeof(ci::mat4);
+}
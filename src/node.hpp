@@ -8,10 +8,20 @@
 #include <glm/gtc/type_ptr.hpp>
 
 
+// 共有しているメッシュへの参照
+//   スキニングの行列は参照するノードごとに違うのでこちらで持つ
+struct MeshRef {
+  u_int index;
+
+  std::vector<ci::mat4> bone_matrices;
+  // 全MeshRefのボーン行列を連結した時の開始位置(インスタンス描画で使う)
+  u_int palette_offset;
+};
+
 struct Node {
   std::string name;
 
-  std::vector<Mesh> mesh;
+  std::vector<MeshRef> mesh;
 
   ci::mat4 matrix;
   ci::mat4 matrix_orig;
@@ -23,15 +33,17 @@ struct Node {
 
 
 // 再帰で子供のノードも生成
-std::shared_ptr<Node> createNode(const aiNode* const n, aiMesh** mesh) {
+//   メッシュは変換済みのものをインデックスで参照する
+std::shared_ptr<Node> createNode(const aiNode* const n, const std::vector<Mesh>& meshes) {
   auto node = std::make_shared<Node>();
 
   node->name = n->mName.C_Str();
 
-  ci::app::console() << "Node:" << node->name << std::endl;
+  logDebug(LOG_IMPORT) << "Node:" << node->name;
 
   for (u_int i = 0; i < n->mNumMeshes; ++i) {
-    node->mesh.push_back(createMesh(mesh[n->mMeshes[i]]));
+    u_int index = n->mMeshes[i];
+    node->mesh.push_back({ index, std::vector<ci::mat4>(meshes[index].bones.size()), 0 });
   }
 
   // Assimpの行列はcolmn-major
@@ -43,7 +55,7 @@ std::shared_ptr<Node> createNode(const aiNode* const n, aiMesh** mesh) {
   node->matrix_orig = node->matrix;
 
   for (u_int i = 0; i < n->mNumChildren; ++i) {
-    node->children.push_back(createNode(n->mChildren[i], mesh));
+    node->children.push_back(createNode(n->mChildren[i], meshes));
   }
 
   return node;
@@ -57,7 +69,7 @@ void createNodeInfo(const std::shared_ptr<Node>& node,
   node_index.insert(std::make_pair(node->name, node));
   node_list.push_back(node);
 
-  for (auto child : node->children) {
+  for (const auto& child : node->children) {
     createNodeInfo(child, node_index, node_list);
   }
 }
@@ -70,7 +82,8 @@ void updateNodeDerivedMatrix(const std::shared_ptr<Node>& node,
   node->global_matrix = parent_matrix * node->matrix;
   node->invert_matrix = ci::inverse(node->global_matrix);
 
-  for (auto child : node->children) {
+  // shared_ptrをコピーすると参照カウントの更新が毎フレーム起きる
+  for (const auto& child : node->children) {
     updateNodeDerivedMatrix(child, node->global_matrix);
   }
 }
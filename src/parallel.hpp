@@ -0,0 +1,143 @@
+﻿#pragma once
+
+//
+// スレッドプールと並列処理
+//
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <algorithm>
+
+
+class ThreadPool {
+  std::vector<std::thread> threads;
+
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::deque<std::function<void ()> > jobs;
+  bool finish;
+
+
+  void worker() {
+    for (;;) {
+      std::function<void ()> job;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [this]() { return finish || !jobs.empty(); });
+        if (jobs.empty()) return;
+
+        job = std::move(jobs.front());
+        jobs.pop_front();
+      }
+      job();
+    }
+  }
+
+
+public:
+  explicit ThreadPool(const size_t num)
+    : finish(false)
+  {
+    for (size_t i = 0; i < num; ++i) {
+      threads.emplace_back([this]() { worker(); });
+    }
+  }
+
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      finish = true;
+    }
+    cv.notify_all();
+
+    for (auto& t : threads) {
+      t.join();
+    }
+  }
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+
+  size_t size() const {
+    return threads.size();
+  }
+
+  // 処理を登録
+  void push(std::function<void ()> job) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      jobs.push_back(std::move(job));
+    }
+    cv.notify_one();
+  }
+};
+
+
+// アプリ全体で共有するスレッドプール
+//   呼び出し元のスレッドも処理に加わるので、コア数-1だけ用意する
+ThreadPool& getThreadPool() {
+  static ThreadPool pool(std::max(std::thread::hardware_concurrency(), 2u) - 1);
+  return pool;
+}
+
+
+// 0 ~ num-1 の処理を並列に実行する
+//   呼び出し元のスレッドも処理をおこなうので
+//   プールが埋まっていても(入れ子で呼ばれても)必ず終わる
+void parallelFor(const size_t num, const std::function<void (size_t)>& func) {
+  auto& pool = getThreadPool();
+  size_t num_helpers = std::min(pool.size(), num > 0 ? num - 1 : 0);
+
+  if (num_helpers == 0) {
+    for (size_t i = 0; i < num; ++i) {
+      func(i);
+    }
+    return;
+  }
+
+  struct State {
+    std::atomic<size_t> next;
+    std::atomic<size_t> done;
+    size_t num;
+    const std::function<void (size_t)>* func;
+
+    std::mutex mutex;
+    std::condition_variable cv;
+  };
+
+  // 遅れて動き出したスレッドが触れても良いよう共有しておく
+  auto state = std::make_shared<State>();
+  state->next = 0;
+  state->done = 0;
+  state->num  = num;
+  state->func = &func;
+
+  auto run = [](State& s) {
+    for (;;) {
+      size_t i = s.next++;
+      if (i >= s.num) break;
+
+      (*s.func)(i);
+
+      if (++s.done == s.num) {
+        std::lock_guard<std::mutex> lock(s.mutex);
+        s.cv.notify_all();
+      }
+    }
+  };
+
+  for (size_t i = 0; i < num_helpers; ++i) {
+    pool.push([state, run]() { run(*state); });
+  }
+  run(*state);
+
+  std::unique_lock<std::mutex> lock(state->mutex);
+  state->cv.wait(lock, [&state]() { return state->done == state->num; });
+}
@@ -0,0 +1,55 @@
+﻿#pragma once
+
+//
+// モデルの姿勢
+//   アニメーションを適用した結果だけを取り出したもの
+//   ひとつのモデルを異なる姿勢で複数描画する時に使う
+//
+
+#include <vector>
+#include <algorithm>
+#include <cassert>
+#include "model.hpp"
+
+
+struct Pose {
+  // node_listと同じ並びのノード行列(親行列適用済み)
+  std::vector<ci::mat4> node_matrices;
+  // 全MeshRefのボーン行列(MeshRef::palette_offsetから並ぶ)
+  std::vector<ci::mat4> palette;
+};
+
+
+// モデルの現在の姿勢を取り出す
+void capturePose(const Model& model, Pose& pose) {
+  pose.node_matrices.resize(model.node_list.size());
+  pose.palette.resize(model.palette_size);
+
+  for (size_t i = 0; i < model.node_list.size(); ++i) {
+    const auto& node = model.node_list[i];
+    pose.node_matrices[i] = node->global_matrix;
+
+    for (const auto& ref : node->mesh) {
+      std::copy(std::begin(ref.bone_matrices), std::end(ref.bone_matrices),
+                std::begin(pose.palette) + ref.palette_offset);
+    }
+  }
+}
+
+// 2つの姿勢の間を補間する(tが0ならfrom、1ならto)
+//   行列の要素ごとの線形補間なので、間隔が短い(回転が小さい)ことが前提
+//   outの行列の容量は使い回す
+void interpolatePose(const Pose& from, const Pose& to, const float t, Pose& out) {
+  assert(from.node_matrices.size() == to.node_matrices.size());
+  assert(from.palette.size() == to.palette.size());
+
+  out.node_matrices.resize(to.node_matrices.size());
+  for (size_t i = 0; i < to.node_matrices.size(); ++i) {
+    out.node_matrices[i] = from.node_matrices[i] + (to.node_matrices[i] - from.node_matrices[i]) * t;
+  }
+
+  out.palette.resize(to.palette.size());
+  for (size_t i = 0; i < to.palette.size(); ++i) {
+    out.palette[i] = from.palette[i] + (to.palette[i] - from.palette[i]) * t;
+  }
+}
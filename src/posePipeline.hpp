@@ -0,0 +1,247 @@
+﻿#pragma once
+
+//
+// 姿勢の計算を別スレッドでおこなう
+//   描画スレッドがフレームNを描画している間に、フレームN+1の姿勢を計算する
+//   計算結果の受け渡しは3つのバッファを入れ替えるだけで、ロックを使わない
+//     back  計算スレッドが書き込み中
+//     ready 書き込みが終わって受け渡し待ち
+//     front 描画スレッドが参照中
+//   計算スレッドはアセットを参照するだけで、インスタンスの状態は計算スレッドが持つ
+//   アセットを入れ替える場合は、waitPoseSimulatorで計算の終了を待ってからsetPoseAssetを呼ぶ
+//   インスタンスごとのスケルトンのLODは依頼と一緒に渡す(描画スレッドが画面上の大きさで決める)
+//   tick_rateを指定すると、インスタンスごとにずらした刻みで計算し、間は補間する
+//     アニメーションの計算量が表示のフレームレートに依らなくなる
+//
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <vector>
+#include <limits>
+#include "model.hpp"
+#include "pose.hpp"
+#include "modelInstance.hpp"
+#include "profiler.hpp"
+#include "frameMemory.hpp"
+
+
+// 1フレーム分の姿勢
+struct PoseFrame {
+  PoseFrame()
+    : time(0.0)
+  {}
+
+  // 数が変わっても姿勢の行列の容量は使い回す
+  Pool<Pose> poses;
+  // 計算したアニメーションの時刻
+  double time;
+};
+
+// 計算の依頼
+struct PoseRequest {
+  uint64_t serial;
+
+  double time;
+  // 姿勢の数(少しずつ時間をずらす)
+  size_t num;
+  // falseならアニメーションしていない姿勢
+  bool animate;
+  // 1秒あたりの計算の回数(0なら毎回計算する)
+  double tick_rate;
+};
+
+enum {
+  POSE_FRAME_INDEX_MASK = 0x3,
+  // readyに新しい内容が入っている
+  POSE_FRAME_FRESH      = 0x4,
+};
+
+
+struct PoseSimulator {
+  PoseSimulator()
+    : ready(1),
+      back(0),
+      front(2),
+      request{ 0, 0.0, 0, false, 0.0 },
+      done_serial(0),
+      quit(false)
+  {}
+
+  // 計算に使うアセット
+  ModelAssetRef asset;
+  // 計算スレッドだけが使う
+  Pool<ModelInstance> instances;
+  std::vector<u_int> lods;
+
+  PoseFrame frames[3];
+  std::atomic<u_int> ready;
+  // 計算スレッドだけが使う
+  u_int back;
+  // 描画スレッドだけが使う
+  u_int front;
+
+  // 依頼とスレッドの待機だけをmutexで守る
+  std::thread thread;
+  std::mutex mutex;
+  std::condition_variable cv;
+  PoseRequest request;
+  // インスタンスごとのスケルトンのLOD(依頼と一緒に計算スレッドへコピーする)
+  std::vector<u_int> request_lods;
+  uint64_t done_serial;
+  bool quit;
+};
+
+
+// 時間をずらしたインスタンスごとに姿勢を計算する
+//   同期モードではこれを描画スレッドから直接呼ぶ
+//   lodsが足りないインスタンスは全てのノードを計算する
+//   毎回計算する場合は、計算した行列をフレームの姿勢と入れ替えるのでコピーしない
+//   刻みで計算する場合は、補間した姿勢をフレームに書き込む(どちらもヒープの確保はしない)
+void simulatePoses(const ModelAssetRef& asset, const PoseRequest& request, const std::vector<u_int>& lods,
+                   Pool<ModelInstance>& instances, PoseFrame& frame) {
+  ProfileZone profile_zone("simulatePoses");
+
+  frame.time = request.time;
+  if (!asset) {
+    clearPool(frame.poses);
+    return;
+  }
+
+  // 増えた分だけインスタンスを作る
+  size_t created = instances.items.size();
+  resizePool(instances, request.num);
+  for (size_t i = created; i < instances.items.size(); ++i) {
+    instances[i] = createModelInstance(asset, 0, i * 0.37);
+    // 刻みを黄金比でずらすと、数によらず均等に分散する
+    double phase = i * 0.6180339887;
+    instances[i].tick_phase = phase - std::floor(phase);
+  }
+
+  // 止まっている姿勢は刻む必要がない
+  bool tick = request.animate && (request.tick_rate > 0.0);
+
+  // クリップのキーはインスタンスごとではなく、同じクリップが続く間は1回だけ取り出す
+  //   (ライブラリのmutexと参照カウントを毎回触らない)
+  std::shared_ptr<const Anim> clip;
+  size_t clip_index = std::numeric_limits<size_t>::max();
+
+  resizePool(frame.poses, request.num);
+  for (size_t i = 0; i < request.num; ++i) {
+    auto& instance = instances[i];
+    instance.lod = (i < lods.size()) ? lods[i] : 0;
+    if (request.animate && (instance.animation != clip_index)) {
+      clip       = acquireInstanceClip(instance);
+      clip_index = instance.animation;
+    }
+
+    if (tick) {
+      tickModelInstance(instance, request.time, request.tick_rate, clip.get(), frame.poses[i]);
+    }
+    else {
+      updateModelInstance(instance, request.time, clip.get());
+      std::swap(instance.pose, frame.poses[i]);
+    }
+  }
+}
+
+
+void runPoseSimulator(PoseSimulator& sim) {
+  setProfileThreadName("pose");
+
+  for (;;) {
+    PoseRequest request;
+    {
+      std::unique_lock<std::mutex> lock(sim.mutex);
+      sim.cv.wait(lock, [&sim]() { return sim.quit || (sim.request.serial != sim.done_serial); });
+      if (sim.quit) return;
+
+      // 溜まった依頼は最新のものだけを計算する
+      request = sim.request;
+      sim.lods.assign(sim.request_lods.begin(), sim.request_lods.end());
+    }
+
+    simulatePoses(sim.asset, request, sim.lods, sim.instances, sim.frames[sim.back]);
+
+    // 書き込んだバッファを受け渡し、空いたバッファを次の書き込み先にする
+    sim.back = sim.ready.exchange(sim.back | POSE_FRAME_FRESH) & POSE_FRAME_INDEX_MASK;
+
+    {
+      std::lock_guard<std::mutex> lock(sim.mutex);
+      sim.done_serial = request.serial;
+    }
+    sim.cv.notify_all();
+  }
+}
+
+void startPoseSimulator(PoseSimulator& sim) {
+  sim.quit = false;
+  sim.thread = std::thread([&sim]() { runPoseSimulator(sim); });
+}
+
+void stopPoseSimulator(PoseSimulator& sim) {
+  if (!sim.thread.joinable()) return;
+
+  {
+    std::lock_guard<std::mutex> lock(sim.mutex);
+    sim.quit = true;
+  }
+  sim.cv.notify_all();
+  sim.thread.join();
+}
+
+
+// 次のフレームの姿勢の計算を依頼
+//   計算中なら終わった後に計算する
+//   tick_rateは1秒あたりの計算の回数(0なら毎回計算する)
+//   lodsはインスタンスごとのスケルトンのLOD(空なら全て0)
+void requestPoses(PoseSimulator& sim, const double time, const size_t num, const bool animate,
+                  const double tick_rate = 0.0, const std::vector<u_int>& lods = std::vector<u_int>()) {
+  {
+    std::lock_guard<std::mutex> lock(sim.mutex);
+    sim.request = PoseRequest{ sim.request.serial + 1, time, num, animate, tick_rate };
+    sim.request_lods.assign(lods.begin(), lods.end());
+  }
+  sim.cv.notify_all();
+}
+
+// 依頼した計算が全て終わるまで待つ
+void waitPoseSimulator(PoseSimulator& sim) {
+  if (!sim.thread.joinable()) return;
+
+  std::unique_lock<std::mutex> lock(sim.mutex);
+  sim.cv.wait(lock, [&sim]() { return sim.request.serial == sim.done_serial; });
+}
+
+// 計算済みの姿勢を捨てる
+//   計算の終了を待ってから呼ぶ
+void clearPoseFrames(PoseSimulator& sim) {
+  for (auto& frame : sim.frames) {
+    clearPool(frame.poses);
+  }
+  sim.ready &= POSE_FRAME_INDEX_MASK;
+}
+
+// 計算に使うアセットを入れ替える
+//   計算の終了を待ってから呼ぶ
+//   前のアセットを参照するインスタンスは全て捨てる(GLのリソースは描画スレッドで解放する)
+void setPoseAsset(PoseSimulator& sim, const ModelAssetRef& asset) {
+  clearPoseFrames(sim);
+  sim.instances = Pool<ModelInstance>();
+  sim.asset = asset;
+}
+
+
+// 新しい姿勢があれば描画用に受け取る
+//   描画用の姿勢はgetFrontPosesで参照する
+bool acquirePoses(PoseSimulator& sim) {
+  if (!(sim.ready.load() & POSE_FRAME_FRESH)) return false;
+
+  sim.front = sim.ready.exchange(sim.front) & POSE_FRAME_INDEX_MASK;
+  return true;
+}
+
+const PoseFrame& getFrontPoses(const PoseSimulator& sim) {
+  return sim.frames[sim.front];
+}
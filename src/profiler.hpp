@@ -0,0 +1,533 @@
+﻿#pragma once
+
+//
+// フレーム単位の計測
+//   ProfileZoneを置いた範囲の時間をスレッドごとに記録する
+//   GPUの時間はタイマークエリで計測し、数フレーム遅れて受け取る
+//   描画回数などのカウンタはフレームごとに集計する
+//   PROFILE_WINDOWフレームごとに平均を求め、指定したフレーム数をChromeのトレース形式で書き出せる
+//     chrome://tracing や https://ui.perfetto.dev で読み込める
+//   ゾーンの記録はmutexを使うので、細かすぎる単位には置かない
+//   記録用のバッファは使い回すので、トレースの記録中以外はヒープを使わない
+//
+
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <map>
+#include <array>
+#include <string>
+#include <cstring>
+#include <fstream>
+#include "misc.hpp"
+#include "logger.hpp"
+#include "allocTracker.hpp"
+
+
+// ベンチマークは自前で計測するので使わない
+#if !defined (SKELETAL_HEADLESS)
+#define USE_PROFILER
+#endif
+
+// タイマークエリは3.3以降か拡張(ESには無い)
+#if defined (USE_PROFILER) && !defined (CINDER_GL_ES)
+#define USE_GPU_TIMER
+#endif
+
+
+enum ProfileCounter {
+  PROFILE_DRAWS,
+  PROFILE_TRIANGLES,
+  // CPUで計算したボーン行列
+  PROFILE_BONES,
+  // アニメーションを適用して親行列を掛けたノード(スケルトンのLODで減る)
+  PROFILE_NODES,
+  // uniformとボーン行列テクスチャの転送
+  PROFILE_UNIFORMS,
+#if defined (USE_ALLOC_TRACKING)
+  // 全スレッドのヒープ確保
+  PROFILE_ALLOCATIONS,
+  PROFILE_ALLOCATED_BYTES,
+#endif
+
+  PROFILE_COUNTER_NUM
+};
+
+const char* const profile_counter_names[PROFILE_COUNTER_NUM] = {
+  "draws", "triangles", "bones", "nodes", "uniforms",
+#if defined (USE_ALLOC_TRACKING)
+  "allocations", "allocated bytes",
+#endif
+};
+
+enum {
+  // 平均を求めるフレーム数
+  PROFILE_WINDOW      = 60,
+  // タイマークエリの結果を待つフレーム数
+  PROFILE_GPU_LATENCY = 4,
+  // GPUの計測結果を記録するスレッド番号
+  PROFILE_GPU_THREAD  = 0,
+};
+
+
+// ゾーンの集計の単位
+//   名前は文字列リテラルなので、比較は中身でおこなう
+struct ProfileKey {
+  const char* name;
+  bool gpu;
+};
+
+struct ProfileKeyLess {
+  bool operator()(const ProfileKey& lhs, const ProfileKey& rhs) const {
+    if (lhs.gpu != rhs.gpu) return lhs.gpu < rhs.gpu;
+    return std::strcmp(lhs.name, rhs.name) < 0;
+  }
+};
+
+// 直近PROFILE_WINDOWフレームの1フレームあたりの平均
+struct ProfileStats {
+  ProfileStats()
+    : frame_ms(0.0),
+      frame_max_ms(0.0),
+      counters{}
+  {}
+
+  double frame_ms;
+  double frame_max_ms;
+  std::map<ProfileKey, double, ProfileKeyLess> zone_ms;
+  double counters[PROFILE_COUNTER_NUM];
+};
+
+// ゾーンの平均時間(記録が無ければ0)
+double getProfileZoneMs(const ProfileStats& stats, const char* name, const bool gpu = false) {
+  auto it = stats.zone_ms.find(ProfileKey{ name, gpu });
+  return (it != stats.zone_ms.end()) ? it->second : 0.0;
+}
+
+
+// トレースの置き場所
+std::string getProfileTracePath() {
+  try {
+    auto directory = ci::fs::temp_directory_path() / "SkeletalCinder";
+    ci::fs::create_directories(directory);
+    return (directory / "trace.json").string();
+  }
+  catch (std::exception& e) {
+    logWarning(LOG_PROFILE) << "Trace directory:" << e.what();
+    return std::string();
+  }
+}
+
+
+#if defined (USE_PROFILER)
+
+using ProfileClock = std::chrono::steady_clock;
+
+struct ProfileEvent {
+  // 文字列リテラルを指す
+  const char* name;
+  // 計測開始からのナノ秒
+  int64_t begin;
+  int64_t end;
+  u_int thread;
+};
+
+#if defined (USE_GPU_TIMER)
+struct GpuTimer {
+  const char* name;
+  GLuint queries[PROFILE_GPU_LATENCY];
+  // 発行した時刻(トレースでの位置に使う)
+  int64_t begin[PROFILE_GPU_LATENCY];
+  bool issued[PROFILE_GPU_LATENCY];
+};
+#endif
+
+struct Profiler {
+  Profiler()
+    : epoch(ProfileClock::now()),
+      thread_names{ "GPU" },
+      frame(0),
+      frame_begin(0),
+      window_frames(0),
+      window_frame_ns(0),
+      window_frame_max_ns(0),
+      window_counters{},
+#if defined (USE_ALLOC_TRACKING)
+      alloc_prev(getAllocStats()),
+#endif
+      stats_updated(false),
+      trace_frames(0)
+  {
+    for (auto& counter : counters) {
+      counter = 0;
+    }
+  }
+
+  ProfileClock::time_point epoch;
+
+  // eventsとスレッドの登録を守る
+  std::mutex mutex;
+  std::map<std::thread::id, u_int> threads;
+  std::vector<std::string> thread_names;
+  // 今のフレームで終わったゾーン
+  std::vector<ProfileEvent> events;
+  // 集計中のフレームのゾーン(eventsと入れ替えて使う)
+  std::vector<ProfileEvent> frame_events;
+
+  std::atomic<uint64_t> counters[PROFILE_COUNTER_NUM];
+
+  // 以下はメインスレッドだけが使う
+  uint64_t frame;
+  int64_t frame_begin;
+
+#if defined (USE_GPU_TIMER)
+  std::vector<GpuTimer> gpu_timers;
+#endif
+
+  // 集計中の窓
+  u_int window_frames;
+  int64_t window_frame_ns;
+  int64_t window_frame_max_ns;
+  std::map<ProfileKey, int64_t, ProfileKeyLess> window_zone_ns;
+  uint64_t window_counters[PROFILE_COUNTER_NUM];
+
+#if defined (USE_ALLOC_TRACKING)
+  AllocStats alloc_prev;
+#endif
+
+  ProfileStats stats;
+  // 窓が閉じてstatsを更新したフレームだけtrue
+  bool stats_updated;
+
+  // トレースの記録
+  int trace_frames;
+  std::string trace_path;
+  std::vector<ProfileEvent> trace_events;
+  std::vector<std::pair<int64_t, std::array<uint64_t, PROFILE_COUNTER_NUM>>> trace_counters;
+};
+
+
+Profiler& getProfiler() {
+  static Profiler profiler;
+  return profiler;
+}
+
+int64_t getProfileTime(const Profiler& profiler) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(ProfileClock::now() - profiler.epoch).count();
+}
+
+// スレッドの番号(mutexを取ってから呼ぶ)
+u_int getProfileThread(Profiler& profiler) {
+  auto id = std::this_thread::get_id();
+  auto it = profiler.threads.find(id);
+  if (it != profiler.threads.end()) return it->second;
+
+  u_int index = u_int(profiler.thread_names.size());
+  profiler.threads.insert({ id, index });
+  profiler.thread_names.push_back("thread " + std::to_string(index));
+  return index;
+}
+
+// 呼び出したスレッドにトレースで表示する名前を付ける
+void setProfileThreadName(const std::string& name) {
+  auto& profiler = getProfiler();
+  std::lock_guard<std::mutex> lock(profiler.mutex);
+  profiler.thread_names[getProfileThread(profiler)] = name;
+}
+
+
+// コンストラクタからデストラクタまでを記録する
+class ProfileZone {
+public:
+  ProfileZone(const char* name)
+    : name(name),
+      begin(getProfileTime(getProfiler()))
+  {}
+
+  ~ProfileZone() {
+    auto& profiler = getProfiler();
+    int64_t end = getProfileTime(profiler);
+
+    std::lock_guard<std::mutex> lock(profiler.mutex);
+    profiler.events.push_back({ name, begin, end, getProfileThread(profiler) });
+  }
+
+  ProfileZone(const ProfileZone&) = delete;
+  ProfileZone& operator=(const ProfileZone&) = delete;
+
+
+private:
+  const char* name;
+  int64_t begin;
+};
+
+
+void countProfile(const ProfileCounter counter, const uint64_t value = 1) {
+  getProfiler().counters[counter].fetch_add(value, std::memory_order_relaxed);
+}
+
+
+#if defined (USE_GPU_TIMER)
+
+bool isGpuTimerSupported() {
+  static const bool supported = (ci::gl::getVersion() >= std::make_pair(GLint(3), GLint(3)))
+                             || ci::gl::isExtensionAvailable("GL_ARB_timer_query");
+  return supported;
+}
+
+GpuTimer& getGpuTimer(Profiler& profiler, const char* name) {
+  for (auto& timer : profiler.gpu_timers) {
+    if (std::strcmp(timer.name, name) == 0) return timer;
+  }
+
+  GpuTimer timer{};
+  timer.name = name;
+  glGenQueries(PROFILE_GPU_LATENCY, timer.queries);
+  profiler.gpu_timers.push_back(timer);
+  return profiler.gpu_timers.back();
+}
+
+// 結果が出ているクエリを読み、GPUのスレッドの記録にする
+//   待つと止まるので、出ていなければ次のフレームで見る
+void collectGpuTimers(Profiler& profiler) {
+  std::lock_guard<std::mutex> lock(profiler.mutex);
+  for (auto& timer : profiler.gpu_timers) {
+    for (int i = 0; i < PROFILE_GPU_LATENCY; ++i) {
+      if (!timer.issued[i]) continue;
+
+      GLint available = GL_FALSE;
+      glGetQueryObjectiv(timer.queries[i], GL_QUERY_RESULT_AVAILABLE, &available);
+      if (!available) continue;
+
+      GLuint64 elapsed = 0;
+      glGetQueryObjectui64v(timer.queries[i], GL_QUERY_RESULT, &elapsed);
+      timer.issued[i] = false;
+
+      profiler.events.push_back({ timer.name, timer.begin[i], timer.begin[i] + int64_t(elapsed), PROFILE_GPU_THREAD });
+    }
+  }
+}
+
+#endif
+
+// GPUでの描画時間を記録する
+//   GL_TIME_ELAPSEDは入れ子にできないので、描画パスの単位で重ならないように置く
+//   メインスレッドからのみ使う
+class GpuProfileZone {
+public:
+  GpuProfileZone(const char* name)
+    : active(false)
+  {
+#if defined (USE_GPU_TIMER)
+    if (!isGpuTimerSupported()) return;
+
+    auto& profiler = getProfiler();
+    auto& timer = getGpuTimer(profiler, name);
+    size_t slot = profiler.frame % PROFILE_GPU_LATENCY;
+
+    // 結果が間に合わなかった分は捨てる
+    timer.begin[slot]  = getProfileTime(profiler);
+    timer.issued[slot] = true;
+    glBeginQuery(GL_TIME_ELAPSED, timer.queries[slot]);
+    active = true;
+#endif
+  }
+
+  ~GpuProfileZone() {
+#if defined (USE_GPU_TIMER)
+    if (active) glEndQuery(GL_TIME_ELAPSED);
+#endif
+  }
+
+  GpuProfileZone(const GpuProfileZone&) = delete;
+  GpuProfileZone& operator=(const GpuProfileZone&) = delete;
+
+
+private:
+  bool active;
+};
+
+
+// トレースの記録を開始
+//   frames分を記録し終えたらpathへ書き出す
+void startProfileTrace(const int frames, const std::string& path) {
+  auto& profiler = getProfiler();
+  profiler.trace_frames = frames;
+  profiler.trace_path   = path;
+  profiler.trace_events.clear();
+  profiler.trace_counters.clear();
+}
+
+bool isProfileTracing() {
+  return getProfiler().trace_frames > 0;
+}
+
+// Chromeのトレース形式で書き出す
+//   時間の単位はマイクロ秒
+//   ゾーンは完了イベント(X)、カウンタはフレームごとのカウンタイベント(C)
+bool writeProfileTrace(const Profiler& profiler, const std::string& path) {
+  std::ofstream ofs(path);
+  if (!ofs) return false;
+
+  ofs << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+
+  bool first = true;
+  auto separator = [&ofs, &first]() {
+    if (!first) ofs << ",\n";
+    first = false;
+  };
+
+  for (size_t i = 0; i < profiler.thread_names.size(); ++i) {
+    separator();
+    ofs << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":" << i
+        << ",\"args\":{\"name\":\"" << profiler.thread_names[i] << "\"}}";
+  }
+
+  for (const auto& event : profiler.trace_events) {
+    separator();
+    ofs << "{\"name\":\"" << event.name << "\",\"ph\":\"X\",\"pid\":0,\"tid\":" << event.thread
+        << ",\"ts\":" << event.begin / 1000.0
+        << ",\"dur\":" << (event.end - event.begin) / 1000.0 << "}";
+  }
+
+  for (const auto& counter : profiler.trace_counters) {
+    separator();
+    ofs << "{\"name\":\"counters\",\"ph\":\"C\",\"pid\":0,\"ts\":" << counter.first / 1000.0 << ",\"args\":{";
+    for (int i = 0; i < PROFILE_COUNTER_NUM; ++i) {
+      ofs << (i ? "," : "") << "\"" << profile_counter_names[i] << "\":" << counter.second[i];
+    }
+    ofs << "}}";
+  }
+
+  ofs << "\n]}\n";
+  return bool(ofs);
+}
+
+
+// フレームの開始(updateの最初で呼ぶ)
+void beginProfileFrame() {
+  auto& profiler = getProfiler();
+  profiler.frame_begin   = getProfileTime(profiler);
+  profiler.stats_updated = false;
+
+#if defined (USE_GPU_TIMER)
+  collectGpuTimers(profiler);
+#endif
+}
+
+// フレームの終了(drawの最後で呼ぶ)
+//   このフレームで終わったゾーンとカウンタを集計する
+void endProfileFrame() {
+  auto& profiler = getProfiler();
+  int64_t frame_end = getProfileTime(profiler);
+
+  auto& events = profiler.frame_events;
+  {
+    std::lock_guard<std::mutex> lock(profiler.mutex);
+    events.swap(profiler.events);
+  }
+
+#if defined (USE_ALLOC_TRACKING)
+  auto alloc = getAllocStats();
+  countProfile(PROFILE_ALLOCATIONS,     (alloc - profiler.alloc_prev).count);
+  countProfile(PROFILE_ALLOCATED_BYTES, (alloc - profiler.alloc_prev).bytes);
+  profiler.alloc_prev = alloc;
+#endif
+
+  std::array<uint64_t, PROFILE_COUNTER_NUM> counters;
+  for (int i = 0; i < PROFILE_COUNTER_NUM; ++i) {
+    counters[i] = profiler.counters[i].exchange(0, std::memory_order_relaxed);
+    profiler.window_counters[i] += counters[i];
+  }
+
+  int64_t frame_ns = frame_end - profiler.frame_begin;
+  profiler.window_frame_ns    += frame_ns;
+  profiler.window_frame_max_ns = std::max(profiler.window_frame_max_ns, frame_ns);
+  for (const auto& event : events) {
+    // 初めてのゾーンだけmapに追加される
+    profiler.window_zone_ns[ProfileKey{ event.name, event.thread == PROFILE_GPU_THREAD }] += event.end - event.begin;
+  }
+
+  profiler.window_frames += 1;
+  if (profiler.window_frames == PROFILE_WINDOW) {
+    auto to_ms = [](const int64_t ns) { return ns / (1000000.0 * PROFILE_WINDOW); };
+
+    auto& stats = profiler.stats;
+    stats.frame_ms     = to_ms(profiler.window_frame_ns);
+    stats.frame_max_ms = profiler.window_frame_max_ns / 1000000.0;
+    for (auto& zone : profiler.window_zone_ns) {
+      stats.zone_ms[zone.first] = to_ms(zone.second);
+      zone.second = 0;
+    }
+    for (int i = 0; i < PROFILE_COUNTER_NUM; ++i) {
+      stats.counters[i] = double(profiler.window_counters[i]) / PROFILE_WINDOW;
+      profiler.window_counters[i] = 0;
+    }
+
+    profiler.window_frames       = 0;
+    profiler.window_frame_ns     = 0;
+    profiler.window_frame_max_ns = 0;
+    profiler.stats_updated = true;
+  }
+
+  if (profiler.trace_frames > 0) {
+    profiler.trace_events.insert(std::end(profiler.trace_events), std::begin(events), std::end(events));
+    profiler.trace_counters.push_back({ profiler.frame_begin, counters });
+
+    profiler.trace_frames -= 1;
+    if (profiler.trace_frames == 0) {
+      if (writeProfileTrace(profiler, profiler.trace_path)) {
+        logInfo(LOG_PROFILE) << "Trace:" << profiler.trace_path;
+      }
+      else {
+        logWarning(LOG_PROFILE) << "Can't write trace:" << profiler.trace_path;
+      }
+      profiler.trace_events.clear();
+      profiler.trace_counters.clear();
+    }
+  }
+  events.clear();
+
+  profiler.frame += 1;
+}
+
+const ProfileStats& getProfileStats() {
+  return getProfiler().stats;
+}
+
+bool isProfileStatsUpdated() {
+  return getProfiler().stats_updated;
+}
+
+#else
+
+// 計測しない場合は何もしない
+class ProfileZone {
+public:
+  ProfileZone(const char*) {}
+};
+
+class GpuProfileZone {
+public:
+  GpuProfileZone(const char*) {}
+};
+
+void setProfileThreadName(const std::string&) {}
+void countProfile(const ProfileCounter, const uint64_t = 1) {}
+
+void beginProfileFrame() {}
+void endProfileFrame() {}
+
+void startProfileTrace(const int, const std::string&) {}
+bool isProfileTracing() { return false; }
+
+const ProfileStats& getProfileStats() {
+  static const ProfileStats stats;
+  return stats;
+}
+
+bool isProfileStatsUpdated() { return false; }
+
+#endif
@@ -0,0 +1,322 @@
+﻿#pragma once
+
+//
+// 描画キュー
+//   描画するメッシュを集めて、シェーダー、バッファ、テクスチャ、マテリアルの順に並べ替える
+//   前の描画と違う状態だけを設定する
+//   同じ状態が続く場合はglMultiDrawElementsIndirectでまとめて描画する
+//   アイテム自体は動かさず、フレーム用の領域に並べ替えた順番を作る
+//
+
+#include <vector>
+#include <tuple>
+#include <algorithm>
+#include "model.hpp"
+#include "instancing.hpp"
+#include "frameMemory.hpp"
+
+
+struct DrawItem {
+  const Mesh* mesh;
+  // 姿勢のボーン行列(ボーンが無ければnullptr)
+  const ci::mat4* bone_matrices;
+  const Material* material;
+  // マテリアルのパラメータ
+  ci::gl::Ubo* material_ubo;
+  size_t material_offset;
+  // テクスチャが無ければidが0
+  MaterialTexture texture;
+
+  // モデル行列(ノードの行列まで適用済み)
+  ci::mat4 matrix;
+};
+
+#if defined (USE_MULTI_DRAW_INDIRECT)
+// glMultiDrawElementsIndirectに渡すコマンド
+struct DrawElementsCommand {
+  GLuint count;
+  GLuint instance_count;
+  GLuint first_index;
+  GLint  base_vertex;
+  GLuint base_instance;
+};
+#endif
+
+// 毎フレーム作り直すので、確保したメモリは使い回す
+struct RenderQueue {
+  std::vector<DrawItem> items;
+
+  // VAOとまとめて描画する時のインスタンス用バッファ
+  //   drawModelInstancedにもこれを渡す(VboMeshごとのインスタンス用バッファを1つにするため)
+  InstanceRenderer instance;
+
+  // 描画し終わるまで使う一時データ
+  FrameArena arena;
+
+#if defined (USE_MULTI_DRAW_INDIRECT)
+  ci::gl::VboRef indirect_buffer;
+  std::vector<DrawElementsCommand> commands;
+  // itemsと同じ並びの、ボーン行列の開始位置
+  std::vector<u_int> palette_offsets;
+#endif
+};
+
+
+// 並べ替えの順序(シェーダー、バッファ、テクスチャ、マテリアル)
+//   全て等しければ同じ状態で描画できる
+using DrawOrder = std::tuple<u_int, const ci::gl::VboMesh*, GLuint, const ci::gl::Ubo*, size_t>;
+
+DrawOrder getDrawOrder(const DrawItem& item) {
+  return DrawOrder(item.mesh->shader_index,
+                   item.mesh->vbo_mesh.get(),
+                   item.texture.id,
+                   item.material_ubo,
+                   item.material_offset);
+}
+
+// 並べ替えの順序とアイテムの番号
+//   番号も比較するので、同じ状態の中では積んだ順になる
+using DrawSortKey  = std::pair<DrawOrder, u_int>;
+using DrawSortKeys = std::vector<DrawSortKey, ArenaAllocator<DrawSortKey>>;
+
+
+// モデルの描画をキューに積む
+//   その時点のモデル行列と、姿勢の行列を使う
+//   reverseならノードとメッシュを逆順に積む(同じ状態の中での描画順が逆になる)
+//   視錐台カリングもここでおこなう
+void pushModel(RenderQueue& queue, const Model& model, const Pose& pose, const bool reverse = false) {
+  ProfileZone profile_zone("pushModel");
+
+  const auto model_matrix = ci::gl::getModelMatrix();
+#if defined (USE_FRUSTUM_CULLING)
+  const auto view_projection = ci::gl::getProjectionMatrix() * ci::gl::getModelView();
+#endif
+
+  const size_t node_num = model.node_list.size();
+  for (size_t k = 0; k < node_num; ++k) {
+    size_t n = reverse ? (node_num - 1 - k) : k;
+    const auto& node = model.node_list[n];
+    if (node->mesh.empty()) continue;
+
+#if defined (USE_FRUSTUM_CULLING)
+    // ノードのローカル座標での視錐台
+    const auto frustum = createFrustum(view_projection * pose.node_matrices[n]);
+#endif
+
+    const size_t ref_num = node->mesh.size();
+    for (size_t j = 0; j < ref_num; ++j) {
+      const auto& ref  = node->mesh[reverse ? (ref_num - 1 - j) : j];
+      const auto& mesh = model.mesh[ref.index];
+      const auto* bone_matrices = mesh.has_bone ? pose.palette.data() + ref.palette_offset : nullptr;
+
+#if defined (USE_FRUSTUM_CULLING)
+      // 画面外なら描画しない
+      const auto& aabb = mesh.has_bone ? calcSkinnedAABB(mesh, bone_matrices) : mesh.aabb;
+      if (!isVisible(frustum, aabb)) continue;
+#endif
+
+      const auto& material = model.material[mesh.material_index];
+
+      queue.items.push_back({ &mesh, bone_matrices, &material,
+                              model.material_ubo.get(), mesh.material_index * model.material_stride,
+                              getMaterialTexture(model, material),
+                              model_matrix * pose.node_matrices[n] });
+    }
+  }
+}
+
+
+#if defined (USE_MULTI_DRAW_INDIRECT)
+
+// ボーンのある全メッシュの行列をまとめてテクスチャへ転送
+void uploadQueuePalette(RenderQueue& queue) {
+  auto& renderer = queue.instance;
+  renderer.palette.clear();
+  queue.palette_offsets.clear();
+
+  for (const auto& item : queue.items) {
+    queue.palette_offsets.push_back(u_int(renderer.palette.size()));
+    if (item.mesh->has_bone) {
+      renderer.palette.insert(std::end(renderer.palette),
+                              item.bone_matrices, item.bone_matrices + item.mesh->bones.size());
+    }
+  }
+  if (renderer.palette.empty()) return;
+
+  uploadPalette(renderer);
+  countProfile(PROFILE_UNIFORMS);
+  renderer.palette_texture->bind(PALETTE_TEXTURE_UNIT);
+}
+
+// 並べ替えた順で[begin, end)にある同じ状態のアイテムをまとめて描画
+//   モデル行列とボーン行列の位置はインスタンス用の頂点属性で渡す
+//   同じメッシュが続く場合はインスタンス数を増やす
+void drawMultiIndirect(RenderQueue& queue, const DrawSortKeys& keys, const size_t begin, const size_t end,
+                       const ShaderProgram& shader) {
+  auto& renderer = queue.instance;
+  const auto& vbo_mesh = queue.items[keys[begin].second].mesh->vbo_mesh;
+
+  renderer.records.clear();
+  queue.commands.clear();
+  for (size_t k = begin; k < end; ++k) {
+    u_int i = keys[k].second;
+    const auto& item = queue.items[i];
+    const auto& mesh = *item.mesh;
+
+    if (!queue.commands.empty() && (queue.commands.back().first_index == mesh.first_index)) {
+      queue.commands.back().instance_count += 1;
+    }
+    else {
+      queue.commands.push_back({ mesh.index_count, 1, mesh.first_index, 0, GLuint(renderer.records.size()) });
+    }
+    renderer.records.push_back({ item.matrix, float(queue.palette_offsets[i]) });
+  }
+
+  // バッファの大きさはbufferDataで変えられる
+  const auto& vbo = getInstanceVbo(renderer, vbo_mesh);
+  vbo->bufferData(sizeof(InstanceRecord) * renderer.records.size(), renderer.records.data(), GL_STREAM_DRAW);
+
+  if (!queue.indirect_buffer) {
+    queue.indirect_buffer = ci::gl::Vbo::create(GL_DRAW_INDIRECT_BUFFER, 0, nullptr, GL_STREAM_DRAW);
+  }
+  queue.indirect_buffer->bufferData(sizeof(DrawElementsCommand) * queue.commands.size(), queue.commands.data(), GL_STREAM_DRAW);
+
+  ci::gl::context()->bindVao(getMeshVao(renderer.vao_cache, vbo_mesh, shader.prog));
+  ci::gl::context()->setDefaultShaderVars();
+
+  ci::gl::ScopedBuffer scoped_buffer(queue.indirect_buffer);
+  countProfile(PROFILE_DRAWS);
+  countProfile(PROFILE_UNIFORMS);
+  for (const auto& command : queue.commands) {
+    countProfile(PROFILE_TRIANGLES, (command.count / 3) * command.instance_count);
+  }
+  glMultiDrawElementsIndirect(GL_TRIANGLES, vbo_mesh->getIndexDataType(), nullptr,
+                              GLsizei(queue.commands.size()), 0);
+}
+
+#endif
+
+
+// キューを並べ替えて描画
+//   同じ状態の中ではキューに積んだ順で描画する
+void drawRenderQueue(RenderQueue& queue, const ShaderHolder& shader_holder) {
+  ProfileZone profile_zone("drawRenderQueue");
+
+  // 前のフレームの一時データを捨てる
+  resetFrameArena(queue.arena);
+
+  // stable_sortは作業用のメモリを毎回確保するので、番号付きのキーをsortする
+  DrawSortKeys keys{ ArenaAllocator<DrawSortKey>(queue.arena) };
+  keys.reserve(queue.items.size());
+  for (size_t i = 0; i < queue.items.size(); ++i) {
+    keys.push_back({ getDrawOrder(queue.items[i]), u_int(i) });
+  }
+  std::sort(std::begin(keys), std::end(keys));
+
+  auto& renderer = queue.instance;
+  purgeInstanceVbos(renderer);
+  purgeVaoCache(renderer.vao_cache);
+
+#if defined (USE_MULTI_DRAW_INDIRECT)
+  bool multi_draw = isMultiDrawIndirectSupported();
+  if (multi_draw) uploadQueuePalette(queue);
+#endif
+
+  const ShaderProgram* shader       = nullptr;
+  const ci::gl::Ubo* material_ubo   = nullptr;
+  size_t material_offset = 0;
+  MaterialTexture texture{ GL_TEXTURE_2D, 0, 0 };
+  GLenum wrap_s = 0;
+  GLenum wrap_t = 0;
+
+  ci::gl::ScopedModelMatrix scoped_matrix;
+  ci::gl::context()->pushVao();
+
+  for (size_t begin = 0; begin < keys.size(); ) {
+    // 同じ状態が続く範囲
+    size_t end = begin + 1;
+    while ((end < keys.size()) && (keys[end].first == keys[begin].first)) {
+      end += 1;
+    }
+
+    const auto& item = queue.items[keys[begin].second];
+    const auto& mesh = *item.mesh;
+
+    u_int shader_index = mesh.shader_index;
+#if defined (USE_MULTI_DRAW_INDIRECT)
+    bool batch = multi_draw && ((end - begin) > 1);
+    if (batch) shader_index |= SHADER_INSTANCING;
+#endif
+
+    const auto* next_shader = &shader_holder.at(shader_index);
+    if (shader != next_shader) {
+      shader = next_shader;
+      shader->prog->bind();
+    }
+
+    // マテリアルはUBOの範囲を切り替えるだけ(シェーダーが変わっても有効)
+    if ((material_ubo != item.material_ubo) || (material_offset != item.material_offset)) {
+      material_ubo    = item.material_ubo;
+      material_offset = item.material_offset;
+      item.material_ubo->bindBufferRange(MATERIAL_BLOCK_BINDING, material_offset, sizeof(MaterialBlock));
+    }
+
+    // テクスチャ配列なら違うマテリアルでも同じテクスチャのまま
+    //   同じテクスチャでもマテリアルごとにラップの指定が違う場合がある
+    if (item.texture.id
+        && ((texture.id != item.texture.id) || (texture.sampler != item.texture.sampler)
+            || (wrap_s != item.material->wrap_s) || (wrap_t != item.material->wrap_t))) {
+      texture = item.texture;
+      wrap_s  = item.material->wrap_s;
+      wrap_t  = item.material->wrap_t;
+      bindMaterialTexture(texture, *item.material);
+    }
+
+#if defined (USE_MULTI_DRAW_INDIRECT)
+    if (batch) {
+      drawMultiIndirect(queue, keys, begin, end, *shader);
+      begin = end;
+      continue;
+    }
+#endif
+
+    // 1つずつ描画(インデックスは書き換え済みなのでbase vertexは要らない)
+    ci::gl::context()->bindVao(getMeshVao(renderer.vao_cache, mesh.vbo_mesh, shader->prog));
+    for (size_t k = begin; k < end; ++k) {
+      const auto& it = queue.items[keys[k].second];
+      if (it.mesh->has_bone) {
+        shader->prog->uniform(shader->bone_matrices, it.bone_matrices, int(it.mesh->bones.size()));
+        countProfile(PROFILE_UNIFORMS);
+      }
+
+      ci::gl::setModelMatrix(it.matrix);
+      ci::gl::context()->setDefaultShaderVars();
+      countProfile(PROFILE_UNIFORMS);
+      drawMeshRange(*it.mesh);
+    }
+    begin = end;
+  }
+
+  ci::gl::context()->popVao();
+  if (texture.id) unbindMaterialTexture(texture);
+
+#if defined (USE_MULTI_DRAW_INDIRECT)
+  if (multi_draw && renderer.palette_texture) {
+    renderer.palette_texture->unbind(PALETTE_TEXTURE_UNIT);
+  }
+#endif
+
+  queue.items.clear();
+}
+
+
+// モデル描画
+// TIPS:姿勢に全ノードの最終的な行列が計算されているので、再帰で描画する必要は無い
+void drawModel(const Model& model,
+               const Pose& pose,
+               const ShaderHolder& shader_holder,
+               RenderQueue& queue,
+               const bool reverse = false) {
+  pushModel(queue, model, pose, reverse);
+  drawRenderQueue(queue, shader_holder);
+}
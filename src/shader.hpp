@@ -3,11 +3,26 @@
 //
 // シェーダー
 //   GLSL1.50と3.0ESの違いを吸収する
+//   1つのソースから#defineの組み合わせで複数のシェーダーを作る
 //
 
 #include <fstream>
 #include <utility>
-#include <regex>
+#include <map>
+#include <vector>
+#include <sstream>
+#include <cstring>
+#include <cinder/gl/GlslProg.h>
+#include "misc.hpp"
+#include "logger.hpp"
+#include "mappedFile.hpp"
+
+
+// リンク済みのプログラムをディスクにキャッシュする
+//   ES2.0は拡張扱いなので使わない
+#if !defined (CINDER_GL_ES_2)
+#define USE_PROGRAM_BINARY
+#endif
 
 
 using Shader = std::pair<std::string, std::string>;
@@ -24,35 +39,267 @@ std::string readFile(const std::string& path) {
 }
 
 
-// 機種依存部分を置換
-std::string replaceText(std::string text) {
-  std::vector<std::pair<std::regex, std::string> > replace{
+// $name$ 形式のトークンを置換
+//   未定義のトークンはそのまま残す
+std::string replaceText(const std::string& text,
+                        const std::map<std::string, std::string>& tokens) {
+  std::string result;
+  result.reserve(text.size());
+
+  size_t pos = 0;
+  while (pos < text.size()) {
+    size_t begin = text.find('$', pos);
+    if (begin == std::string::npos) break;
+    size_t end = text.find('$', begin + 1);
+    if (end == std::string::npos) break;
+
+    result.append(text, pos, begin - pos);
+
+    auto it = tokens.find(text.substr(begin + 1, end - begin - 1));
+    if (it != tokens.end()) {
+      result += it->second;
+      pos = end + 1;
+    }
+    else {
+      // 閉じ側の$は次のトークンの開始かもしれない
+      result += '$';
+      pos = begin + 1;
+    }
+  }
+  result.append(text, pos, std::string::npos);
+
+  return result;
+}
+
+// 機種依存部分と#defineを置換
+std::string replaceText(const std::string& text,
+                        const std::vector<std::string>& defines = std::vector<std::string>()) {
+  std::string define_text;
+  for (const auto& d : defines) {
+    define_text += "#define " + d + "\n";
+  }
+
+  std::map<std::string, std::string> tokens{
 #if defined (CINDER_COCOA_TOUCH)
-    { std::regex("\\$version\\$"), "#version 300 es" },
-    { std::regex("\\$precision\\$"), "precision mediump float;" },
+    { "version", "#version 300 es" },
+    { "precision", "precision mediump float;" },
 #else
-    { std::regex("\\$version\\$"), "#version 150" },
-    { std::regex("\\$precision\\$"), "" },
+    { "version", "#version 150" },
+    { "precision", "" },
 #endif
+    { "defines", define_text },
   };
 
-  for (const auto& t : replace) {
-    text = std::regex_replace(text, t.first, t.second);
-  }
-
-  return text;
+  return replaceText(text, tokens);
 }
 
 
 // シェーダーを読み込む
 //   パスに拡張子は要らない
 Shader readShader(const std::string& vertex_path,
-                  const std::string& fragment_path) {
+                  const std::string& fragment_path,
+                  const std::vector<std::string>& defines = std::vector<std::string>()) {
   auto vertex_shader   = readFile(ci::app::getAssetPath(vertex_path + ".vsh").string());
-  vertex_shader = replaceText(vertex_shader);
-  
+  vertex_shader = replaceText(vertex_shader, defines);
+
   auto fragment_shader = readFile(ci::app::getAssetPath(fragment_path + ".fsh").string());
-  fragment_shader = replaceText(fragment_shader);
+  fragment_shader = replaceText(fragment_shader, defines);
 
   return std::make_pair(vertex_shader, fragment_shader);
 }
+
+
+// Cinderの既定の対応表に無い頂点属性
+//   インスタンスごとのデータ(instancing.hpp)をciCustom0..4で受け取る
+const std::pair<ci::geom::Attrib, const char*> custom_attribs[] = {
+  { ci::geom::CUSTOM_0, "ciCustom0" },
+  { ci::geom::CUSTOM_1, "ciCustom1" },
+  { ci::geom::CUSTOM_2, "ciCustom2" },
+  { ci::geom::CUSTOM_3, "ciCustom3" },
+  { ci::geom::CUSTOM_4, "ciCustom4" },
+};
+
+// 頂点属性の対応を指定したFormat
+ci::gl::GlslProg::Format createShaderFormat() {
+  ci::gl::GlslProg::Format format;
+  for (const auto& attrib : custom_attribs) {
+    format.attrib(attrib.first, attrib.second);
+  }
+  return format;
+}
+
+
+#if defined (USE_PROGRAM_BINARY)
+
+// プログラムバイナリを読み込めるGlslProg
+//   GlslProgはソースからしか作れないので、仮のシェーダーで作ってから
+//   バイナリで置き換え、uniformなどの情報を取り直す
+class BinaryGlslProg : public ci::gl::GlslProg {
+public:
+  BinaryGlslProg(const Format& format)
+    : ci::gl::GlslProg(format)
+  {}
+
+  // バイナリで置き換える
+  bool loadBinary(const GLenum format, const void* data, const GLsizei size) {
+    glProgramBinary(mHandle, format, data, size);
+
+    GLint status = GL_FALSE;
+    glGetProgramiv(mHandle, GL_LINK_STATUS, &status);
+    if (status != GL_TRUE) return false;
+
+    recache();
+    return true;
+  }
+
+  // バイナリを取り出せるようにリンクし直す
+  void relinkRetrievable() {
+    glProgramParameteri(mHandle, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    glLinkProgram(mHandle);
+    recache();
+  }
+
+  // バイナリを取り出す
+  bool getBinary(GLenum& format, std::vector<uint8_t>& data) const {
+    GLint size = 0;
+    glGetProgramiv(mHandle, GL_PROGRAM_BINARY_LENGTH, &size);
+    if (size <= 0) return false;
+
+    data.resize(size);
+    GLsizei length = 0;
+    glGetProgramBinary(mHandle, size, &length, &format, data.data());
+    data.resize(length);
+    return length > 0;
+  }
+
+
+private:
+  void recache() {
+    mAttributes.clear();
+    mUniforms.clear();
+    mUniformBlocks.clear();
+
+    cacheActiveAttribs();
+    cacheActiveUniforms();
+    cacheActiveUniformBlocks();
+
+    // 取り直すとFormatで指定した対応が消えるので付け直す
+    for (auto& attribute : mAttributes) {
+      for (const auto& attrib : custom_attribs) {
+        if (attribute.mName == attrib.second) attribute.mSemantic = attrib.first;
+      }
+    }
+  }
+};
+
+
+// バイナリを差し込む仮のシェーダー
+const char* stub_vertex_shader =
+  "$version$\n"
+  "in vec4 ciPosition;\n"
+  "void main(void) { gl_Position = ciPosition; }\n";
+
+const char* stub_fragment_shader =
+  "$version$\n"
+  "$precision$\n"
+  "out vec4 oColor;\n"
+  "void main(void) { oColor = vec4(1.0); }\n";
+
+
+// バイナリを扱えるか
+bool isProgramBinarySupported() {
+  GLint num = 0;
+  glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &num);
+  return num > 0;
+}
+
+// ドライバとソースからキャッシュのキーを作る
+uint64_t getProgramBinaryHash(const Shader& shader) {
+  uint64_t hash = getHash(shader.first.data(), shader.first.size());
+  hash = getHash(shader.second.data(), shader.second.size(), hash);
+
+  for (auto name : { GL_VENDOR, GL_RENDERER, GL_VERSION }) {
+    auto str = reinterpret_cast<const char*>(glGetString(name));
+    if (str) hash = getHash(str, std::strlen(str), hash);
+  }
+  return hash;
+}
+
+// キャッシュの置き場所
+std::string getProgramBinaryPath(const uint64_t hash) {
+  try {
+    auto directory = ci::fs::temp_directory_path() / "SkeletalCinder";
+    ci::fs::create_directories(directory);
+
+    std::ostringstream name;
+    name << std::hex << hash << ".bin";
+    return (directory / name.str()).string();
+  }
+  catch (std::exception& e) {
+    logWarning(LOG_SHADER) << "Program binary directory:" << e.what();
+    return std::string();
+  }
+}
+
+// キャッシュから読み込む
+//   先頭にバイナリの形式を書いてある
+ci::gl::GlslProgRef readProgramBinary(const std::string& path) {
+  MappedFile file(path);
+  if (!file.isOpen() || (file.size() <= sizeof(GLenum))) return ci::gl::GlslProgRef();
+
+  auto data = static_cast<const uint8_t*>(file.data());
+  GLenum format;
+  std::memcpy(&format, data, sizeof(format));
+
+  auto stub = replaceText(stub_vertex_shader);
+  auto prog = std::make_shared<BinaryGlslProg>(createShaderFormat()
+                                               .vertex(stub)
+                                               .fragment(replaceText(stub_fragment_shader)));
+  if (!prog->loadBinary(format, data + sizeof(format), GLsizei(file.size() - sizeof(format)))) {
+    // ドライバが更新されたなどで使えない
+    logInfo(LOG_SHADER) << "Program binary rejected:" << path;
+    return ci::gl::GlslProgRef();
+  }
+
+  return prog;
+}
+
+// キャッシュへ書き出す
+void writeProgramBinary(const std::string& path, const BinaryGlslProg& prog) {
+  GLenum format;
+  std::vector<uint8_t> data;
+  if (!prog.getBinary(format, data)) return;
+
+  std::ofstream ofs(path, std::ios::binary);
+  ofs.write(reinterpret_cast<const char*>(&format), sizeof(format));
+  ofs.write(reinterpret_cast<const char*>(data.data()), data.size());
+}
+
+#endif
+
+
+// シェーダーを作る
+//   USE_PROGRAM_BINARYが有効ならキャッシュを使う
+ci::gl::GlslProgRef createShader(const Shader& shader) {
+  auto format = createShaderFormat().vertex(shader.first).fragment(shader.second);
+
+#if defined (USE_PROGRAM_BINARY)
+  if (isProgramBinarySupported()) {
+    auto path = getProgramBinaryPath(getProgramBinaryHash(shader));
+    if (!path.empty()) {
+      auto prog = readProgramBinary(path);
+      if (prog) {
+        logDebug(LOG_SHADER) << "Program binary:" << path;
+        return prog;
+      }
+
+      auto binary_prog = std::make_shared<BinaryGlslProg>(format);
+      binary_prog->relinkRetrievable();
+      writeProgramBinary(path, *binary_prog);
+      return binary_prog;
+    }
+  }
+#endif
+
+  return ci::gl::GlslProg::create(format);
+}
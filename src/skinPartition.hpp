@@ -0,0 +1,275 @@
+﻿#pragma once
+
+//
+// スキニングするメッシュを分ける
+//   頂点ごとに影響するボーンの数を数え、三角形を振り分ける
+//     3頂点とも同じボーンだけに従う三角形は、そのボーンのノードに付けた動かないメッシュにする
+//     (スキニングせずにノードの行列で描画する)
+//     それ以外は頂点の影響数の最大値(1、2、4)ごとにスキニングするメッシュにまとめる
+//   影響数に合わせたシェーダーを使うので、頂点ごとの行列の読み出しとブレンドが減る
+//   分けたメッシュは使うボーンだけを持つ
+//
+
+#include <map>
+#include <vector>
+#include <limits>
+#include <algorithm>
+#include "mesh.hpp"
+#include "node.hpp"
+#include "staticMerge.hpp"
+
+
+// ボーンのノードへ移す三角形の最小数
+//   少ないと描画の回数が増えるだけなので、影響数1のメッシュに残す
+enum {
+  SKIN_RIGID_MIN_TRIANGLES = 32,
+};
+
+// 影響数ごとのまとめ先(0:1本 1:2本 2:4本)
+enum {
+  SKIN_BUCKET_NUM = 3,
+};
+
+u_int getInfluenceBucket(const u_int influences) {
+  return (influences <= 1) ? 0
+       : (influences <= 2) ? 1
+                           : 2;
+}
+
+
+// 三角形を抜き出したメッシュを作る
+//   頂点は使うものだけを詰め、ボーンは使うものだけを残して番号を振り直す
+Mesh extractMeshSection(const Mesh& src, const std::vector<u_int>& triangles) {
+  const u_int none = std::numeric_limits<u_int>::max();
+
+  const auto& body         = src.body;
+  const auto& indices      = body.getIndices();
+  const auto& bone_indices = body.getBoneIndices();
+  const auto& bone_weights = body.getBoneWeights();
+
+  // 元の頂点番号 -> 新しい頂点番号
+  std::vector<u_int> vertex_remap(body.getNumVertices(), none);
+  std::vector<u_int> vertices;
+  std::vector<uint32_t> section_indices;
+  for (auto t : triangles) {
+    for (u_int k = 0; k < 3; ++k) {
+      auto v = indices[t * 3 + k];
+      if (vertex_remap[v] == none) {
+        vertex_remap[v] = u_int(vertices.size());
+        vertices.push_back(v);
+      }
+      section_indices.push_back(vertex_remap[v]);
+    }
+  }
+
+  // 元のボーン番号 -> 新しいボーン番号
+  std::vector<u_int> bone_remap(src.bones.size(), none);
+  std::vector<u_int> bones;
+  for (auto v : vertices) {
+    for (int h = 0; h < 4; ++h) {
+      if (bone_weights[v][h] <= 0.0f) continue;
+
+      u_int b = u_int(bone_indices[v][h]);
+      if (bone_remap[b] == none) {
+        bone_remap[b] = u_int(bones.size());
+        bones.push_back(b);
+      }
+    }
+  }
+
+  Mesh mesh;
+  mesh.material_index   = src.material_index;
+  mesh.has_vertex_color = src.has_vertex_color;
+  mesh.has_bone         = true;
+
+  const auto& positions = body.getPositions();
+  const auto& normals   = body.getNormals();
+  const auto& uvs       = body.getTexCoords();
+  const auto& colors    = body.getColors();
+
+  std::vector<ci::vec3> section_positions;
+  std::vector<ci::vec3> section_normals;
+  std::vector<ci::vec2> section_uvs;
+  std::vector<ci::ColorA> section_colors;
+  std::vector<index_t> section_bone_indices;
+  std::vector<ci::vec4> section_bone_weights;
+  for (auto v : vertices) {
+    section_positions.push_back(positions[v]);
+    if (!normals.empty()) section_normals.push_back(normals[v]);
+    if (!uvs.empty())     section_uvs.push_back(uvs[v]);
+    if (!colors.empty())  section_colors.push_back(colors[v]);
+
+    index_t bone_index = bone_indices[v];
+    for (int h = 0; h < 4; ++h) {
+      bone_index[h] = (bone_weights[v][h] > 0.0f) ? bone_remap[u_int(bone_index[h])] : 0;
+    }
+    section_bone_indices.push_back(bone_index);
+    section_bone_weights.push_back(bone_weights[v]);
+
+    mesh.bone_influences = std::max(countBoneInfluences(bone_weights[v]), mesh.bone_influences);
+  }
+
+  mesh.aabb = createAABB(section_positions);
+
+  for (auto b : bones) {
+    const auto& src_bone = src.bones[b];
+
+    Bone bone;
+    bone.name   = src_bone.name;
+    bone.offset = src_bone.offset;
+
+    std::vector<ci::vec3> influenced;
+    for (const auto& weight : src_bone.weights) {
+      if ((weight.value <= 0.0f) || (vertex_remap[weight.vertex_id] == none)) continue;
+
+      bone.weights.push_back({ vertex_remap[weight.vertex_id], weight.value });
+      bone.influence += weight.value;
+      influenced.push_back(positions[weight.vertex_id]);
+    }
+    if (!influenced.empty()) {
+      bone.has_aabb = true;
+      bone.aabb     = createAABB(influenced);
+    }
+
+    mesh.bones.push_back(std::move(bone));
+  }
+
+  mesh.body.setPositions(std::move(section_positions));
+  mesh.body.setNormals(std::move(section_normals));
+  mesh.body.setTexCoords(std::move(section_uvs));
+  mesh.body.setColors(std::move(section_colors));
+  mesh.body.setIndices(std::move(section_indices));
+  mesh.body.setBoneIndices(std::move(section_bone_indices));
+  mesh.body.setBoneWeights(std::move(section_bone_weights));
+
+  return mesh;
+}
+
+
+// スキニングするメッシュを分ける
+//   GLは使わないので別スレッドから呼んでも良い
+//   ボーンの名前からノードを探すので、createNodeInfoの後に呼ぶ
+void partitionSkinnedMeshes(const std::vector<std::shared_ptr<Node>>& node_list,
+                            const std::map<std::string, std::shared_ptr<Node>>& node_index,
+                            std::vector<Mesh>& meshes) {
+  std::vector<bool> used(meshes.size(), false);
+  for (const auto& node : node_list) {
+    for (const auto& ref : node->mesh) {
+      used[ref.index] = true;
+    }
+  }
+
+  // 分けたメッシュの番号 -> 置き換えるスキニングするメッシュの番号
+  std::map<u_int, std::vector<u_int>> replaced;
+
+  size_t rigid_num = 0;
+  size_t bucket_nums[SKIN_BUCKET_NUM] = {};
+
+  const size_t mesh_num = meshes.size();
+  for (u_int i = 0; i < mesh_num; ++i) {
+    if (!used[i] || !meshes[i].has_bone) continue;
+
+    // meshesに追加すると参照が無効になるので、分け方を決めてから追加する
+    std::vector<Mesh> sections;
+    std::vector<std::pair<StaticMeshArrays, std::shared_ptr<Node>>> rigid_sections;
+    {
+      const auto& mesh         = meshes[i];
+      const auto& indices      = mesh.body.getIndices();
+      const auto& bone_indices = mesh.body.getBoneIndices();
+      const auto& bone_weights = mesh.body.getBoneWeights();
+
+      // ひとつのボーンだけに従う頂点ならそのボーン
+      const u_int none = std::numeric_limits<u_int>::max();
+      std::vector<u_int> rigid_bones(mesh.body.getNumVertices(), none);
+      std::vector<u_int> influences(mesh.body.getNumVertices());
+      for (size_t v = 0; v < influences.size(); ++v) {
+        influences[v] = countBoneInfluences(bone_weights[v]);
+        // ウェイトが1でなければスキニングと結果が変わる
+        if ((influences[v] == 1) && (bone_weights[v].x > 0.999f)) rigid_bones[v] = u_int(bone_indices[v].x);
+      }
+
+      std::map<u_int, std::vector<u_int>> rigid;
+      std::vector<u_int> buckets[SKIN_BUCKET_NUM];
+      for (u_int t = 0; t < indices.size() / 3; ++t) {
+        auto v0 = indices[t * 3 + 0];
+        auto v1 = indices[t * 3 + 1];
+        auto v2 = indices[t * 3 + 2];
+
+        if ((rigid_bones[v0] != none) && (rigid_bones[v0] == rigid_bones[v1]) && (rigid_bones[v0] == rigid_bones[v2])) {
+          rigid[rigid_bones[v0]].push_back(t);
+          continue;
+        }
+
+        u_int num = std::max(std::max(influences[v0], influences[v1]), influences[v2]);
+        buckets[getInfluenceBucket(num)].push_back(t);
+      }
+
+      for (const auto& r : rigid) {
+        if (r.second.size() < SKIN_RIGID_MIN_TRIANGLES) {
+          appendArray(buckets[0], r.second);
+          continue;
+        }
+
+        // ボーンのオフセットでボーンのノードの座標系へ移す
+        const auto& bone = mesh.bones[r.first];
+        StaticMeshArrays arrays;
+        appendStaticMesh(arrays, extractMeshSection(mesh, r.second), bone.offset);
+        rigid_sections.push_back(std::make_pair(std::move(arrays), node_index.at(bone.name)));
+      }
+
+      size_t bucket_used = 0;
+      for (const auto& b : buckets) {
+        if (!b.empty()) bucket_used += 1;
+      }
+      // ひとつにしかならなければ分けない
+      if (rigid_sections.empty() && (bucket_used <= 1)) continue;
+
+      for (u_int k = 0; k < SKIN_BUCKET_NUM; ++k) {
+        if (buckets[k].empty()) continue;
+        sections.push_back(extractMeshSection(mesh, buckets[k]));
+        bucket_nums[k] += 1;
+      }
+    }
+
+    // 動かないメッシュと同じように描画する
+    Mesh info;
+    info.material_index   = meshes[i].material_index;
+    info.has_vertex_color = meshes[i].has_vertex_color;
+    for (auto& r : rigid_sections) {
+      addStaticMesh(r.first, info, r.second, meshes);
+      rigid_num += 1;
+    }
+
+    auto& indices = replaced[i];
+    for (auto& section : sections) {
+      indices.push_back(u_int(meshes.size()));
+      meshes.push_back(std::move(section));
+    }
+  }
+  if (replaced.empty()) return;
+
+  // 元のメッシュの参照を分けたメッシュに置き換える
+  for (const auto& node : node_list) {
+    std::vector<MeshRef> refs;
+    for (auto& ref : node->mesh) {
+      auto it = replaced.find(ref.index);
+      if (it == replaced.end()) {
+        refs.push_back(std::move(ref));
+        continue;
+      }
+
+      for (auto index : it->second) {
+        refs.push_back({ index, std::vector<ci::mat4>(meshes[index].bones.size()), 0 });
+      }
+    }
+    node->mesh = std::move(refs);
+  }
+
+  compactMeshes(node_list, meshes);
+
+  logInfo(LOG_IMPORT) << "Skinned meshes:" << replaced.size()
+                      << " -> rigid:" << rigid_num
+                      << " 1 bone:" << bucket_nums[0]
+                      << " 2 bones:" << bucket_nums[1]
+                      << " 4 bones:" << bucket_nums[2];
+}
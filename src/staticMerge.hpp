@@ -0,0 +1,206 @@
+﻿#pragma once
+
+//
+// 動かないメッシュをまとめる
+//   アニメーションの対象になっていないノードの下にあるボーン無しのメッシュは
+//   ノードの行列を頂点に適用して、マテリアルと頂点形式ごとにひとつのメッシュにまとめる
+//   まとめたメッシュはルートノードから参照する
+//   アニメーションするノードやスキニングするメッシュはそのまま
+//
+
+#include <map>
+#include <set>
+#include <algorithm>
+#include "mesh.hpp"
+#include "node.hpp"
+#include "animation.hpp"
+#include "frustum.hpp"
+#include "geometryArena.hpp"
+
+
+// まとめる候補
+struct StaticMeshSource {
+  u_int index;
+  // ルートノードの座標系への変換
+  ci::mat4 matrix;
+};
+
+
+// アニメーションの対象になっていないノードのメッシュを集める
+//   まとめるかどうか決まるまでノードからは外さない
+void collectStaticMeshes(const std::shared_ptr<Node>& node, const ci::mat4& matrix,
+                         const std::set<std::string>& animated_nodes,
+                         const std::vector<Mesh>& meshes,
+                         std::map<std::pair<u_int, u_int>, std::vector<StaticMeshSource>>& sources) {
+  if (animated_nodes.count(node->name)) return;
+
+  for (const auto& ref : node->mesh) {
+    const auto& mesh = meshes[ref.index];
+    if (mesh.has_bone) continue;
+
+    auto key = std::make_pair(mesh.material_index, getVertexFormat(mesh.body));
+    sources[key].push_back({ ref.index, matrix });
+  }
+
+  for (const auto& child : node->children) {
+    collectStaticMeshes(child, matrix * child->matrix, animated_nodes, meshes, sources);
+  }
+}
+
+// まとめている途中の頂点データ
+struct StaticMeshArrays {
+  std::vector<ci::vec3> positions;
+  std::vector<ci::vec3> normals;
+  std::vector<ci::vec2> uvs;
+  std::vector<ci::ColorA> colors;
+  std::vector<uint32_t> indices;
+};
+
+// 頂点に行列を適用して連結する
+void appendStaticMesh(StaticMeshArrays& dst, const Mesh& src, const ci::mat4& matrix) {
+  const auto& body = src.body;
+  uint32_t base_vertex = uint32_t(dst.positions.size());
+
+  for (const auto& p : body.getPositions()) {
+    dst.positions.push_back(ci::vec3(matrix * ci::vec4(p, 1.0f)));
+  }
+
+  auto normal_matrix = glm::transpose(glm::inverse(ci::mat3(matrix)));
+  for (const auto& n : body.getNormals()) {
+    dst.normals.push_back(glm::normalize(normal_matrix * n));
+  }
+
+  appendArray(dst.uvs,    body.getTexCoords());
+  appendArray(dst.colors, body.getColors());
+
+  // 裏返る行列なら三角形の向きも逆にする
+  bool flip = glm::determinant(ci::mat3(matrix)) < 0.0f;
+  const auto& indices = body.getIndices();
+  for (size_t i = 0; i + 2 < indices.size(); i += 3) {
+    dst.indices.push_back(indices[i] + base_vertex);
+    dst.indices.push_back(indices[i + (flip ? 2 : 1)] + base_vertex);
+    dst.indices.push_back(indices[i + (flip ? 1 : 2)] + base_vertex);
+  }
+}
+
+// まとめたメッシュを追加してnode(普通はルートノード)から参照する
+void addStaticMesh(StaticMeshArrays& arrays, const Mesh& src,
+                   const std::shared_ptr<Node>& node, std::vector<Mesh>& meshes) {
+  Mesh mesh;
+  mesh.material_index   = src.material_index;
+  mesh.has_vertex_color = src.has_vertex_color;
+  mesh.aabb             = createAABB(arrays.positions);
+
+  mesh.body.setPositions(std::move(arrays.positions));
+  mesh.body.setNormals(std::move(arrays.normals));
+  mesh.body.setTexCoords(std::move(arrays.uvs));
+  mesh.body.setColors(std::move(arrays.colors));
+  mesh.body.setIndices(std::move(arrays.indices));
+  arrays = StaticMeshArrays();
+
+  node->mesh.push_back({ u_int(meshes.size()), std::vector<ci::mat4>(), 0 });
+  meshes.push_back(std::move(mesh));
+}
+
+// ノードから参照されなくなったメッシュを詰める
+void compactMeshes(const std::vector<std::shared_ptr<Node>>& node_list, std::vector<Mesh>& meshes) {
+  std::vector<bool> used(meshes.size(), false);
+  for (const auto& node : node_list) {
+    for (const auto& ref : node->mesh) {
+      used[ref.index] = true;
+    }
+  }
+
+  std::vector<u_int> remap(meshes.size());
+  std::vector<Mesh> compacted;
+  for (size_t i = 0; i < meshes.size(); ++i) {
+    if (!used[i]) continue;
+    remap[i] = u_int(compacted.size());
+    compacted.push_back(std::move(meshes[i]));
+  }
+
+  for (const auto& node : node_list) {
+    for (auto& ref : node->mesh) {
+      ref.index = remap[ref.index];
+    }
+  }
+  meshes = std::move(compacted);
+}
+
+
+// 動かないメッシュをまとめる
+//   GLは使わないので別スレッドから呼んでも良い
+void mergeStaticMeshes(const std::shared_ptr<Node>& root,
+                       const std::vector<std::shared_ptr<Node>>& node_list,
+                       const std::vector<Anim>& animations,
+                       std::vector<Mesh>& meshes) {
+  std::set<std::string> animated_nodes;
+  for (const auto& anim : animations) {
+    for (const auto& body : anim.body) {
+      animated_nodes.insert(body.node_name);
+    }
+  }
+
+  // ルートノードの下でまとめるので、ルートの行列は含めない
+  std::map<std::pair<u_int, u_int>, std::vector<StaticMeshSource>> sources;
+  collectStaticMeshes(root, ci::mat4(), animated_nodes, meshes, sources);
+
+  // ひとつしか無い組み合わせはまとめても描画回数が減らない
+  std::set<u_int> merged_indices;
+  for (auto it = sources.begin(); it != sources.end(); ) {
+    if (it->second.size() < 2) {
+      it = sources.erase(it);
+      continue;
+    }
+    for (const auto& source : it->second) {
+      merged_indices.insert(source.index);
+    }
+    ++it;
+  }
+  if (sources.empty()) return;
+
+  // 元のノードからは外す(同じメッシュをアニメーションするノードが参照している場合は残す)
+  size_t removed_num = 0;
+  std::vector<std::shared_ptr<Node>> stack{ root };
+  while (!stack.empty()) {
+    auto node = stack.back();
+    stack.pop_back();
+    if (animated_nodes.count(node->name)) continue;
+
+    auto& refs = node->mesh;
+    auto end = std::remove_if(std::begin(refs), std::end(refs),
+                              [&](const MeshRef& ref) { return merged_indices.count(ref.index) > 0; });
+    removed_num += std::distance(end, std::end(refs));
+    refs.erase(end, std::end(refs));
+
+    stack.insert(std::end(stack), std::begin(node->children), std::end(node->children));
+  }
+
+  size_t merged_num = 0;
+  for (const auto& s : sources) {
+    // meshesに追加すると参照が無効になるので、元のメッシュの情報はコピーしておく
+    Mesh info;
+    info.material_index   = meshes[s.second.front().index].material_index;
+    info.has_vertex_color = meshes[s.second.front().index].has_vertex_color;
+
+    StaticMeshArrays arrays;
+    for (const auto& source : s.second) {
+      size_t vertex_num = meshes[source.index].body.getNumVertices();
+
+      // 16bitインデックスに収まらなければ分ける
+      if (!arrays.positions.empty()
+          && (arrays.positions.size() + vertex_num > getMaxGroupVertices())) {
+        addStaticMesh(arrays, info, root, meshes);
+        merged_num += 1;
+      }
+      appendStaticMesh(arrays, meshes[source.index], source.matrix);
+    }
+
+    addStaticMesh(arrays, info, root, meshes);
+    merged_num += 1;
+  }
+
+  compactMeshes(node_list, meshes);
+
+  logInfo(LOG_IMPORT) << "Static meshes:" << removed_num << " -> " << merged_num;
+}
@@ -6,15 +6,85 @@
 
 #include <map>
 #include <string>
+#include <mutex>
+#include <atomic>
 #include <cinder/ImageIo.h>
 #include <cinder/gl/Texture.h>
 #include <cinder/ip/Resize.h>
 #include "misc.hpp"
+#include "logger.hpp"
+#include "mappedFile.hpp"
 
+#if defined (USE_COMPRESSED_TEXTURE)
+#include <sstream>
+#include "ktx.hpp"
+#include "textureCompress.hpp"
+#endif
 
-// テクスチャを読み込む
-ci::gl::Texture2dRef loadTexrture(const std::string& path) {
-  ci::app::console() << "Texture read:" << path << std::endl;
+
+// OpenGL ES 2.0は２のべき乗以外のサイズでミップマップやリピートが使えない
+//   GL3.x以降やES3.0はそのまま扱える
+#if defined (CINDER_GL_ES_2)
+#define TEXTURE_POW2_ONLY
+#endif
+
+
+// GPUが扱えるテクスチャの最大サイズ
+//   GLの初期化後にsetupTextureLimit()で設定する
+std::atomic<int> texture_max_size(2048);
+
+void setupTextureLimit() {
+  GLint size = 0;
+  glGetIntegerv(GL_MAX_TEXTURE_SIZE, &size);
+  if (size > 0) texture_max_size = size;
+}
+
+
+// 読み込んだテクスチャ画像
+struct TextureImage {
+  std::string path;
+  uint64_t hash;
+
+  ci::Surface surface;
+  // 圧縮済みのテクスチャ(空ならsurfaceを使う)
+  std::string ktx_path;
+  // 同じ内容のテクスチャが転送済みならそちらを使う
+  ci::gl::Texture2dRef texture;
+};
+
+// 読み込んだテクスチャのキャッシュ
+//   パスとファイル内容のハッシュ値で識別し、モデル間や読み直しで共有する
+//   GPUへ転送したらテクスチャへの弱参照だけを残す
+struct TextureCacheEntry {
+  uint64_t hash;
+
+  ci::Surface surface;
+  std::string ktx_path;
+  std::weak_ptr<ci::gl::Texture2d> texture;
+};
+
+struct TextureCache {
+  std::mutex mutex;
+  std::map<std::string, TextureCacheEntry> entries;
+};
+
+TextureCache& getTextureCache() {
+  static TextureCache cache;
+  return cache;
+}
+
+// キャッシュを破棄
+void clearTextureCache() {
+  auto& cache = getTextureCache();
+  std::lock_guard<std::mutex> lock(cache.mutex);
+  cache.entries.clear();
+}
+
+
+// テクスチャ画像を読み込む
+//   GLは使わないので別スレッドから呼んでも良い
+ci::Surface decodeTexture(const std::string& path) {
+  logDebug(LOG_TEXTURE) << "Texture read:" << path;
 
 #if defined (USE_FULL_PATH)
   ci::Surface surface = ci::loadImage(path);
@@ -22,20 +92,168 @@ ci::gl::Texture2dRef loadTexrture(const std::string& path) {
   ci::Surface surface = ci::loadImage(ci::app::loadAsset(path));
 #endif
 
-  // サイズが２のべき乗でなければ変換
   int w = surface.getWidth();
   int h = surface.getHeight();
-  int pow_w = int2pow(w);
-  int pow_h = int2pow(h);
+  int new_w = w;
+  int new_h = h;
 
-  // 大きなサイズのテクスチャは禁止
-  assert((pow_w <= 2048) && (pow_h <= 2048));
+  // GPUで扱えない大きさなら縮小
+  int max_size = texture_max_size;
+  if (std::max(w, h) > max_size) {
+    float scale = float(max_size) / float(std::max(w, h));
+    new_w = std::max(int(w * scale), 1);
+    new_h = std::max(int(h * scale), 1);
+  }
 
-  if ((w != pow_w) || (h != pow_h)) {
+#if defined (TEXTURE_POW2_ONLY)
+  // サイズが２のべき乗でなければ変換
+  new_w = std::min(int2pow(new_w), max_size);
+  new_h = std::min(int2pow(new_h), max_size);
+#endif
+
+  if ((w != new_w) || (h != new_h)) {
     // リサイズ
-    surface = ci::ip::resizeCopy(surface, ci::Area{0, 0, w - 1, h - 1}, ci::ivec2{pow_w, pow_h});
-    ci::app::console() << "Texture resize: " << w << "," << h << " -> " << pow_w << "," << pow_h << std::endl;
+    surface = ci::ip::resizeCopy(surface, surface.getBounds(), ci::ivec2{new_w, new_h});
+    logInfo(LOG_TEXTURE) << "Texture resize: " << w << "," << h << " -> " << new_w << "," << new_h;
   }
 
-  return ci::gl::Texture2d::create(surface);
+  return surface;
+}
+
+// ファイル内容のハッシュ値
+uint64_t getFileHash(const std::string& path) {
+  MappedFile file(path);
+  return getHash(file.data(), file.size());
+}
+
+#if defined (USE_COMPRESSED_TEXTURE)
+
+// 圧縮済みテクスチャのパス
+std::string getKtxPath(const std::string& path) {
+  return path + ".ktx";
+}
+
+// 元画像の識別用の値(最大サイズが変わったら作り直す)
+std::string getKtxHashValue(const uint64_t hash) {
+  int max_size = texture_max_size;
+  std::ostringstream value;
+  value << std::hex << getHash(&max_size, sizeof(max_size), hash);
+  return value.str();
+}
+
+const char* ktx_hash_key = "SkeletalCinder.hash";
+
+// 圧縮済みテクスチャが使えるか調べる
+bool isValidKtx(const std::string& ktx_path, const uint64_t hash) {
+  MappedFile file(ktx_path);
+  if (!file.isOpen()) return false;
+
+  KtxImage image;
+  if (!readKtx(static_cast<const uint8_t*>(file.data()), file.size(), image, true)) return false;
+
+  return findKtxValue(image, ktx_hash_key) == getKtxHashValue(hash);
+}
+
+// 画像を圧縮して書き出す
+bool writeCompressedTexture(const std::string& ktx_path, const ci::Surface& surface, const uint64_t hash) {
+  auto image = cookTexture(surface);
+  image.key_values.push_back(std::make_pair(std::string(ktx_hash_key), getKtxHashValue(hash)));
+
+  if (!writeKtx(ktx_path, image)) {
+    logWarning(LOG_TEXTURE) << "Texture cook failed:" << ktx_path;
+    return false;
+  }
+
+  logDebug(LOG_TEXTURE) << "Texture cooked:" << ktx_path;
+  return true;
+}
+
+#endif
+
+// キャッシュを使ってテクスチャ画像を読み込む
+//   別スレッドから呼んでも良い
+TextureImage readTextureImage(const std::string& path) {
+  TextureImage image;
+  image.path = path;
+#if defined (USE_FULL_PATH)
+  std::string file_path = path;
+#else
+  std::string file_path = ci::app::getAssetPath(path).string();
+#endif
+  image.hash = getFileHash(file_path);
+
+  auto& cache = getTextureCache();
+  {
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    auto it = cache.entries.find(path);
+    if ((it != cache.entries.end()) && (it->second.hash == image.hash)) {
+      image.texture = it->second.texture.lock();
+      if (image.texture || it->second.surface || !it->second.ktx_path.empty()) {
+        image.surface  = it->second.surface;
+        image.ktx_path = it->second.ktx_path;
+        logDebug(LOG_TEXTURE) << "Texture cached:" << path;
+        return image;
+      }
+    }
+  }
+
+#if defined (USE_COMPRESSED_TEXTURE)
+  // 圧縮済みのものがあれば画像の展開は不要
+  auto ktx_path = getKtxPath(file_path);
+  if (isValidKtx(ktx_path, image.hash)) {
+    logDebug(LOG_TEXTURE) << "Texture compressed:" << ktx_path;
+    image.ktx_path = ktx_path;
+  }
+  else {
+    image.surface = decodeTexture(path);
+    if (writeCompressedTexture(ktx_path, image.surface, image.hash)) {
+      image.surface  = ci::Surface();
+      image.ktx_path = ktx_path;
+    }
+  }
+#else
+  image.surface = decodeTexture(path);
+#endif
+
+  {
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    cache.entries[path] = TextureCacheEntry{ image.hash, image.surface, image.ktx_path, std::weak_ptr<ci::gl::Texture2d>() };
+  }
+
+  return image;
+}
+
+// テクスチャ画像をGPUへ転送
+//   転送済みならそれを使う
+ci::gl::Texture2dRef createTexture(const TextureImage& image) {
+  if (image.texture) return image.texture;
+
+  ci::gl::Texture2dRef texture;
+  if (!image.ktx_path.empty()) {
+    // ミップマップは作成済み
+    texture = ci::gl::Texture2d::createFromKtx(ci::loadFile(image.ktx_path),
+                                               ci::gl::Texture2d::Format().minFilter(GL_LINEAR_MIPMAP_LINEAR).magFilter(GL_LINEAR));
+  }
+  else {
+    texture = ci::gl::Texture2d::create(image.surface);
+  }
+
+  auto& cache = getTextureCache();
+  {
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    auto it = cache.entries.find(image.path);
+    if ((it != cache.entries.end()) && (it->second.hash == image.hash)) {
+      // 画像はもう要らない
+      it->second.surface = ci::Surface();
+      it->second.texture = texture;
+    }
+  }
+
+  return texture;
+}
+
+
+// テクスチャを読み込む
+ci::gl::Texture2dRef loadTexrture(const std::string& path) {
+  return createTexture(readTextureImage(path));
 }
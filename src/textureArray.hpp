@@ -0,0 +1,221 @@
+﻿#pragma once
+
+//
+// テクスチャ配列
+//   大きさと形式が同じテクスチャをGL_TEXTURE_2D_ARRAYの各レイヤーにまとめる
+//   マテリアルはレイヤー番号で参照し、ラップの指定はサンプラーで切り替える
+//   違うマテリアルでもテクスチャを束縛し直さずに描画できる
+//
+
+#include <map>
+#include <vector>
+#include <string>
+#include "ktx.hpp"
+#include "textureCompress.hpp"
+#include "mappedFile.hpp"
+#include "texture.hpp"
+
+
+enum {
+  // 1つの配列のレイヤー数の上限(GL3.0、ES3.0で保証されている数)
+  TEXTURE_ARRAY_MAX_LAYERS = 256,
+
+  // 非圧縮のテクスチャの形式
+  TEXTURE_UNCOMPRESSED_RGBA8 = GL_RGBA8,
+};
+
+
+// 1レイヤー分の画像(ミップマップ込み)
+struct TextureLayerImage {
+  uint32_t internal_format;
+  uint32_t width;
+  uint32_t height;
+  std::vector<std::vector<uint8_t> > levels;
+};
+
+// GPUへ転送する前のテクスチャ配列
+struct TextureArrayImage {
+  uint32_t internal_format;
+  uint32_t width;
+  uint32_t height;
+
+  // レイヤーの並び
+  std::vector<std::string> names;
+  std::vector<TextureLayerImage> layers;
+};
+
+// GPU上のテクスチャ配列
+//   コピーすると二重に破棄するのでshared_ptrで持つ
+struct TextureArray {
+  TextureArray()
+    : id(0),
+      internal_format(0),
+      width(0),
+      height(0),
+      level_num(0),
+      layer_num(0)
+  {}
+
+  ~TextureArray() {
+    if (id) glDeleteTextures(1, &id);
+  }
+
+  TextureArray(const TextureArray&) = delete;
+  TextureArray& operator=(const TextureArray&) = delete;
+
+  GLuint id;
+  uint32_t internal_format;
+  int width;
+  int height;
+  int level_num;
+  int layer_num;
+};
+
+using TextureArrayRef = std::shared_ptr<TextureArray>;
+
+
+// ラップの組み合わせごとのサンプラー
+struct SamplerTable {
+  SamplerTable() = default;
+
+  ~SamplerTable() {
+    for (const auto& sampler : samplers) {
+      glDeleteSamplers(1, &sampler.second);
+    }
+  }
+
+  SamplerTable(const SamplerTable&) = delete;
+  SamplerTable& operator=(const SamplerTable&) = delete;
+
+  std::map<std::pair<GLenum, GLenum>, GLuint> samplers;
+};
+
+
+// 読み込んだ画像からレイヤーの画像を作る
+//   GLは使わないので別スレッドから呼んでも良い
+bool createLayerImage(const TextureImage& image, TextureLayerImage& layer) {
+  if (!image.ktx_path.empty()) {
+    MappedFile file(image.ktx_path);
+    KtxImage ktx;
+    if (!file.isOpen() || !readKtx(static_cast<const uint8_t*>(file.data()), file.size(), ktx)) return false;
+
+    layer.internal_format = ktx.gl_internal_format;
+    layer.width           = ktx.width;
+    layer.height          = ktx.height;
+    layer.levels          = std::move(ktx.levels);
+    return !layer.levels.empty();
+  }
+
+  if (!image.surface) return false;
+
+  // 上下はSurfaceから作ったテクスチャと同じ向き
+  auto rgba = createRgbaImage(image.surface, true);
+  layer.internal_format = TEXTURE_UNCOMPRESSED_RGBA8;
+  layer.width           = rgba.width;
+  layer.height          = rgba.height;
+  for (auto& level : createMipChain(rgba)) {
+    layer.levels.push_back(std::move(level.pixels));
+  }
+  return true;
+}
+
+// 大きさ、形式、ミップマップの段数が同じレイヤーをまとめる
+//   layer_indexにはnamesと同じ並びで(配列の番号, レイヤー番号)を返す
+std::vector<TextureArrayImage> packTextureLayers(const std::vector<std::string>& names,
+                                                 std::vector<TextureLayerImage>& layers,
+                                                 std::vector<std::pair<u_int, u_int> >& layer_index) {
+  std::vector<TextureArrayImage> arrays;
+  layer_index.resize(names.size());
+
+  for (size_t i = 0; i < names.size(); ++i) {
+    auto& layer = layers[i];
+
+    size_t index = 0;
+    for (; index < arrays.size(); ++index) {
+      const auto& a = arrays[index];
+      if ((a.internal_format == layer.internal_format)
+          && (a.width == layer.width) && (a.height == layer.height)
+          && (a.layers.front().levels.size() == layer.levels.size())
+          && (a.layers.size() < TEXTURE_ARRAY_MAX_LAYERS)) break;
+    }
+    if (index == arrays.size()) {
+      arrays.push_back(TextureArrayImage{ layer.internal_format, layer.width, layer.height,
+                                          std::vector<std::string>(), std::vector<TextureLayerImage>() });
+    }
+
+    auto& a = arrays[index];
+    layer_index[i] = std::make_pair(u_int(index), u_int(a.layers.size()));
+    a.names.push_back(names[i]);
+    a.layers.push_back(std::move(layer));
+  }
+
+  return arrays;
+}
+
+
+bool isCompressedFormat(const uint32_t internal_format) {
+  return internal_format != TEXTURE_UNCOMPRESSED_RGBA8;
+}
+
+// テクスチャ配列をGPUへ転送
+TextureArrayRef createTextureArray(const TextureArrayImage& image) {
+  auto texture = std::make_shared<TextureArray>();
+  texture->internal_format = image.internal_format;
+  texture->width           = int(image.width);
+  texture->height          = int(image.height);
+  texture->level_num       = int(image.layers.front().levels.size());
+  texture->layer_num       = int(image.layers.size());
+
+  glGenTextures(1, &texture->id);
+  ci::gl::ScopedTextureBind bind(GL_TEXTURE_2D_ARRAY, texture->id);
+
+  GLsizei width  = texture->width;
+  GLsizei height = texture->height;
+  for (int level = 0; level < texture->level_num; ++level) {
+    // 全レイヤー分の領域を確保してから、レイヤーごとに書き込む
+    if (isCompressedFormat(image.internal_format)) {
+      GLsizei level_size = GLsizei(image.layers.front().levels[level].size());
+      glCompressedTexImage3D(GL_TEXTURE_2D_ARRAY, level, image.internal_format, width, height, texture->layer_num,
+                             0, level_size * texture->layer_num, nullptr);
+      for (int i = 0; i < texture->layer_num; ++i) {
+        const auto& data = image.layers[i].levels[level];
+        glCompressedTexSubImage3D(GL_TEXTURE_2D_ARRAY, level, 0, 0, i, width, height, 1,
+                                  image.internal_format, GLsizei(data.size()), data.data());
+      }
+    }
+    else {
+      glTexImage3D(GL_TEXTURE_2D_ARRAY, level, image.internal_format, width, height, texture->layer_num,
+                   0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+      for (int i = 0; i < texture->layer_num; ++i) {
+        glTexSubImage3D(GL_TEXTURE_2D_ARRAY, level, 0, 0, i, width, height, 1,
+                        GL_RGBA, GL_UNSIGNED_BYTE, image.layers[i].levels[level].data());
+      }
+    }
+
+    width  = std::max(width / 2, 1);
+    height = std::max(height / 2, 1);
+  }
+
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, texture->level_num - 1);
+
+  return texture;
+}
+
+
+// ラップの組み合わせに対応するサンプラー
+//   無ければ作る
+GLuint getSampler(SamplerTable& table, const GLenum wrap_s, const GLenum wrap_t) {
+  auto key = std::make_pair(wrap_s, wrap_t);
+  auto it = table.samplers.find(key);
+  if (it != table.samplers.end()) return it->second;
+
+  GLuint sampler = 0;
+  glGenSamplers(1, &sampler);
+  glSamplerParameteri(sampler, GL_TEXTURE_WRAP_S, wrap_s);
+  glSamplerParameteri(sampler, GL_TEXTURE_WRAP_T, wrap_t);
+  glSamplerParameteri(sampler, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+  glSamplerParameteri(sampler, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+  table.samplers.insert(std::make_pair(key, sampler));
+  return sampler;
+}
@@ -0,0 +1,764 @@
+﻿#pragma once
+
+//
+// テクスチャの圧縮
+//   デスクトップはBC1/BC3(DXT1/DXT5)、OpenGL ES3.0はETC2を使う
+//   ミップマップも作ってKTX形式で書き出す
+//   確認用に展開処理も用意してある(bench/textureCheck.hppで使う)
+//
+
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <algorithm>
+#include <limits>
+#include <cmath>
+#include <cinder/Surface.h>
+#include "ktx.hpp"
+#include "parallel.hpp"
+
+
+// 圧縮形式(GLのヘッダに無い場合もあるので自前で定義)
+enum : uint32_t {
+  TEXTURE_COMPRESSED_RGB_BC1        = 0x83F0,   // GL_COMPRESSED_RGB_S3TC_DXT1_EXT
+  TEXTURE_COMPRESSED_RGBA_BC3       = 0x83F3,   // GL_COMPRESSED_RGBA_S3TC_DXT5_EXT
+  TEXTURE_COMPRESSED_RGB8_ETC2      = 0x9274,   // GL_COMPRESSED_RGB8_ETC2
+  TEXTURE_COMPRESSED_RGBA8_ETC2_EAC = 0x9278,   // GL_COMPRESSED_RGBA8_ETC2_EAC
+
+  TEXTURE_BASE_RGB  = 0x1907,                   // GL_RGB
+  TEXTURE_BASE_RGBA = 0x1908,                   // GL_RGBA
+};
+
+
+// RGBA各8bitの画像
+struct RgbaImage {
+  int width;
+  int height;
+  std::vector<uint8_t> pixels;
+};
+
+// 4x4ピクセルのブロック
+//   ピクセルの並びは横方向が先
+using PixelBlock = uint8_t[16][4];
+
+
+// Surface -> RgbaImage
+//   flipがtrueなら上下を反転(GLのテクスチャは左下が原点)
+RgbaImage createRgbaImage(const ci::Surface& surface, const bool flip) {
+  RgbaImage image;
+  image.width  = surface.getWidth();
+  image.height = surface.getHeight();
+  image.pixels.resize(image.width * image.height * 4);
+
+  const uint8_t* data = surface.getData();
+  size_t row_bytes = surface.getRowBytes();
+  size_t inc = surface.getPixelInc();
+  size_t r = surface.getRedOffset();
+  size_t g = surface.getGreenOffset();
+  size_t b = surface.getBlueOffset();
+  bool has_alpha = surface.hasAlpha();
+  size_t a = has_alpha ? size_t(surface.getAlphaOffset()) : 0;
+
+  for (int y = 0; y < image.height; ++y) {
+    const uint8_t* src = data + row_bytes * (flip ? image.height - 1 - y : y);
+    uint8_t* dst = &image.pixels[y * image.width * 4];
+    for (int x = 0; x < image.width; ++x) {
+      dst[0] = src[r];
+      dst[1] = src[g];
+      dst[2] = src[b];
+      dst[3] = has_alpha ? src[a] : 255;
+
+      src += inc;
+      dst += 4;
+    }
+  }
+
+  return image;
+}
+
+// 透明なピクセルを含むか
+bool hasTransparentPixel(const RgbaImage& image) {
+  for (size_t i = 3; i < image.pixels.size(); i += 4) {
+    if (image.pixels[i] != 255) return true;
+  }
+  return false;
+}
+
+// 縦横半分の画像を作る(2x2の平均)
+RgbaImage createHalfImage(const RgbaImage& image) {
+  RgbaImage half;
+  half.width  = std::max(image.width / 2, 1);
+  half.height = std::max(image.height / 2, 1);
+  half.pixels.resize(half.width * half.height * 4);
+
+  for (int y = 0; y < half.height; ++y) {
+    int y0 = std::min(y * 2, image.height - 1);
+    int y1 = std::min(y * 2 + 1, image.height - 1);
+    for (int x = 0; x < half.width; ++x) {
+      int x0 = std::min(x * 2, image.width - 1);
+      int x1 = std::min(x * 2 + 1, image.width - 1);
+      for (int c = 0; c < 4; ++c) {
+        int sum = image.pixels[(y0 * image.width + x0) * 4 + c]
+                + image.pixels[(y0 * image.width + x1) * 4 + c]
+                + image.pixels[(y1 * image.width + x0) * 4 + c]
+                + image.pixels[(y1 * image.width + x1) * 4 + c];
+        half.pixels[(y * half.width + x) * 4 + c] = uint8_t((sum + 2) / 4);
+      }
+    }
+  }
+
+  return half;
+}
+
+// 1x1までのミップマップを作る
+std::vector<RgbaImage> createMipChain(const RgbaImage& image) {
+  std::vector<RgbaImage> chain{ image };
+  while ((chain.back().width > 1) || (chain.back().height > 1)) {
+    chain.push_back(createHalfImage(chain.back()));
+  }
+  return chain;
+}
+
+
+// 画像からブロックを取り出す
+//   はみ出した部分は端のピクセルで埋める
+void fetchBlock(const RgbaImage& image, const int bx, const int by, PixelBlock& block) {
+  for (int y = 0; y < 4; ++y) {
+    int py = std::min(by * 4 + y, image.height - 1);
+    for (int x = 0; x < 4; ++x) {
+      int px = std::min(bx * 4 + x, image.width - 1);
+      const uint8_t* src = &image.pixels[(py * image.width + px) * 4];
+      std::copy(src, src + 4, block[y * 4 + x]);
+    }
+  }
+}
+
+// ブロックを画像へ書き戻す(展開処理用)
+void storeBlock(RgbaImage& image, const int bx, const int by, const PixelBlock& block) {
+  for (int y = 0; y < 4; ++y) {
+    int py = by * 4 + y;
+    if (py >= image.height) break;
+    for (int x = 0; x < 4; ++x) {
+      int px = bx * 4 + x;
+      if (px >= image.width) break;
+      std::copy(block[y * 4 + x], block[y * 4 + x] + 4, &image.pixels[(py * image.width + px) * 4]);
+    }
+  }
+}
+
+
+int clamp255(const int value) {
+  return std::min(std::max(value, 0), 255);
+}
+
+int squareError(const uint8_t* a, const int r, const int g, const int b) {
+  int dr = a[0] - r;
+  int dg = a[1] - g;
+  int db = a[2] - b;
+  return dr * dr + dg * dg + db * db;
+}
+
+
+//
+// BC1/BC3
+//
+
+uint16_t packRgb565(const float r, const float g, const float b) {
+  int r5 = clamp255(int(r + 0.5f)) * 31 / 255;
+  int g6 = clamp255(int(g + 0.5f)) * 63 / 255;
+  int b5 = clamp255(int(b + 0.5f)) * 31 / 255;
+  return uint16_t((r5 << 11) | (g6 << 5) | b5);
+}
+
+void unpackRgb565(const uint16_t c, int rgb[3]) {
+  int r5 = (c >> 11) & 31;
+  int g6 = (c >> 5) & 63;
+  int b5 = c & 31;
+  rgb[0] = (r5 << 3) | (r5 >> 2);
+  rgb[1] = (g6 << 2) | (g6 >> 4);
+  rgb[2] = (b5 << 3) | (b5 >> 2);
+}
+
+// BC1のカラー部分(8バイト)
+//   色の分布の主軸の両端を代表色にする
+void encodeBC1Color(const PixelBlock& block, uint8_t* out) {
+  float mean[3] = {};
+  for (const auto& p : block) {
+    for (int c = 0; c < 3; ++c) mean[c] += p[c];
+  }
+  for (auto& m : mean) m /= 16.0f;
+
+  float cov[6] = {};
+  for (const auto& p : block) {
+    float d[3] = { p[0] - mean[0], p[1] - mean[1], p[2] - mean[2] };
+    cov[0] += d[0] * d[0]; cov[1] += d[0] * d[1]; cov[2] += d[0] * d[2];
+    cov[3] += d[1] * d[1]; cov[4] += d[1] * d[2]; cov[5] += d[2] * d[2];
+  }
+
+  // べき乗法で主軸を求める
+  float axis[3] = { 1.0f, 1.0f, 1.0f };
+  for (int i = 0; i < 4; ++i) {
+    float v[3] = {
+      cov[0] * axis[0] + cov[1] * axis[1] + cov[2] * axis[2],
+      cov[1] * axis[0] + cov[3] * axis[1] + cov[4] * axis[2],
+      cov[2] * axis[0] + cov[4] * axis[1] + cov[5] * axis[2],
+    };
+    float len = std::max({ std::abs(v[0]), std::abs(v[1]), std::abs(v[2]) });
+    if (len < 1e-6f) break;
+    for (int c = 0; c < 3; ++c) axis[c] = v[c] / len;
+  }
+  float axis_len2 = axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2];
+
+  float min_t = std::numeric_limits<float>::max();
+  float max_t = -std::numeric_limits<float>::max();
+  for (const auto& p : block) {
+    float t = ((p[0] - mean[0]) * axis[0] + (p[1] - mean[1]) * axis[1] + (p[2] - mean[2]) * axis[2]) / axis_len2;
+    min_t = std::min(min_t, t);
+    max_t = std::max(max_t, t);
+  }
+
+  uint16_t c0 = packRgb565(mean[0] + axis[0] * max_t, mean[1] + axis[1] * max_t, mean[2] + axis[2] * max_t);
+  uint16_t c1 = packRgb565(mean[0] + axis[0] * min_t, mean[1] + axis[1] * min_t, mean[2] + axis[2] * min_t);
+  // c0 > c1 で４色モードになる
+  if (c0 < c1) std::swap(c0, c1);
+
+  uint32_t indices = 0;
+  if (c0 != c1) {
+    int p0[3], p1[3];
+    unpackRgb565(c0, p0);
+    unpackRgb565(c1, p1);
+
+    int palette[4][3];
+    for (int c = 0; c < 3; ++c) {
+      palette[0][c] = p0[c];
+      palette[1][c] = p1[c];
+      palette[2][c] = (2 * p0[c] + p1[c]) / 3;
+      palette[3][c] = (p0[c] + 2 * p1[c]) / 3;
+    }
+
+    for (int i = 0; i < 16; ++i) {
+      int best = 0;
+      int best_error = std::numeric_limits<int>::max();
+      for (int j = 0; j < 4; ++j) {
+        int error = squareError(block[i], palette[j][0], palette[j][1], palette[j][2]);
+        if (error < best_error) {
+          best_error = error;
+          best = j;
+        }
+      }
+      indices |= uint32_t(best) << (i * 2);
+    }
+  }
+
+  out[0] = uint8_t(c0);
+  out[1] = uint8_t(c0 >> 8);
+  out[2] = uint8_t(c1);
+  out[3] = uint8_t(c1 >> 8);
+  for (int i = 0; i < 4; ++i) out[4 + i] = uint8_t(indices >> (i * 8));
+}
+
+void decodeBC1Color(const uint8_t* in, PixelBlock& block, const bool bc1_alpha) {
+  uint16_t c0 = uint16_t(in[0] | (in[1] << 8));
+  uint16_t c1 = uint16_t(in[2] | (in[3] << 8));
+  uint32_t indices = in[4] | (in[5] << 8) | (in[6] << 16) | (uint32_t(in[7]) << 24);
+
+  int p0[3], p1[3];
+  unpackRgb565(c0, p0);
+  unpackRgb565(c1, p1);
+
+  int palette[4][4];
+  for (int c = 0; c < 3; ++c) {
+    palette[0][c] = p0[c];
+    palette[1][c] = p1[c];
+    if ((c0 > c1) || !bc1_alpha) {
+      palette[2][c] = (2 * p0[c] + p1[c]) / 3;
+      palette[3][c] = (p0[c] + 2 * p1[c]) / 3;
+    }
+    else {
+      palette[2][c] = (p0[c] + p1[c]) / 2;
+      palette[3][c] = 0;
+    }
+  }
+  palette[0][3] = palette[1][3] = palette[2][3] = 255;
+  palette[3][3] = ((c0 > c1) || !bc1_alpha) ? 255 : 0;
+
+  for (int i = 0; i < 16; ++i) {
+    const int* p = palette[(indices >> (i * 2)) & 3];
+    for (int c = 0; c < 4; ++c) block[i][c] = uint8_t(p[c]);
+  }
+}
+
+// BC3のアルファ部分(8バイト)
+void encodeBC3Alpha(const PixelBlock& block, uint8_t* out) {
+  int a0 = 0;
+  int a1 = 255;
+  for (const auto& p : block) {
+    a0 = std::max(a0, int(p[3]));
+    a1 = std::min(a1, int(p[3]));
+  }
+
+  // a0 > a1 で８段階モード
+  int palette[8] = { a0, a1 };
+  for (int i = 1; i < 7; ++i) {
+    palette[i + 1] = ((7 - i) * a0 + i * a1) / 7;
+  }
+
+  uint64_t indices = 0;
+  if (a0 != a1) {
+    for (int i = 0; i < 16; ++i) {
+      int best = 0;
+      int best_error = std::numeric_limits<int>::max();
+      for (int j = 0; j < 8; ++j) {
+        int error = std::abs(int(block[i][3]) - palette[j]);
+        if (error < best_error) {
+          best_error = error;
+          best = j;
+        }
+      }
+      indices |= uint64_t(best) << (i * 3);
+    }
+  }
+
+  out[0] = uint8_t(a0);
+  out[1] = uint8_t(a1);
+  for (int i = 0; i < 6; ++i) out[2 + i] = uint8_t(indices >> (i * 8));
+}
+
+void decodeBC3Alpha(const uint8_t* in, PixelBlock& block) {
+  int a0 = in[0];
+  int a1 = in[1];
+  uint64_t indices = 0;
+  for (int i = 0; i < 6; ++i) indices |= uint64_t(in[2 + i]) << (i * 8);
+
+  int palette[8] = { a0, a1 };
+  if (a0 > a1) {
+    for (int i = 1; i < 7; ++i) palette[i + 1] = ((7 - i) * a0 + i * a1) / 7;
+  }
+  else {
+    for (int i = 1; i < 5; ++i) palette[i + 1] = ((5 - i) * a0 + i * a1) / 5;
+    palette[6] = 0;
+    palette[7] = 255;
+  }
+
+  for (int i = 0; i < 16; ++i) {
+    block[i][3] = uint8_t(palette[(indices >> (i * 3)) & 7]);
+  }
+}
+
+
+//
+// ETC2
+//   カラーはETC1互換の個別モードと差分モードのみ使う
+//   (差分モードで範囲外にならないようにしているのでETC2として正しく展開される)
+//
+
+const int etc_modifier[8][2] = {
+  {  2,   8 }, {  5,  17 }, {  9,  29 }, { 13,  42 },
+  { 18,  60 }, { 24,  80 }, { 33, 106 }, { 47, 183 },
+};
+
+// インデックス値 -> 補正値
+int getEtcModifier(const int table, const int index) {
+  const int value[4] = {
+    etc_modifier[table][0],  etc_modifier[table][1],
+    -etc_modifier[table][0], -etc_modifier[table][1],
+  };
+  return value[index];
+}
+
+// ETCのピクセル番号は縦方向が先
+int etcPixel(const int x, const int y) {
+  return x * 4 + y;
+}
+
+bool isEtcSubblock(const bool flip, const int x, const int y, const int subblock) {
+  return (flip ? (y >= 2) : (x >= 2)) == (subblock == 1);
+}
+
+// サブブロックに最適な補正テーブルとインデックスを選ぶ
+int fitEtcSubblock(const PixelBlock& block, const bool flip, const int subblock,
+                   const int base[3], int& best_table, uint32_t& best_indices) {
+  int best_error = std::numeric_limits<int>::max();
+
+  for (int table = 0; table < 8; ++table) {
+    int error = 0;
+    uint32_t indices = 0;
+    for (int y = 0; y < 4; ++y) {
+      for (int x = 0; x < 4; ++x) {
+        if (!isEtcSubblock(flip, x, y, subblock)) continue;
+
+        const uint8_t* p = block[y * 4 + x];
+        int best = 0;
+        int best_pixel_error = std::numeric_limits<int>::max();
+        for (int i = 0; i < 4; ++i) {
+          int m = getEtcModifier(table, i);
+          int e = squareError(p, clamp255(base[0] + m), clamp255(base[1] + m), clamp255(base[2] + m));
+          if (e < best_pixel_error) {
+            best_pixel_error = e;
+            best = i;
+          }
+        }
+        error += best_pixel_error;
+
+        // 上位ビットは16ビット目から
+        int n = etcPixel(x, y);
+        indices |= uint32_t(best & 1) << n;
+        indices |= uint32_t(best >> 1) << (n + 16);
+      }
+    }
+
+    if (error < best_error) {
+      best_error   = error;
+      best_table   = table;
+      best_indices = indices;
+    }
+  }
+
+  return best_error;
+}
+
+int expand4(const int c) { return (c << 4) | c; }
+int expand5(const int c) { return (c << 3) | (c >> 2); }
+
+void writeBigEndian(uint8_t* out, const uint64_t value) {
+  for (int i = 0; i < 8; ++i) out[i] = uint8_t(value >> (56 - i * 8));
+}
+
+uint64_t readBigEndian(const uint8_t* in) {
+  uint64_t value = 0;
+  for (int i = 0; i < 8; ++i) value = (value << 8) | in[i];
+  return value;
+}
+
+// ETC2(RGB8)のカラー部分(8バイト)
+void encodeEtcColor(const PixelBlock& block, uint8_t* out) {
+  int best_error = std::numeric_limits<int>::max();
+  uint64_t best_code = 0;
+
+  for (int flip = 0; flip < 2; ++flip) {
+    // サブブロックの平均色
+    float average[2][3] = {};
+    for (int y = 0; y < 4; ++y) {
+      for (int x = 0; x < 4; ++x) {
+        int s = isEtcSubblock(flip != 0, x, y, 1) ? 1 : 0;
+        for (int c = 0; c < 3; ++c) average[s][c] += block[y * 4 + x][c] / 8.0f;
+      }
+    }
+
+    for (int diff = 0; diff < 2; ++diff) {
+      int q[2][3];
+      int base[2][3];
+      bool valid = true;
+      for (int s = 0; s < 2; ++s) {
+        for (int c = 0; c < 3; ++c) {
+          if (diff) {
+            q[s][c]    = std::min(int(average[s][c] * 31.0f / 255.0f + 0.5f), 31);
+            base[s][c] = expand5(q[s][c]);
+          }
+          else {
+            q[s][c]    = std::min(int(average[s][c] * 15.0f / 255.0f + 0.5f), 15);
+            base[s][c] = expand4(q[s][c]);
+          }
+        }
+      }
+      if (diff) {
+        for (int c = 0; c < 3; ++c) {
+          int d = q[1][c] - q[0][c];
+          if ((d < -4) || (d > 3)) valid = false;
+        }
+      }
+      if (!valid) continue;
+
+      int table[2];
+      uint32_t indices[2];
+      int error = fitEtcSubblock(block, flip != 0, 0, base[0], table[0], indices[0])
+                + fitEtcSubblock(block, flip != 0, 1, base[1], table[1], indices[1]);
+      if (error >= best_error) continue;
+
+      uint32_t high = 0;
+      if (diff) {
+        for (int c = 0; c < 3; ++c) {
+          high |= uint32_t(q[0][c]) << (27 - c * 8);
+          high |= uint32_t((q[1][c] - q[0][c]) & 7) << (24 - c * 8);
+        }
+      }
+      else {
+        for (int c = 0; c < 3; ++c) {
+          high |= uint32_t(q[0][c]) << (28 - c * 8);
+          high |= uint32_t(q[1][c]) << (24 - c * 8);
+        }
+      }
+      high |= uint32_t(table[0]) << 5;
+      high |= uint32_t(table[1]) << 2;
+      high |= uint32_t(diff) << 1;
+      high |= uint32_t(flip);
+
+      best_error = error;
+      best_code  = (uint64_t(high) << 32) | (indices[0] | indices[1]);
+    }
+  }
+
+  writeBigEndian(out, best_code);
+}
+
+void decodeEtcColor(const uint8_t* in, PixelBlock& block) {
+  uint64_t code = readBigEndian(in);
+  uint32_t high = uint32_t(code >> 32);
+  uint32_t low  = uint32_t(code);
+
+  bool diff = (high >> 1) & 1;
+  bool flip = high & 1;
+  int table[2] = { int((high >> 5) & 7), int((high >> 2) & 7) };
+
+  int base[2][3];
+  for (int c = 0; c < 3; ++c) {
+    if (diff) {
+      int q0 = (high >> (27 - c * 8)) & 31;
+      int d  = (high >> (24 - c * 8)) & 7;
+      if (d >= 4) d -= 8;
+      base[0][c] = expand5(q0);
+      base[1][c] = expand5(q0 + d);
+    }
+    else {
+      base[0][c] = expand4((high >> (28 - c * 8)) & 15);
+      base[1][c] = expand4((high >> (24 - c * 8)) & 15);
+    }
+  }
+
+  for (int y = 0; y < 4; ++y) {
+    for (int x = 0; x < 4; ++x) {
+      int s = isEtcSubblock(flip, x, y, 1) ? 1 : 0;
+      int n = etcPixel(x, y);
+      int index = ((low >> n) & 1) | (((low >> (n + 16)) & 1) << 1);
+      int m = getEtcModifier(table[s], index);
+      for (int c = 0; c < 3; ++c) block[y * 4 + x][c] = uint8_t(clamp255(base[s][c] + m));
+      block[y * 4 + x][3] = 255;
+    }
+  }
+}
+
+
+const int eac_modifier[16][8] = {
+  { -3, -6,  -9, -15, 2, 5, 8, 14 },
+  { -3, -7, -10, -13, 2, 6, 9, 12 },
+  { -2, -5,  -8, -13, 1, 4, 7, 12 },
+  { -2, -4,  -6, -13, 1, 3, 5, 12 },
+  { -3, -6,  -8, -12, 2, 5, 7, 11 },
+  { -3, -7,  -9, -11, 2, 6, 8, 10 },
+  { -4, -7,  -8, -11, 3, 6, 7, 10 },
+  { -3, -5,  -8, -11, 2, 4, 7, 10 },
+  { -2, -6,  -8, -10, 1, 5, 7,  9 },
+  { -2, -5,  -8, -10, 1, 4, 7,  9 },
+  { -2, -4,  -8, -10, 1, 3, 7,  9 },
+  { -2, -5,  -7, -10, 1, 4, 6,  9 },
+  { -3, -4,  -7, -10, 2, 3, 6,  9 },
+  { -1, -2,  -3, -10, 0, 1, 2,  9 },
+  { -4, -6,  -8,  -9, 3, 5, 7,  8 },
+  { -3, -5,  -7,  -9, 2, 4, 6,  8 },
+};
+
+// ETC2(EAC)のアルファ部分(8バイト)
+//   全テーブルについて、値の範囲に合う倍率と基準値の近辺を探す
+void encodeEacAlpha(const PixelBlock& block, uint8_t* out) {
+  int a_min = 255;
+  int a_max = 0;
+  for (const auto& p : block) {
+    a_min = std::min(a_min, int(p[3]));
+    a_max = std::max(a_max, int(p[3]));
+  }
+
+  int best_error = std::numeric_limits<int>::max();
+  uint64_t best_code = 0;
+
+  for (int table = 0; table < 16; ++table) {
+    const int* mod = eac_modifier[table];
+    int mod_min = *std::min_element(mod, mod + 8);
+    int mod_max = *std::max_element(mod, mod + 8);
+
+    int ideal = (a_max - a_min) / (mod_max - mod_min);
+    for (int multiplier = std::max(ideal, 1); multiplier <= std::min(ideal + 2, 15); ++multiplier) {
+      int center = int((a_max + a_min) * 0.5f - multiplier * (mod_max + mod_min) * 0.5f + 0.5f);
+      for (int base = clamp255(center - 1); base <= clamp255(center + 1); ++base) {
+        int error = 0;
+        uint64_t indices = 0;
+        for (int y = 0; y < 4; ++y) {
+          for (int x = 0; x < 4; ++x) {
+            int a = block[y * 4 + x][3];
+            int best = 0;
+            int best_pixel_error = std::numeric_limits<int>::max();
+            for (int i = 0; i < 8; ++i) {
+              int e = std::abs(clamp255(base + mod[i] * multiplier) - a);
+              if (e < best_pixel_error) {
+                best_pixel_error = e;
+                best = i;
+              }
+            }
+            error += best_pixel_error * best_pixel_error;
+            indices |= uint64_t(best) << (45 - etcPixel(x, y) * 3);
+          }
+        }
+
+        if (error < best_error) {
+          best_error = error;
+          best_code  = (uint64_t(base) << 56) | (uint64_t(multiplier) << 52) | (uint64_t(table) << 48) | indices;
+        }
+      }
+    }
+  }
+
+  writeBigEndian(out, best_code);
+}
+
+void decodeEacAlpha(const uint8_t* in, PixelBlock& block) {
+  uint64_t code = readBigEndian(in);
+  int base       = int(code >> 56);
+  int multiplier = int((code >> 52) & 15);
+  int table      = int((code >> 48) & 15);
+
+  for (int y = 0; y < 4; ++y) {
+    for (int x = 0; x < 4; ++x) {
+      int index = int((code >> (45 - etcPixel(x, y) * 3)) & 7);
+      block[y * 4 + x][3] = uint8_t(clamp255(base + eac_modifier[table][index] * multiplier));
+    }
+  }
+}
+
+
+//
+// 画像単位の圧縮・展開
+//
+
+size_t getCompressedBlockSize(const uint32_t format) {
+  switch (format) {
+  case TEXTURE_COMPRESSED_RGB_BC1:
+  case TEXTURE_COMPRESSED_RGB8_ETC2:
+    return 8;
+
+  default:
+    return 16;
+  }
+}
+
+size_t getCompressedImageSize(const uint32_t format, const int width, const int height) {
+  return size_t((width + 3) / 4) * size_t((height + 3) / 4) * getCompressedBlockSize(format);
+}
+
+// ブロック単位で圧縮
+//   ブロックの行ごとに並列に処理する
+std::vector<uint8_t> compressImage(const RgbaImage& image, const uint32_t format) {
+  int blocks_x = (image.width + 3) / 4;
+  int blocks_y = (image.height + 3) / 4;
+  size_t block_size = getCompressedBlockSize(format);
+
+  std::vector<uint8_t> data(blocks_x * blocks_y * block_size);
+  parallelFor(blocks_y, [&](size_t by) {
+      for (int bx = 0; bx < blocks_x; ++bx) {
+        PixelBlock block;
+        fetchBlock(image, bx, int(by), block);
+
+        uint8_t* out = &data[(by * blocks_x + bx) * block_size];
+        switch (format) {
+        case TEXTURE_COMPRESSED_RGB_BC1:
+          encodeBC1Color(block, out);
+          break;
+
+        case TEXTURE_COMPRESSED_RGBA_BC3:
+          encodeBC3Alpha(block, out);
+          encodeBC1Color(block, out + 8);
+          break;
+
+        case TEXTURE_COMPRESSED_RGB8_ETC2:
+          encodeEtcColor(block, out);
+          break;
+
+        case TEXTURE_COMPRESSED_RGBA8_ETC2_EAC:
+          encodeEacAlpha(block, out);
+          encodeEtcColor(block, out + 8);
+          break;
+        }
+      }
+    });
+
+  return data;
+}
+
+// 展開
+//   圧縮結果の確認用(bench/textureCheck.hpp)
+RgbaImage decompressImage(const std::vector<uint8_t>& data, const uint32_t format,
+                          const int width, const int height) {
+  RgbaImage image;
+  image.width  = width;
+  image.height = height;
+  image.pixels.resize(width * height * 4);
+
+  int blocks_x = (width + 3) / 4;
+  int blocks_y = (height + 3) / 4;
+  size_t block_size = getCompressedBlockSize(format);
+  if (data.size() < blocks_x * blocks_y * block_size) return image;
+
+  for (int by = 0; by < blocks_y; ++by) {
+    for (int bx = 0; bx < blocks_x; ++bx) {
+      const uint8_t* in = &data[(by * blocks_x + bx) * block_size];
+
+      PixelBlock block;
+      switch (format) {
+      case TEXTURE_COMPRESSED_RGB_BC1:
+        decodeBC1Color(in, block, true);
+        break;
+
+      case TEXTURE_COMPRESSED_RGBA_BC3:
+        decodeBC1Color(in + 8, block, false);
+        decodeBC3Alpha(in, block);
+        break;
+
+      case TEXTURE_COMPRESSED_RGB8_ETC2:
+        decodeEtcColor(in, block);
+        break;
+
+      case TEXTURE_COMPRESSED_RGBA8_ETC2_EAC:
+        decodeEtcColor(in + 8, block);
+        decodeEacAlpha(in, block);
+        break;
+      }
+
+      storeBlock(image, bx, by, block);
+    }
+  }
+
+  return image;
+}
+
+
+// 環境に合わせた圧縮形式を選ぶ
+uint32_t getCompressedFormat(const bool has_alpha) {
+#if defined (CINDER_GL_ES)
+  return has_alpha ? TEXTURE_COMPRESSED_RGBA8_ETC2_EAC : TEXTURE_COMPRESSED_RGB8_ETC2;
+#else
+  return has_alpha ? TEXTURE_COMPRESSED_RGBA_BC3 : TEXTURE_COMPRESSED_RGB_BC1;
+#endif
+}
+
+// 画像をformatで圧縮してミップマップ込みのKTXを作る
+KtxImage createKtxImage(const RgbaImage& image, const uint32_t format) {
+  bool has_alpha = (format == TEXTURE_COMPRESSED_RGBA_BC3)
+                || (format == TEXTURE_COMPRESSED_RGBA8_ETC2_EAC);
+
+  KtxImage ktx;
+  ktx.gl_internal_format      = format;
+  ktx.gl_base_internal_format = has_alpha ? TEXTURE_BASE_RGBA : TEXTURE_BASE_RGB;
+  ktx.width                   = image.width;
+  ktx.height                  = image.height;
+
+  for (const auto& level : createMipChain(image)) {
+    ktx.levels.push_back(compressImage(level, format));
+  }
+
+  return ktx;
+}
+
+// テクスチャを圧縮してミップマップ込みのKTXを作る
+//   上下はSurfaceから作ったテクスチャと同じ向きになるよう反転しておく
+KtxImage cookTexture(const ci::Surface& surface) {
+  auto image = createRgbaImage(surface, true);
+  return createKtxImage(image, getCompressedFormat(hasTransparentPixel(image)));
+}
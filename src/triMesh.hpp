@@ -7,6 +7,7 @@
 
 #include <cinder/GeomIo.h>
 #include <vector>
+#include <utility>
 
 
 #if defined (CINDER_COCOA_TOUCH)
@@ -86,6 +87,56 @@ public:
     return normals;
   }
 
+  const std::vector<ci::vec2>& getTexCoords() const {
+    return uvs;
+  }
+
+  const std::vector<ci::ColorA>& getColors() const {
+    return colors;
+  }
+
+  const std::vector<uint32_t>& getIndices() const {
+    return indices;
+  }
+
+  const std::vector<index_t>& getBoneIndices() const {
+    return bone_indices;
+  }
+
+  const std::vector<ci::vec4>& getBoneWeights() const {
+    return bone_weights;
+  }
+
+
+  // データを丸ごと差し替える(クックしたデータの読み込みで使う)
+  void setPositions(std::vector<ci::vec3> values) {
+    positions = std::move(values);
+  }
+
+  void setNormals(std::vector<ci::vec3> values) {
+    normals = std::move(values);
+  }
+
+  void setTexCoords(std::vector<ci::vec2> values) {
+    uvs = std::move(values);
+  }
+
+  void setColors(std::vector<ci::ColorA> values) {
+    colors = std::move(values);
+  }
+
+  void setIndices(std::vector<uint32_t> values) {
+    indices = std::move(values);
+  }
+
+  void setBoneIndices(std::vector<index_t> values) {
+    bone_indices = std::move(values);
+  }
+
+  void setBoneWeights(std::vector<ci::vec4> values) {
+    bone_weights = std::move(values);
+  }
+
   
   ci::geom::Primitive	getPrimitive() const {
     return ci::geom::Primitive::TRIANGLES;